@@ -0,0 +1,59 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Counts allocations made by the code under test. The linker sends calls to
+ * malloc/calloc/realloc here (`--wrap`), and they're passed on to libc.
+ **/
+
+#include "bench-alloc.h"
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+/**
+ * Number of allocations so far (single-threaded benchmarks only)
+ **/
+static unsigned long allocations = 0;
+
+void *__wrap_malloc(size_t size)
+{
+    allocations++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    allocations++;
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    allocations++;
+    return __real_realloc(ptr, size);
+}
+
+/**
+ * Get the number of allocations made so far
+ **/
+unsigned long bench_alloc_count(void)
+{
+    return allocations;
+}
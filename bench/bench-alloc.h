@@ -0,0 +1,34 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef BENCH_ALLOC_H
+#define BENCH_ALLOC_H
+
+#include <stddef.h>
+
+/**
+ * Benchmarks linked with `bench_alloc_args` (see meson.build) have every call
+ * to these from their own objects counted
+ **/
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t count, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+
+unsigned long bench_alloc_count(void);
+
+#endif
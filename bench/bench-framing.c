@@ -0,0 +1,134 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Microbenchmark for the line framing used by the query handler: pipelined
+ * requests arrive in read-sized chunks, and each complete line is taken out
+ * with `ring_buffer_take_line`, as `query_handler_handle_message` does.
+ **/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench-alloc.h"
+#include "query-handler.h"
+#include "ring-buffer.h"
+
+/**
+ * How much data arrives per simulated read
+ **/
+#define BENCH_READ_CHUNK 4096
+
+/**
+ * Total number of requests framed for each batch size
+ **/
+#define BENCH_TOTAL_REQUESTS (1 << 22)
+
+static const char request[] = "status\n";
+
+/**
+ * Get the current monotonic time in nanoseconds
+ **/
+static long long bench_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Frame every complete line in `in`, continuing the scan from `*scanned`
+ *
+ * Returns the number of lines framed
+ **/
+static long bench_frame_lines(struct ring_buffer *in, size_t *scanned)
+{
+    char parse_buff[QUERY_HANDLER_MAX_REQUEST_LENGTH + 1];
+    long framed = 0;
+
+    while (ring_buffer_take_line(in, scanned, parse_buff, sizeof(parse_buff)) \
+            != -1
+    ) {
+        framed++;
+    }
+
+    return framed;
+}
+
+/**
+ * Frame `BENCH_TOTAL_REQUESTS` requests, sent in pipelined batches of `batch`
+ * requests each, and print the throughput
+ **/
+static void bench_batch(long batch)
+{
+    size_t batch_len = batch * (sizeof(request) - 1);
+    char *wire = malloc(batch_len);
+    struct ring_buffer in = {0};
+    long framed = 0;
+
+    for (long i = 0; i < batch; i++) {
+        memcpy(&(wire[i * (sizeof(request) - 1)]), request, sizeof(request) - 1);
+    }
+
+    unsigned long allocations = bench_alloc_count();
+    long long start_ns = bench_now_ns();
+
+    for (long sent = 0; sent < BENCH_TOTAL_REQUESTS; sent += batch) {
+        size_t scanned = 0;
+
+        for (size_t offset = 0; offset < batch_len; offset += BENCH_READ_CHUNK) {
+            size_t chunk = batch_len - offset;
+
+            if (chunk > BENCH_READ_CHUNK) {
+                chunk = BENCH_READ_CHUNK;
+            }
+
+            ring_buffer_write(&in, &(wire[offset]), chunk);
+            framed += bench_frame_lines(&in, &scanned);
+        }
+    }
+
+    long long elapsed_ns = bench_now_ns() - start_ns;
+    allocations = bench_alloc_count() - allocations;
+
+    printf(
+        "batch %6li: %12.0f requests/s (%6.1f ns/request, "
+        "%.4f allocs/request)\n",
+        batch,
+        framed * 1e9 / elapsed_ns,
+        (double)elapsed_ns / framed,
+        (double)allocations / framed
+    );
+
+    ring_buffer_free(&in);
+    free(wire);
+}
+
+int main(int argc, char *argv[])
+{
+    long batches[] = {1, 16, 256, 4096, 65536};
+
+    for (size_t i = 0; i < sizeof(batches)/sizeof(batches[0]); i++) {
+        bench_batch(batches[i]);
+    }
+
+    return 0;
+}
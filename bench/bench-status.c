@@ -0,0 +1,198 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Benchmark for the safety tracker as the daemon uses it (see
+ * safety-tracker.c): the cost of each `tracker_provide_*` update, and of
+ * getting the status JSON, both cached and freshly rendered. Each is run with
+ * the default periods, then with a config of 64 periods.
+ **/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench-alloc.h"
+#include "safety-tracker.h"
+
+#define BENCH_NS_PER_MS 1000000LL
+
+/**
+ * Number of operations timed for each benchmark
+ **/
+#define BENCH_OPERATIONS (1L << 21)
+
+/**
+ * Number of periods in the large config
+ **/
+#define BENCH_LARGE_PERIODS 64
+
+/**
+ * Get the current monotonic time in nanoseconds
+ **/
+static long long bench_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * A single operation on the tracker
+ **/
+typedef void (*bench_operation)(long i);
+
+/**
+ * A little activity (well short of every limit, eventually beyond them)
+ **/
+static void bench_provide_active(long i)
+{
+    tracker_provide_active_ns(BENCH_NS_PER_MS);
+}
+
+/**
+ * A short idle time, which doesn't clear anything
+ **/
+static void bench_provide_idle(long i)
+{
+    tracker_provide_idle_ns(100 * BENCH_NS_PER_MS);
+}
+
+/**
+ * A little activity, then a long enough break to clear everything
+ **/
+static void bench_active_then_break(long i)
+{
+    tracker_provide_active_ns(BENCH_NS_PER_MS);
+    tracker_provide_idle_ns(24 * 60 * 60 * 1000 * BENCH_NS_PER_MS);
+}
+
+/**
+ * Ask for the status when nothing has changed
+ **/
+static void bench_status_cached(long i)
+{
+    int len;
+    tracker_get_status_json(&len);
+}
+
+/**
+ * A second of activity (so the status changes), then ask for the status
+ **/
+static void bench_status_render(long i)
+{
+    int len;
+
+    tracker_provide_active_ns(1000 * BENCH_NS_PER_MS);
+    tracker_get_status_json(&len);
+}
+
+/**
+ * Time `operation`, and print the cost of each call
+ **/
+static void bench_run(const char *name, bench_operation operation)
+{
+    /* Warm up (e.g. the first render allocates its buffer) */
+    operation(0);
+
+    unsigned long allocations = bench_alloc_count();
+    long long start_ns = bench_now_ns();
+
+    for (long i = 0; i < BENCH_OPERATIONS; i++) {
+        operation(i);
+    }
+
+    long long elapsed_ns = bench_now_ns() - start_ns;
+    allocations = bench_alloc_count() - allocations;
+
+    printf(
+        "%3i periods, %-18s: %8.1f ns/op, %6.3f allocs/op\n",
+        tracker_count_periods(),
+        name,
+        (double)elapsed_ns / BENCH_OPERATIONS,
+        (double)allocations / BENCH_OPERATIONS
+    );
+}
+
+/**
+ * Run every benchmark on the periods currently loaded
+ **/
+static void bench_all(void)
+{
+    bench_run("provide_active", bench_provide_active);
+    bench_run("provide_idle", bench_provide_idle);
+    bench_run("active + break", bench_active_then_break);
+    bench_run("status (cached)", bench_status_cached);
+    bench_run("status (rendered)", bench_status_render);
+}
+
+/**
+ * Write a config with `BENCH_LARGE_PERIODS` periods to a temporary file, and
+ * load it
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+static int bench_load_large_config(void)
+{
+    char path[] = "/tmp/norsi-bench-XXXXXX";
+    int fd = mkstemp(path);
+    FILE *config;
+    int rc;
+
+    if (fd == -1 || (config = fdopen(fd, "w")) == NULL) {
+        return -1;
+    }
+
+    for (int i = 0; i < BENCH_LARGE_PERIODS; i++) {
+        fprintf(
+            config, "period p%i %im %is %im\n", i, 1 + i * 7, i % 4 * 15, 1 + i
+        );
+    }
+    fclose(config);
+
+    rc = tracker_load_config(path);
+    unlink(path);
+
+    return rc == 0 ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    /* Don't pick up the user's own config */
+    setenv("XDG_CONFIG_HOME", "/nonexistent", 1);
+
+    if (tracker_init() == -1) {
+        return 1;
+    }
+    bench_all();
+
+    if (bench_load_large_config() == -1) {
+        fprintf(stderr, "unable to load the large config\n");
+        tracker_cleanup();
+        return 1;
+    }
+    bench_all();
+
+    tracker_cleanup();
+
+    return 0;
+}
@@ -0,0 +1,171 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Microbenchmark for the tracker's update loops (see tracker-kernel.c): a mix
+ * of active and idle updates is applied to 8, 64 and 1024 periods with each
+ * implementation this CPU supports. The results of every implementation are
+ * checked against each other.
+ **/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tracker-kernel.h"
+
+#define BENCH_NS_PER_SECOND 1000000000LL
+
+/**
+ * Total number of per-period updates applied for each period count
+ **/
+#define BENCH_TOTAL_PERIOD_UPDATES (1L << 28)
+
+/**
+ * Get the current monotonic time in nanoseconds
+ **/
+static long long bench_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Fill `periods` with `count` made-up periods, from a few seconds up to a few
+ * hours long
+ **/
+static void bench_make_periods(struct tracker_kernel_periods *periods,
+    int count)
+{
+    int64_t *limit_ns = malloc(count * sizeof(int64_t));
+    int64_t *reset_ns = malloc(count * sizeof(int64_t));
+    int64_t *break_ns = malloc(count * sizeof(int64_t));
+
+    for (int i = 0; i < count; i++) {
+        limit_ns[i] = (60 + (i * 7919) % 14400) * BENCH_NS_PER_SECOND;
+        break_ns[i] = (10 + (i * 104729) % 600) * BENCH_NS_PER_SECOND;
+        reset_ns[i] = i % 3 == 0 ? break_ns[i] / 2 : 0;
+    }
+
+    periods->count = count;
+    periods->limit_ns = limit_ns;
+    periods->reset_ns = reset_ns;
+    periods->break_ns = break_ns;
+    periods->active_ns = calloc(count, sizeof(int64_t));
+}
+
+/**
+ * Apply `rounds` rounds of updates: mostly activity (a few seconds at a time,
+ * with some fraction of a second), with an idle stretch of some length every
+ * few rounds
+ *
+ * Returns how many updates cleared something, or took some period beyond its
+ * limit
+ **/
+static long bench_run(const struct tracker_kernel_periods *periods,
+    long rounds)
+{
+    long changes = 0;
+
+    for (long r = 0; r < rounds; r++) {
+        if (r % 4 == 3) {
+            changes += tracker_kernel_idle(
+                periods, (r * 37) % 700 * BENCH_NS_PER_SECOND
+            ) != 0;
+        } else {
+            changes += tracker_kernel_active(
+                periods, (1 + r % 5) * BENCH_NS_PER_SECOND + r % 999999937
+            ) != 0;
+        }
+    }
+
+    return changes;
+}
+
+/**
+ * Time every implementation on `count` periods, and print the throughput
+ **/
+static int bench_count(int count)
+{
+    struct tracker_kernel_periods periods;
+    long rounds = BENCH_TOTAL_PERIOD_UPDATES / count;
+    int64_t *expected = malloc(count * sizeof(int64_t));
+    long expected_changes = -1;
+    int rc = 0;
+
+    bench_make_periods(&periods, count);
+
+    /* Every implementation has to end up where the first one did */
+    for (int k = 0; tracker_kernel_list(k) != NULL; k++) {
+        if (tracker_kernel_select(tracker_kernel_list(k)) == -1) {
+            continue;
+        }
+        memset(periods.active_ns, 0, count * sizeof(int64_t));
+
+        long long start_ns = bench_now_ns();
+        long changes = bench_run(&periods, rounds);
+        long long elapsed_ns = bench_now_ns() - start_ns;
+
+        printf(
+            "%4i periods, %-6s: %12.0f updates/s (%8.1f ns/update)\n",
+            count,
+            tracker_kernel_name(),
+            rounds * 1e9 / elapsed_ns,
+            (double)elapsed_ns / rounds
+        );
+
+        if (expected_changes == -1) {
+            memcpy(expected, periods.active_ns, count * sizeof(int64_t));
+            expected_changes = changes;
+        } else if (changes != expected_changes || memcmp(
+                expected, periods.active_ns, count * sizeof(int64_t)
+            ) != 0
+        ) {
+            fprintf(stderr, "%s disagrees with %s\n",
+                tracker_kernel_name(), tracker_kernel_list(0)
+            );
+            rc = -1;
+        }
+    }
+
+    free((void *)periods.limit_ns);
+    free((void *)periods.reset_ns);
+    free((void *)periods.break_ns);
+    free(periods.active_ns);
+    free(expected);
+
+    return rc;
+}
+
+int main(int argc, char *argv[])
+{
+    int counts[] = {8, 64, 1024};
+    int rc = 0;
+
+    for (size_t i = 0; i < sizeof(counts)/sizeof(counts[0]); i++) {
+        if (bench_count(counts[i]) == -1) {
+            rc = 1;
+        }
+    }
+
+    return rc;
+}
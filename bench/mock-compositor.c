@@ -0,0 +1,889 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * A tiny wayland compositor for integration tests and benchmarks. It offers a
+ * seat and KDE's idle protocol (protocol/idle.xml), starts the daemon against
+ * it (with its own runtime/state/config folders), subscribes to the daemon's
+ * status, then sends storms of scripted idle/resumed events.
+ *
+ * Each cycle tells every timeout that the user is active, then that they've
+ * been idle for as long as the timeout is (shortest first). The config given
+ * to the daemon resets its only period after 1s of idleness, so every cycle
+ * changes the status. The time from sending a cycle until the daemon pushes
+ * the new status is measured, along with the CPU time the daemon used.
+ *
+ * With -c, there are no idle events. Instead that many clients each send
+ * `status` requests, waiting for each answer before sending the next, to
+ * measure how many requests the daemon can answer per second.
+ *
+ * Usage: mock-compositor [-n COUNT] [-r CYCLES_PER_SECOND] [-c CLIENTS] [-v]
+ *     DAEMON
+ *
+ * COUNT is the number of cycles (or of status requests, with -c) in total. A
+ * rate of 0 (the default) sends each cycle as soon as the last one has been
+ * answered. With -v the daemon's output isn't hidden. Exits with a non-zero
+ * status if the daemon stops answering.
+ **/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server.h>
+
+#include "idle-server-protocol.h"
+
+#define MOCK_NS_PER_SECOND 1000000000LL
+
+/**
+ * How long the daemon has to start up, or to answer a cycle (ms)
+ **/
+#define MOCK_TIMEOUT_MS 5000
+
+/**
+ * How often to try connecting to the daemon while it starts up (ms)
+ **/
+#define MOCK_CONNECT_INTERVAL_MS 10
+
+/**
+ * Handed to the daemon so every cycle resets a period (see above)
+ **/
+#define MOCK_CONFIG "period storm 1h 1s 2s\n"
+
+/**
+ * An idle timeout the daemon asked for
+ **/
+struct mock_timeout {
+    struct wl_resource *resource;
+    /* How long the user has to be idle before it fires (ms) */
+    uint32_t timeout_ms;
+    /* In `timeouts`, ordered from shortest to longest */
+    struct wl_list link;
+};
+
+static struct wl_display *display = NULL;
+static struct wl_event_loop *loop = NULL;
+static struct wl_list timeouts;
+
+/**
+ * Timers for the next cycle, for giving up on the daemon, and for connecting
+ **/
+static struct wl_event_source *cycle_timer = NULL;
+static struct wl_event_source *watchdog_timer = NULL;
+static struct wl_event_source *connect_timer = NULL;
+
+/**
+ * A client sending status requests (with -c)
+ **/
+struct mock_client {
+    int fd;
+    struct wl_event_source *source;
+    /* When the request it's waiting on was sent */
+    long long sent_ns;
+};
+
+static struct mock_client *clients = NULL;
+static int client_count = 0;
+
+/**
+ * Connection to the daemon's query socket, once it's up
+ **/
+static int status_fd = -1;
+static struct wl_event_source *status_source = NULL;
+static char status_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+/**
+ * Root of the folders made for the daemon
+ **/
+static char root[] = "/tmp/norsi-mock-XXXXXX";
+
+static pid_t daemon_pid = -1;
+
+/**
+ * Progress through the run (cycles are status requests with -c)
+ **/
+static int cycle_count = 1000;
+static int cycles_per_second = 0;
+static int cycles_sent = 0;
+static int cycles_answered = 0;
+static int subscribed = 0;
+static int failed = 0;
+static long long start_ns = 0;
+static long long sent_ns = 0;
+static long long *latency_ns = NULL;
+
+static void mock_start_clients(void);
+
+/**
+ * Get the current monotonic time in nanoseconds
+ **/
+static long long mock_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * MOCK_NS_PER_SECOND + now.tv_nsec;
+}
+
+/**
+ * Stop the run (the event loop is left once the current dispatch is over)
+ **/
+static void mock_finish(int failure)
+{
+    failed |= failure;
+    wl_display_terminate(display);
+}
+
+/*******************************************************************************
+ * Wayland globals
+ ******************************************************************************/
+
+static void mock_timeout_release(struct wl_client *client,
+    struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static void mock_timeout_simulate_user_activity(struct wl_client *client,
+    struct wl_resource *resource)
+{
+    /* Nothing to simulate */
+}
+
+static const struct org_kde_kwin_idle_timeout_interface mock_timeout_impl = {
+    .release = mock_timeout_release,
+    .simulate_user_activity = mock_timeout_simulate_user_activity,
+};
+
+static void mock_timeout_destroy(struct wl_resource *resource)
+{
+    struct mock_timeout *timeout = wl_resource_get_user_data(resource);
+
+    wl_list_remove(&(timeout->link));
+    free(timeout);
+}
+
+static void mock_idle_get_idle_timeout(struct wl_client *client,
+    struct wl_resource *resource, uint32_t id, struct wl_resource *seat,
+    uint32_t timeout_ms)
+{
+    struct mock_timeout *timeout = calloc(1, sizeof(*timeout));
+    struct mock_timeout *next;
+
+    if (timeout == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    timeout->timeout_ms = timeout_ms;
+    timeout->resource = wl_resource_create(
+        client, &org_kde_kwin_idle_timeout_interface, 1, id
+    );
+    if (timeout->resource == NULL) {
+        free(timeout);
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(
+        timeout->resource, &mock_timeout_impl, timeout, mock_timeout_destroy
+    );
+
+    /* Keep the list in the order timeouts fire */
+    wl_list_for_each(next, &timeouts, link) {
+        if (next->timeout_ms > timeout_ms) {
+            break;
+        }
+    }
+    wl_list_insert(next->link.prev, &(timeout->link));
+}
+
+static const struct org_kde_kwin_idle_interface mock_idle_impl = {
+    .get_idle_timeout = mock_idle_get_idle_timeout,
+};
+
+static void mock_idle_bind(struct wl_client *client, void *data,
+    uint32_t version, uint32_t id)
+{
+    struct wl_resource *resource = wl_resource_create(
+        client, &org_kde_kwin_idle_interface, version, id
+    );
+
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(resource, &mock_idle_impl, NULL, NULL);
+}
+
+/**
+ * The seat has no capabilities, so its devices are never asked for. If they
+ * are, they get an inert object.
+ **/
+static void mock_seat_get_device(struct wl_client *client,
+    struct wl_resource *resource, const struct wl_interface *interface,
+    uint32_t id)
+{
+    struct wl_resource *device = wl_resource_create(
+        client, interface, wl_resource_get_version(resource), id
+    );
+
+    if (device == NULL) {
+        wl_client_post_no_memory(client);
+    }
+}
+
+static void mock_seat_get_pointer(struct wl_client *client,
+    struct wl_resource *resource, uint32_t id)
+{
+    mock_seat_get_device(client, resource, &wl_pointer_interface, id);
+}
+
+static void mock_seat_get_keyboard(struct wl_client *client,
+    struct wl_resource *resource, uint32_t id)
+{
+    mock_seat_get_device(client, resource, &wl_keyboard_interface, id);
+}
+
+static void mock_seat_get_touch(struct wl_client *client,
+    struct wl_resource *resource, uint32_t id)
+{
+    mock_seat_get_device(client, resource, &wl_touch_interface, id);
+}
+
+static void mock_seat_release(struct wl_client *client,
+    struct wl_resource *resource)
+{
+    wl_resource_destroy(resource);
+}
+
+static const struct wl_seat_interface mock_seat_impl = {
+    .get_pointer = mock_seat_get_pointer,
+    .get_keyboard = mock_seat_get_keyboard,
+    .get_touch = mock_seat_get_touch,
+    .release = mock_seat_release,
+};
+
+static void mock_seat_bind(struct wl_client *client, void *data,
+    uint32_t version, uint32_t id)
+{
+    struct wl_resource *resource = wl_resource_create(
+        client, &wl_seat_interface, version, id
+    );
+
+    if (resource == NULL) {
+        wl_client_post_no_memory(client);
+        return;
+    }
+
+    wl_resource_set_implementation(resource, &mock_seat_impl, NULL, NULL);
+
+    wl_seat_send_capabilities(resource, 0);
+    if (version >= WL_SEAT_NAME_SINCE_VERSION) {
+        wl_seat_send_name(resource, "seat0");
+    }
+}
+
+/*******************************************************************************
+ * Storms
+ ******************************************************************************/
+
+/**
+ * Send one cycle of activity then idleness to every timeout
+ **/
+static void mock_send_cycle(void)
+{
+    struct mock_timeout *timeout;
+
+    wl_list_for_each(timeout, &timeouts, link) {
+        org_kde_kwin_idle_timeout_send_resumed(timeout->resource);
+    }
+    wl_list_for_each(timeout, &timeouts, link) {
+        org_kde_kwin_idle_timeout_send_idle(timeout->resource);
+    }
+
+    wl_display_flush_clients(display);
+
+    sent_ns = mock_now_ns();
+    cycles_sent++;
+    wl_event_source_timer_update(watchdog_timer, MOCK_TIMEOUT_MS);
+}
+
+/**
+ * Send the next cycle now, or arm the timer for when it's due
+ **/
+static void mock_schedule_cycle(void)
+{
+    long long due_ns = 0;
+
+    if (cycles_per_second > 0) {
+        due_ns = start_ns + \
+            cycles_sent * MOCK_NS_PER_SECOND / cycles_per_second;
+    }
+
+    long long wait_ms = (due_ns - mock_now_ns() + 999999) / 1000000;
+
+    if (wait_ms <= 0) {
+        mock_send_cycle();
+    } else {
+        wl_event_source_timer_update(cycle_timer, wait_ms);
+    }
+}
+
+static int mock_cycle_due(void *data)
+{
+    mock_send_cycle();
+    return 0;
+}
+
+static int mock_watchdog(void *data)
+{
+    fprintf(
+        stderr, "daemon didn't answer (%i/%i cycles answered)\n",
+        cycles_answered, cycle_count
+    );
+    mock_finish(1);
+    return 0;
+}
+
+/**
+ * Handle a status line pushed by the daemon
+ **/
+static void mock_status_line(void)
+{
+    if (!subscribed) {
+        /* The first push comes straight after subscribing */
+        if (wl_list_empty(&timeouts)) {
+            fprintf(stderr, "daemon didn't ask for any idle timeouts\n");
+            mock_finish(1);
+            return;
+        }
+
+        subscribed = 1;
+        start_ns = mock_now_ns();
+        if (client_count > 0) {
+            mock_start_clients();
+        } else {
+            mock_schedule_cycle();
+        }
+        return;
+    }
+
+    if (client_count > 0 || cycles_answered == cycles_sent) {
+        /* Not caused by a cycle */
+        return;
+    }
+
+    latency_ns[cycles_answered++] = mock_now_ns() - sent_ns;
+    wl_event_source_timer_update(watchdog_timer, 0);
+
+    if (cycles_answered == cycle_count) {
+        mock_finish(0);
+    } else {
+        mock_schedule_cycle();
+    }
+}
+
+/**
+ * Read whatever the daemon has sent on `fd`
+ *
+ * Returns the number of lines that were completed, or -1 if the connection
+ * was lost
+ **/
+static int mock_read_lines(int fd)
+{
+    char buffer[4096];
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    int lines = 0;
+
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (n <= 0) {
+        fprintf(stderr, "lost connection to the daemon\n");
+        mock_finish(1);
+        return -1;
+    }
+
+    for (ssize_t i = 0; i < n; i++) {
+        lines += buffer[i] == '\n';
+    }
+
+    return lines;
+}
+
+static int mock_status_ready(int fd, uint32_t mask, void *data)
+{
+    for (int lines = mock_read_lines(fd); lines > 0; lines--) {
+        mock_status_line();
+    }
+
+    return 0;
+}
+
+/**
+ * Connect to the daemon's query socket
+ *
+ * Returns the FD, or -1 if it isn't listening (yet)
+ **/
+static int mock_open_socket(void)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    strcpy(addr.sun_path, status_path);
+
+    if (fd != -1 && \
+            connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+    ) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+/**
+ * Keep trying to subscribe to the daemon's status until it's listening
+ **/
+static int mock_connect(void *data)
+{
+    static const char request[] = "subscribe\n";
+    int fd = mock_open_socket();
+
+    if (fd == -1) {
+        wl_event_source_timer_update(connect_timer, MOCK_CONNECT_INTERVAL_MS);
+        return 0;
+    }
+
+    if (write(fd, request, sizeof(request) - 1) != sizeof(request) - 1) {
+        fprintf(stderr, "unable to subscribe (%s)\n", strerror(errno));
+        close(fd);
+        mock_finish(1);
+        return 0;
+    }
+
+    status_fd = fd;
+    status_source = wl_event_loop_add_fd(
+        loop, fd, WL_EVENT_READABLE, mock_status_ready, NULL
+    );
+
+    return 0;
+}
+
+/*******************************************************************************
+ * Status requests
+ ******************************************************************************/
+
+/**
+ * Send a status request from `client`, if there are any left to send
+ **/
+static void mock_send_request(struct mock_client *client)
+{
+    static const char request[] = "status\n";
+
+    if (cycles_sent == cycle_count) {
+        return;
+    }
+
+    client->sent_ns = mock_now_ns();
+    cycles_sent++;
+
+    if (write(client->fd, request, sizeof(request) - 1) != \
+            sizeof(request) - 1
+    ) {
+        fprintf(stderr, "unable to send a request (%s)\n", strerror(errno));
+        mock_finish(1);
+    }
+}
+
+static int mock_client_ready(int fd, uint32_t mask, void *data)
+{
+    struct mock_client *client = data;
+    int lines = mock_read_lines(fd);
+
+    if (lines <= 0) {
+        return 0;
+    }
+
+    /* Only one request is ever waiting on an answer */
+    latency_ns[cycles_answered++] = mock_now_ns() - client->sent_ns;
+    wl_event_source_timer_update(watchdog_timer, MOCK_TIMEOUT_MS);
+
+    if (cycles_answered == cycle_count) {
+        mock_finish(0);
+    } else {
+        mock_send_request(client);
+    }
+
+    return 0;
+}
+
+/**
+ * Connect every client, and have each of them send its first request
+ **/
+static void mock_start_clients(void)
+{
+    clients = calloc(client_count, sizeof(*clients));
+    if (clients == NULL) {
+        fprintf(stderr, "unable to set up clients\n");
+        mock_finish(1);
+        return;
+    }
+    for (int i = 0; i < client_count; i++) {
+        clients[i].fd = -1;
+    }
+
+    for (int i = 0; i < client_count; i++) {
+        clients[i].fd = mock_open_socket();
+
+        if (clients[i].fd == -1) {
+            fprintf(
+                stderr, "unable to connect client %i (%s)\n", i,
+                strerror(errno)
+            );
+            mock_finish(1);
+            return;
+        }
+
+        clients[i].source = wl_event_loop_add_fd(
+            loop, clients[i].fd, WL_EVENT_READABLE, mock_client_ready,
+            &(clients[i])
+        );
+    }
+
+    start_ns = mock_now_ns();
+    for (int i = 0; i < client_count; i++) {
+        mock_send_request(&(clients[i]));
+    }
+}
+
+/*******************************************************************************
+ * Set-up
+ ******************************************************************************/
+
+/**
+ * Make `<root>/<name>` for the daemon, and point `variable` at it
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+static int mock_make_folder(const char *variable, const char *name)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/%s", root, name);
+    if (mkdir(path, 0700) == -1) {
+        return -1;
+    }
+
+    return setenv(variable, path, 1);
+}
+
+/**
+ * Write the config file for the daemon
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+static int mock_write_config(void)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s/config/norsi", root);
+    if (mkdir(path, 0700) == -1) {
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), "%s/config/norsi/config", root);
+
+    FILE *config = fopen(path, "w");
+    if (config == NULL) {
+        return -1;
+    }
+
+    fputs(MOCK_CONFIG, config);
+
+    return fclose(config) == 0 ? 0 : -1;
+}
+
+/**
+ * Delete everything under (and including) `path`
+ **/
+static void mock_remove_tree(const char *path)
+{
+    struct stat info;
+    DIR *dir;
+
+    if (lstat(path, &info) == -1) {
+        return;
+    }
+
+    if (S_ISDIR(info.st_mode) && (dir = opendir(path)) != NULL) {
+        struct dirent *entry;
+
+        while ((entry = readdir(dir)) != NULL) {
+            char child[PATH_MAX];
+
+            if (strcmp(entry->d_name, ".") == 0 || \
+                    strcmp(entry->d_name, "..") == 0
+            ) {
+                continue;
+            }
+
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+            mock_remove_tree(child);
+        }
+
+        closedir(dir);
+        rmdir(path);
+    } else {
+        unlink(path);
+    }
+}
+
+/**
+ * Start the daemon, with its output hidden unless `verbose`
+ *
+ * Returns the PID, or -1 on failure
+ **/
+static pid_t mock_start_daemon(const char *path, int verbose)
+{
+    pid_t pid = fork();
+
+    if (pid != 0) {
+        return pid;
+    }
+
+    if (!verbose) {
+        int null_fd = open("/dev/null", O_WRONLY);
+
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+    }
+
+    execl(path, path, (char *)NULL);
+    _exit(127);
+}
+
+/**
+ * Compare latencies for sorting
+ **/
+static int mock_compare_latency(const void *a, const void *b)
+{
+    long long la = *(const long long *)a;
+    long long lb = *(const long long *)b;
+
+    return (la > lb) - (la < lb);
+}
+
+/**
+ * Print the latency percentiles and the daemon's CPU time
+ **/
+static void mock_report(const struct rusage *usage, long long elapsed_ns)
+{
+    double cpu_s = usage->ru_utime.tv_sec + usage->ru_stime.tv_sec + \
+        (usage->ru_utime.tv_usec + usage->ru_stime.tv_usec) / 1e6;
+
+    qsort(latency_ns, cycles_answered, sizeof(long long), mock_compare_latency);
+
+    double p50_us = latency_ns[cycles_answered / 2] / 1e3;
+    double p99_us = latency_ns[(cycles_answered * 99) / 100] / 1e3;
+    double max_us = latency_ns[cycles_answered - 1] / 1e3;
+
+    if (client_count > 0) {
+        printf(
+            "%i requests from %i clients in %.3fs: %.0f requests/s "
+            "(%.0f ns/request), latency p50 %.1fus, p99 %.1fus, max %.1fus; "
+            "daemon CPU %.3fs (%.0f ns/request)\n",
+            cycles_answered, client_count, elapsed_ns / 1e9,
+            cycles_answered * 1e9 / elapsed_ns,
+            (double)elapsed_ns / cycles_answered,
+            p50_us, p99_us, max_us,
+            cpu_s, cpu_s * 1e9 / cycles_answered
+        );
+        return;
+    }
+
+    printf(
+        "%i cycles (%i timeouts) in %.3fs: latency p50 %.1fus, p99 %.1fus, "
+        "max %.1fus; daemon CPU %.3fs (%.1fus/cycle)\n",
+        cycles_answered, wl_list_length(&timeouts), elapsed_ns / 1e9,
+        p50_us, p99_us, max_us,
+        cpu_s, cpu_s * 1e6 / cycles_answered
+    );
+}
+
+/**
+ * Make sure there are enough FDs for every client (here and in the daemon)
+ **/
+static void mock_raise_fd_limit(void)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && \
+            limit.rlim_cur < (rlim_t)client_count + 64
+    ) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int verbose = 0;
+    int option;
+
+    while ((option = getopt(argc, argv, "n:r:c:v")) != -1) {
+        switch (option) {
+        case 'n':
+            cycle_count = atoi(optarg);
+            break;
+        case 'r':
+            cycles_per_second = atoi(optarg);
+            break;
+        case 'c':
+            client_count = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            optind = argc;
+            break;
+        }
+    }
+
+    if (optind != argc - 1 || cycle_count <= 0 || cycles_per_second < 0 || \
+            client_count < 0
+    ) {
+        fprintf(
+            stderr,
+            "usage: %s [-n COUNT] [-r CYCLES_PER_SECOND] [-c CLIENTS] [-v] "
+            "DAEMON\n",
+            argv[0]
+        );
+        return 1;
+    }
+
+    latency_ns = malloc(cycle_count * sizeof(long long));
+    if (latency_ns == NULL || mkdtemp(root) == NULL) {
+        fprintf(stderr, "unable to set up (%s)\n", strerror(errno));
+        return 1;
+    }
+
+    /* The daemon gets folders of its own, and finds us through them */
+    if (mock_make_folder("XDG_RUNTIME_DIR", "runtime") == -1 || \
+            mock_make_folder("XDG_STATE_HOME", "state") == -1 || \
+            mock_make_folder("XDG_CONFIG_HOME", "config") == -1 || \
+            mock_write_config() == -1
+    ) {
+        fprintf(stderr, "unable to set up %s (%s)\n", root, strerror(errno));
+        mock_remove_tree(root);
+        return 1;
+    }
+    snprintf(
+        status_path, sizeof(status_path), "%s/runtime/norsi/socket.sock", root
+    );
+
+    wl_list_init(&timeouts);
+
+    const char *socket_name = NULL;
+
+    display = wl_display_create();
+    if (display != NULL) {
+        socket_name = wl_display_add_socket_auto(display);
+    }
+    if (socket_name == NULL || \
+            wl_global_create(display, &wl_seat_interface, 7, NULL,
+                mock_seat_bind) == NULL || \
+            wl_global_create(display, &org_kde_kwin_idle_interface, 1, NULL,
+                mock_idle_bind) == NULL
+    ) {
+        fprintf(stderr, "unable to set up the compositor\n");
+        mock_remove_tree(root);
+        return 1;
+    }
+    setenv("WAYLAND_DISPLAY", socket_name, 1);
+
+    loop = wl_display_get_event_loop(display);
+    cycle_timer = wl_event_loop_add_timer(loop, mock_cycle_due, NULL);
+    watchdog_timer = wl_event_loop_add_timer(loop, mock_watchdog, NULL);
+    connect_timer = wl_event_loop_add_timer(loop, mock_connect, NULL);
+
+    mock_raise_fd_limit();
+    daemon_pid = mock_start_daemon(argv[optind], verbose);
+    if (daemon_pid == -1) {
+        fprintf(
+            stderr, "unable to start %s (%s)\n", argv[optind], strerror(errno)
+        );
+        mock_remove_tree(root);
+        return 1;
+    }
+
+    wl_event_source_timer_update(connect_timer, MOCK_CONNECT_INTERVAL_MS);
+    wl_event_source_timer_update(watchdog_timer, MOCK_TIMEOUT_MS);
+
+    wl_display_run(display);
+
+    long long elapsed_ns = mock_now_ns() - start_ns;
+    struct rusage usage;
+
+    /* The daemon saves its state and exits on SIGTERM */
+    kill(daemon_pid, SIGTERM);
+    waitpid(daemon_pid, NULL, 0);
+    getrusage(RUSAGE_CHILDREN, &usage);
+
+    if (cycles_answered > 0) {
+        mock_report(&usage, elapsed_ns);
+    }
+
+    for (int i = 0; clients != NULL && i < client_count; i++) {
+        if (clients[i].source != NULL) {
+            wl_event_source_remove(clients[i].source);
+        }
+        if (clients[i].fd != -1) {
+            close(clients[i].fd);
+        }
+    }
+    free(clients);
+
+    if (status_source != NULL) {
+        wl_event_source_remove(status_source);
+    }
+    if (status_fd != -1) {
+        close(status_fd);
+    }
+    wl_display_destroy(display);
+    mock_remove_tree(root);
+    free(latency_ns);
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Where the daemon gets the time from. Normally this is just CLOCK_MONOTONIC,
+ * but it can be switched over to a virtual clock which only moves when it's
+ * told to (e.g. when replaying recorded activity faster than realtime).
+ **/
+
+#include "clock-source.h"
+
+/**
+ * The virtual time in nanoseconds, or -1 to use the real clock
+ **/
+static int64_t virtual_now_ns = -1;
+
+/**
+ * Get the current (monotonic) time
+ **/
+void clock_source_now(struct timespec *now)
+{
+    if (virtual_now_ns == -1) {
+        clock_gettime(CLOCK_MONOTONIC, now);
+        return;
+    }
+
+    now->tv_sec = virtual_now_ns / 1000000000LL;
+    now->tv_nsec = virtual_now_ns % 1000000000LL;
+}
+
+/**
+ * Switch to the virtual clock (if it isn't already in use), and set it to
+ * `now_ns`
+ **/
+void clock_source_set_virtual(int64_t now_ns)
+{
+    virtual_now_ns = now_ns;
+}
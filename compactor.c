@@ -0,0 +1,497 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Keeps the history folder in shape on a thread of its own, so the event loop
+ * never waits on it:
+ *
+ * - closed segments are packed (see history-codec.c)
+ * - once the history takes up more than its share of the disk, the oldest
+ *   segments are rolled up into the rollup archive and then dropped
+ * - segments the history has written to are synced (and closed once they're
+ *   finished), so the main thread never waits on fdatasync
+ *
+ * The thread sleeps until the history starts a new segment, then makes a
+ * single pass over the folder. Apart from syncing it, it never touches the
+ * segment being appended to, so the only state shared with the main thread is
+ * below (behind `lock`).
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "compactor.h"
+#include "history.h"
+#include "metrics.h"
+#include "rollup.h"
+
+/**
+ * The most disk space the history is allowed to take up
+ **/
+#define COMPACTOR_DISK_CAP_BYTES (64 * 1024 * 1024)
+
+/**
+ * The most finished segments that can be waiting to be closed
+ **/
+#define COMPACTOR_MAX_CLOSING 8
+
+/**
+ * The compactor's thread
+ **/
+static pthread_t thread;
+
+/**
+ * non-zero => `thread` is running
+ **/
+static int thread_started = 0;
+
+/**
+ * Protects everything below
+ **/
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Signalled when there's something for the thread to do
+ **/
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER;
+
+/**
+ * non-zero => the thread should make another pass over the history
+ **/
+static int pass_requested = 0;
+
+/**
+ * non-zero => the thread should finish up
+ **/
+static int stopping = 0;
+
+/**
+ * Base time of the segment being appended to (older segments are closed)
+ **/
+static int64_t current_segment = -1;
+
+/**
+ * Idle time that counts as a break when rolling up dropped segments
+ **/
+static int break_seconds = 0;
+
+/**
+ * FD of the segment being appended to, if it's waiting to be synced (or -1)
+ **/
+static int sync_fd = -1;
+
+/**
+ * FDs of finished segments, waiting to be synced and closed
+ **/
+static int closing_fds[COMPACTOR_MAX_CLOSING];
+
+/**
+ * Number of FDs in `closing_fds`
+ **/
+static int closing_count = 0;
+
+/**
+ * Check if the main thread wants the compactor to stop
+ **/
+static int compactor_stopping(void)
+{
+    pthread_mutex_lock(&lock);
+    int result = stopping;
+    pthread_mutex_unlock(&lock);
+
+    return result;
+}
+
+/**
+ * Sync the segment being appended to (unless `fd` is -1), and sync and close
+ * the finished ones. The history folder is synced too once a segment has been
+ * finished, since a new one was started in it.
+ **/
+static void compactor_sync_segments(int fd, const int *closing, int count)
+{
+    if (fd != -1) {
+        fdatasync(fd);
+    }
+
+    for (int i = 0; i < count; i++) {
+        fdatasync(closing[i]);
+        close(closing[i]);
+    }
+
+    if (count > 0) {
+        history_sync_folder();
+    }
+}
+
+/**
+ * Pack a closed segment, if it isn't packed already. The packed segment is
+ * written under a temporary name and renamed into place before the plain one
+ * is removed, so readers always find one or the other.
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+static int compactor_pack_segment(int64_t base_ms)
+{
+    char plain_path[PATH_MAX];
+    char packed_path[PATH_MAX];
+    char temp_path[PATH_MAX];
+    struct stat info;
+    int packed;
+    int fd = history_open_segment(base_ms, &packed);
+
+    if (fd == -1 || packed) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return fd == -1 ? -1 : 0;
+    }
+
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    unsigned char *plain = malloc(info.st_size > 0 ? info.st_size : 1);
+    unsigned char *packed_data = NULL;
+    size_t packed_len = 0;
+
+    if (plain == NULL || \
+            pread(fd, plain, info.st_size, 0) != info.st_size || \
+            history_pack(plain, info.st_size, &packed_data, &packed_len) == -1
+    ) {
+        fprintf(
+            stderr, "couldn't pack history segment %lld\n", (long long)base_ms
+        );
+        free(plain);
+        close(fd);
+        return -1;
+    }
+    free(plain);
+    close(fd);
+
+    if (history_segment_path(plain_path, base_ms, 0) || \
+            history_segment_path(packed_path, base_ms, 1) || \
+            snprintf(temp_path, PATH_MAX, "%s.new", packed_path) >= PATH_MAX
+    ) {
+        free(packed_data);
+        return -1;
+    }
+
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+
+    if (fd == -1) {
+        fprintf(
+            stderr, "couldn't create %s (%s)\n", temp_path, strerror(errno)
+        );
+        free(packed_data);
+        return -1;
+    }
+
+    int failed = write(fd, packed_data, packed_len) != (ssize_t)packed_len || \
+        fsync(fd) == -1;
+    failed = close(fd) == -1 || failed;
+    free(packed_data);
+
+    if (failed || rename(temp_path, packed_path) == -1) {
+        fprintf(stderr, "couldn't write %s\n", packed_path);
+        unlink(temp_path);
+        return -1;
+    }
+
+    history_sync_folder();
+    unlink(plain_path);
+    metrics_add(METRICS_SEGMENTS_PACKED, 1);
+
+    printf(
+        "packed history segment %lld (%lli -> %zu bytes)\n",
+        (long long)base_ms, (long long)info.st_size, packed_len
+    );
+
+    return 0;
+}
+
+/**
+ * Get the size of a segment on disk
+ **/
+static off_t compactor_segment_size(int64_t base_ms)
+{
+    struct stat info;
+    int fd = history_open_segment(base_ms, NULL);
+
+    if (fd == -1) {
+        return 0;
+    }
+
+    off_t size = fstat(fd, &info) == 0 ? info.st_size : 0;
+    close(fd);
+
+    return size;
+}
+
+/**
+ * Drop the oldest closed segments until the history fits within its cap. Their
+ * activity is rolled up into the archive first, so that reports still cover
+ * them (at a daily resolution).
+ **/
+static void compactor_enforce_cap(const int64_t *bases, int count,
+    int64_t current, int break_after)
+{
+    off_t total = 0;
+    int drop = 0;
+
+    for (int i = 0; i < count; i++) {
+        total += compactor_segment_size(bases[i]);
+    }
+
+    while (total > COMPACTOR_DISK_CAP_BYTES && drop < count - 1 && \
+            bases[drop] < current
+    ) {
+        total -= compactor_segment_size(bases[drop]);
+        drop++;
+    }
+
+    if (drop == 0) {
+        return;
+    }
+
+    struct rollup_set *set = rollup_set_create(break_after);
+
+    if (set == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < drop; i++) {
+        history_replay_segment(bases[i], rollup_set_add_event, set);
+    }
+
+    /* Only drop the segments once the archive is known to cover them */
+    if (rollup_archive(set, bases[drop]) == 0) {
+        for (int i = 0; i < drop; i++) {
+            char path[PATH_MAX];
+
+            for (int packed = 0; packed < 2; packed++) {
+                if (history_segment_path(path, bases[i], packed) == 0) {
+                    unlink(path);
+                }
+            }
+        }
+        history_sync_folder();
+
+        printf("archived %i old history segments\n", drop);
+    } else {
+        fprintf(stderr, "couldn't update rollup archive\n");
+    }
+
+    rollup_set_destroy(set);
+}
+
+/**
+ * Make a single pass over the history folder
+ **/
+static void compactor_pass(int64_t current, int break_after)
+{
+    int64_t *bases;
+    int count = history_scan_segments(&bases);
+
+    if (count == -1) {
+        return;
+    }
+
+    for (int i = 0; i < count && bases[i] < current; i++) {
+        if (compactor_stopping()) {
+            free(bases);
+            return;
+        }
+        compactor_pack_segment(bases[i]);
+    }
+
+    compactor_enforce_cap(bases, count, current, break_after);
+
+    free(bases);
+}
+
+/**
+ * The compactor thread: waits to be woken up, then makes a pass over the
+ * history
+ **/
+static void *compactor_run(void *data)
+{
+    pthread_mutex_lock(&lock);
+
+    while (1) {
+        while (!pass_requested && !stopping && sync_fd == -1 && \
+                closing_count == 0
+        ) {
+            pthread_cond_wait(&wakeup, &lock);
+        }
+
+        /* Syncs come first (even when stopping), so nothing is left unsynced */
+        if (sync_fd != -1 || closing_count > 0) {
+            int fd = sync_fd;
+            int closing[COMPACTOR_MAX_CLOSING];
+            int count = closing_count;
+
+            memcpy(closing, closing_fds, count * sizeof(int));
+            sync_fd = -1;
+            closing_count = 0;
+
+            pthread_mutex_unlock(&lock);
+            compactor_sync_segments(fd, closing, count);
+            pthread_mutex_lock(&lock);
+            continue;
+        }
+
+        if (stopping) {
+            break;
+        }
+
+        int64_t current = current_segment;
+        int break_after = break_seconds;
+        pass_requested = 0;
+
+        pthread_mutex_unlock(&lock);
+        compactor_pass(current, break_after);
+        pthread_mutex_lock(&lock);
+    }
+
+    pthread_mutex_unlock(&lock);
+
+    return NULL;
+}
+
+/**
+ * Call this once at start-up, after the history and rollups are initialized.
+ * The first pass starts straight away.
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+int compactor_start(void)
+{
+    int64_t current = history_get_current_segment();
+
+    if (current == -1) {
+        /* Without a current segment, there's no telling what's closed */
+        return -1;
+    }
+
+    pthread_mutex_lock(&lock);
+    current_segment = current;
+    break_seconds = rollup_get_break_seconds();
+    pass_requested = 1;
+    stopping = 0;
+    pthread_mutex_unlock(&lock);
+
+    /* Signals are left to the main thread (the new thread inherits the mask) */
+    sigset_t all_signals;
+    sigset_t old_mask;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &old_mask);
+
+    int result = pthread_create(&thread, NULL, compactor_run, NULL);
+
+    pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+    if (result != 0) {
+        fprintf(stderr, "couldn't start compactor (%s)\n", strerror(result));
+        return -1;
+    }
+
+    thread_started = 1;
+
+    return 0;
+}
+
+/**
+ * Let the compactor know that a new segment has been started (so the previous
+ * one can be packed)
+ **/
+void compactor_wake(int64_t current_segment_ms)
+{
+    pthread_mutex_lock(&lock);
+    current_segment = current_segment_ms;
+    pass_requested = 1;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Have the compactor make sure everything written to the segment being
+ * appended to has reached the disk (done straight away if it isn't running)
+ **/
+void compactor_sync_segment(int fd)
+{
+    if (!thread_started) {
+        fdatasync(fd);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    sync_fd = fd;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+}
+
+/**
+ * Hand over a finished segment's FD, once the next segment has been started.
+ * The compactor syncs and closes it (this is done straight away if it isn't
+ * running, or has fallen too far behind).
+ **/
+void compactor_close_segment(int fd)
+{
+    if (thread_started) {
+        pthread_mutex_lock(&lock);
+
+        if (closing_count < COMPACTOR_MAX_CLOSING) {
+            closing_fds[closing_count++] = fd;
+            pthread_cond_signal(&wakeup);
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+
+        pthread_mutex_unlock(&lock);
+    }
+
+    compactor_sync_segments(-1, &fd, 1);
+}
+
+/**
+ * Call this before shutting down (it waits for any pass in progress to get to
+ * a safe point, after syncing any segments it was handed)
+ **/
+void compactor_stop(void)
+{
+    if (!thread_started) {
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    stopping = 1;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&lock);
+
+    pthread_join(thread, NULL);
+    thread_started = 0;
+}
@@ -0,0 +1,196 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Watches a single file (the config file) with inotify from the main event
+ * loop, and lets its owner know each time a new version of it is in place.
+ *
+ * The folder is watched rather than the file itself, so that the file can be
+ * created after start-up, and so that editors which save by writing a new file
+ * and renaming it over the old one are noticed. Only completed writes/renames
+ * are reported, never a half-written file.
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "config-watch.h"
+#include "event-loop.h"
+#include "paths.h"
+
+/**
+ * Enough for a burst of events, each with a name no longer than NAME_MAX
+ **/
+#define CONFIG_WATCH_BUFFER_SIZE \
+    (16 * (sizeof(struct inotify_event) + NAME_MAX + 1))
+
+/**
+ * The inotify instance (-1 until initialized)
+ **/
+static int inotify_fd = -1;
+
+/**
+ * The event loop's record of `inotify_fd`
+ **/
+static struct event_source *inotify_source = NULL;
+
+/**
+ * Name of the watched file within its folder (e.g. "config")
+ **/
+static char watched_name[NAME_MAX + 1] = {0};
+
+/**
+ * Called each time the watched file changes
+ **/
+static config_watch_handler changed_handler = NULL;
+static void *changed_data = NULL;
+
+/**
+ * Called by the event loop when there are inotify events to read. A burst of
+ * events (e.g. an editor's write + rename) is reported as a single change.
+ **/
+static void config_watch_ready(int fd, uint32_t events, void *data)
+{
+    _Alignas(struct inotify_event) char buffer[CONFIG_WATCH_BUFFER_SIZE];
+    int changed = 0;
+
+    while (1) {
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+
+        if (len == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN) {
+                fprintf(
+                    stderr, "unable to read config changes (%s)\n",
+                    strerror(errno)
+                );
+            }
+            break;
+        }
+
+        for (char *p = buffer; p < buffer + len; ) {
+            struct inotify_event *event = (struct inotify_event *)p;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                /* Some events were lost, so assume the worst */
+                changed = 1;
+            } else if (event->mask & IN_IGNORED) {
+                fprintf(stderr, "config folder removed, no longer watched\n");
+            } else if (event->len > 0 && \
+                    strcmp(event->name, watched_name) == 0
+            ) {
+                changed = 1;
+            }
+
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    if (changed) {
+        changed_handler(changed_data);
+    }
+}
+
+/**
+ * Start watching the file at `path` (the folder it's in is created if
+ * needed). `handler` is called from the event loop each time a new version of
+ * the file has been written.
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+int config_watch_init(const char *path, config_watch_handler handler,
+    void *data)
+{
+    char folder[PATH_MAX];
+    const char *slash = strrchr(path, '/');
+
+    if (slash == NULL || \
+            (size_t)(slash - path) >= sizeof(folder) || \
+            strlen(slash + 1) >= sizeof(watched_name)
+    ) {
+        fprintf(stderr, "can't watch config file %s\n", path);
+        return -1;
+    }
+
+    memcpy(folder, path, slash - path);
+    folder[slash - path] = '\0';
+    strcpy(watched_name, slash + 1);
+
+    if (paths_make_folders(folder) == -1) {
+        fprintf(
+            stderr, "unable to create %s (%s)\n", folder, strerror(errno)
+        );
+        return -1;
+    }
+
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd == -1) {
+        fprintf(stderr, "unable to set up inotify (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    if (inotify_add_watch(
+            inotify_fd, folder, IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR
+        ) == -1
+    ) {
+        fprintf(
+            stderr, "unable to watch %s (%s)\n", folder, strerror(errno)
+        );
+        config_watch_cleanup();
+        return -1;
+    }
+
+    changed_handler = handler;
+    changed_data = data;
+
+    inotify_source = event_loop_add_fd(
+        inotify_fd, EPOLLIN, config_watch_ready, NULL
+    );
+    if (inotify_source == NULL) {
+        config_watch_cleanup();
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Stop watching the config file
+ **/
+void config_watch_cleanup(void)
+{
+    if (inotify_source != NULL) {
+        event_loop_remove_source(inotify_source);
+        inotify_source = NULL;
+    }
+
+    if (inotify_fd != -1) {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+
+    changed_handler = NULL;
+    changed_data = NULL;
+}
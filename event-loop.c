@@ -0,0 +1,339 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * A single epoll instance which owns every file descriptor the program waits
+ * on (wayland display, query listener, client connections, timers), so that
+ * the process only wakes up when there is actually something to do.
+ **/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "event-loop.h"
+#include "metrics.h"
+
+/**
+ * The maximum number of ready events handled per call to `epoll_wait`
+ **/
+#define EVENT_LOOP_MAX_EVENTS 256
+
+/**
+ * Everything needed to dispatch readiness on a watched FD
+ **/
+struct event_source {
+    /* The watched FD (owned by the event loop for timers) */
+    int fd;
+    /* Handler for plain FDs, or NULL for timers */
+    event_loop_fd_handler fd_handler;
+    /* Handler for timers, or NULL for plain FDs */
+    event_loop_timer_handler timer_handler;
+    /* Passed back to the handler */
+    void *data;
+    /* non-zero => removed during dispatch, waiting to be freed */
+    int removed;
+    /* Next source in the list of sources waiting to be freed */
+    struct event_source *next_removed;
+};
+
+/**
+ * The epoll instance everything is registered with
+ **/
+static int epoll_fd = -1;
+
+/**
+ * Sources removed while events were being dispatched. These can't be freed
+ * straight away because later events from the same `epoll_wait` may still
+ * point at them.
+ **/
+static struct event_source *removed_sources = NULL;
+
+/**
+ * Optional handler called each time the loop wakes up
+ **/
+static event_loop_wakeup_handler wakeup_handler = NULL;
+
+/**
+ * Passed back to `wakeup_handler`
+ **/
+static void *wakeup_handler_data = NULL;
+
+/**
+ * Call this once at start-up, before anything else is added to the loop
+ *
+ * Returns 0 on success, -1 otherwise (check errno)
+ **/
+int event_loop_init(void)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (epoll_fd == -1) {
+        fprintf(
+            stderr, "couldn't create epoll instance (%s)\n", strerror(errno)
+        );
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Set a handler to be called each time the loop wakes up, before the handlers
+ * for any ready sources (e.g. to bring state up to date before it's queried)
+ **/
+void event_loop_set_wakeup_handler(event_loop_wakeup_handler handler,
+    void *data)
+{
+    wakeup_handler = handler;
+    wakeup_handler_data = data;
+}
+
+/**
+ * Register a source with epoll, returning the new source (or NULL on failure)
+ **/
+static struct event_source *event_loop_register(int fd, uint32_t events,
+    event_loop_fd_handler fd_handler, event_loop_timer_handler timer_handler,
+    void *data)
+{
+    struct event_source *source = calloc(1, sizeof(struct event_source));
+
+    if (source == NULL) {
+        return NULL;
+    }
+
+    source->fd = fd;
+    source->fd_handler = fd_handler;
+    source->timer_handler = timer_handler;
+    source->data = data;
+
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = source,
+    };
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        fprintf(
+            stderr, "couldn't add fd=%i to epoll (%s)\n", fd, strerror(errno)
+        );
+        free(source);
+        return NULL;
+    }
+
+    return source;
+}
+
+/**
+ * Start watching `fd` for `events` (EPOLLIN, EPOLLOUT, ...), calling `handler`
+ * whenever any of them are ready. The FD still belongs to the caller.
+ *
+ * Returns the new source, or NULL on failure
+ **/
+struct event_source *event_loop_add_fd(int fd, uint32_t events,
+    event_loop_fd_handler handler, void *data)
+{
+    return event_loop_register(fd, events, handler, NULL, data);
+}
+
+/**
+ * Change the set of events being watched for on a source
+ *
+ * Returns 0 on success, -1 otherwise (check errno)
+ **/
+int event_loop_update_fd(struct event_source *source, uint32_t events)
+{
+    struct epoll_event ev = {
+        .events = events,
+        .data.ptr = source,
+    };
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, source->fd, &ev);
+}
+
+/**
+ * Create a (disarmed) timer which calls `handler` each time it expires
+ *
+ * Returns the new source, or NULL on failure
+ **/
+struct event_source *event_loop_add_timer(event_loop_timer_handler handler,
+    void *data)
+{
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    if (timer_fd == -1) {
+        fprintf(stderr, "couldn't create timer (%s)\n", strerror(errno));
+        return NULL;
+    }
+
+    struct event_source *source = event_loop_register(
+        timer_fd, EPOLLIN, NULL, handler, data
+    );
+
+    if (source == NULL) {
+        close(timer_fd);
+    }
+
+    return source;
+}
+
+/**
+ * Arm a timer to first expire after `initial_ms`, then every `interval_ms`
+ * (or only once if `interval_ms` is 0). An `initial_ms` of 0 disarms it.
+ *
+ * Returns 0 on success, -1 otherwise (check errno)
+ **/
+int event_loop_arm_timer(struct event_source *source, int initial_ms,
+    int interval_ms)
+{
+    struct itimerspec spec = {
+        .it_value = {
+            .tv_sec = initial_ms / 1000,
+            .tv_nsec = (initial_ms % 1000) * 1000000L,
+        },
+        .it_interval = {
+            .tv_sec = interval_ms / 1000,
+            .tv_nsec = (interval_ms % 1000) * 1000000L,
+        },
+    };
+
+    return timerfd_settime(source->fd, 0, &spec, NULL);
+}
+
+/**
+ * Arm a timer to expire once at an absolute CLOCK_MONOTONIC time. A time of
+ * zero disarms it. Without a timer (e.g. when replaying a trace), nothing
+ * happens.
+ *
+ * Returns 0 on success, -1 otherwise (check errno)
+ **/
+int event_loop_arm_timer_at(struct event_source *source,
+    const struct timespec *when)
+{
+    if (source == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    struct itimerspec spec = {
+        .it_value = *when,
+        .it_interval = {0},
+    };
+
+    return timerfd_settime(source->fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/**
+ * Stop watching a source and release it. Timer FDs are closed, other FDs are
+ * left for the caller to close.
+ **/
+void event_loop_remove_source(struct event_source *source)
+{
+    if (source == NULL || source->removed) {
+        return;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+
+    if (source->timer_handler != NULL) {
+        close(source->fd);
+    }
+
+    source->removed = 1;
+    source->next_removed = removed_sources;
+    removed_sources = source;
+}
+
+/**
+ * Free everything that was removed during the last dispatch
+ **/
+static void event_loop_free_removed(void)
+{
+    while (removed_sources != NULL) {
+        struct event_source *next = removed_sources->next_removed;
+        free(removed_sources);
+        removed_sources = next;
+    }
+}
+
+/**
+ * Wait up to `timeout_ms` (or forever if -1) for any source to become ready,
+ * then call the handlers for all of the ready sources.
+ *
+ * Returns the number of sources that were ready, or -1 on failure
+ **/
+int event_loop_dispatch(int timeout_ms)
+{
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+
+    int ready = epoll_wait(epoll_fd, events, EVENT_LOOP_MAX_EVENTS, timeout_ms);
+
+    if (ready == -1) {
+        if (errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed (%s)\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    metrics_add(METRICS_LOOP_WAKEUPS, 1);
+
+    if (wakeup_handler != NULL) {
+        wakeup_handler(wakeup_handler_data);
+    }
+
+    for (int i = 0; i < ready; i++) {
+        struct event_source *source = events[i].data.ptr;
+
+        if (source->removed) {
+            /* an earlier handler stopped watching this source */
+            continue;
+        }
+
+        if (source->timer_handler != NULL) {
+            uint64_t expirations;
+
+            if (read(source->fd, &expirations, sizeof(expirations)) > 0) {
+                source->timer_handler(source->data);
+            }
+        } else {
+            source->fd_handler(source->fd, events[i].events, source->data);
+        }
+    }
+
+    event_loop_free_removed();
+
+    return ready;
+}
+
+/**
+ * Call this before shutting down, after all other modules have removed their
+ * sources.
+ **/
+void event_loop_cleanup(void)
+{
+    event_loop_free_removed();
+
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+}
@@ -0,0 +1,396 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Encoding/decoding of history segments.
+ *
+ * Plain segments (the one being appended to) store each event as a varint of
+ * the zig-zag delta from the previous event, shifted left to make room for the
+ * new state in the lowest bit.
+ *
+ * Once a segment is closed, it can be packed. The states are split out and
+ * run-length encoded as alternating runs of "changed"/"unchanged" (the state
+ * nearly always changes, so this is usually a single varint), which leaves the
+ * deltas a bit smaller. The deltas are stored as varints of the zig-zag delta
+ * plus one, and a 0 introduces a run length for repeats of the last delta.
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "history.h"
+
+/**
+ * A growable buffer used while packing
+ **/
+struct history_codec_buffer {
+    unsigned char *data;
+    size_t len;
+    size_t capacity;
+};
+
+/**
+ * Encode `value` as a LEB128 varint into `out` (which needs room for 10 bytes)
+ *
+ * Returns the number of bytes used
+ **/
+size_t history_encode_varint(uint64_t value, unsigned char *out)
+{
+    size_t len = 0;
+
+    while (value >= 0x80) {
+        out[len++] = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    out[len++] = (unsigned char)value;
+
+    return len;
+}
+
+/**
+ * Decode a LEB128 varint from `data` at `*offset`, stopping at `end`
+ *
+ * Returns 1 if a varint was decoded (and moves `*offset` past it), 0 if it's
+ * incomplete, or -1 if it's too long to be valid
+ **/
+static int history_decode_varint(const unsigned char *data, size_t *offset,
+    size_t end, uint64_t *value)
+{
+    size_t at = *offset;
+
+    *value = 0;
+
+    for (int shift = 0; ; shift += 7) {
+        if (at >= end) {
+            return 0;
+        }
+        if (shift >= 64) {
+            return -1;
+        }
+
+        unsigned char byte = data[at++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+
+        if ((byte & 0x80) == 0) {
+            break;
+        }
+    }
+
+    *offset = at;
+
+    return 1;
+}
+
+static uint64_t history_zigzag(int64_t value)
+{
+    return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t history_unzigzag(uint64_t value)
+{
+    return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/**
+ * Start reading the events from a segment (plain or packed) held in memory
+ *
+ * Returns 0 on success, -1 if `data` isn't a segment
+ **/
+int history_reader_init(struct history_reader *reader, const void *data,
+    size_t len)
+{
+    uint32_t magic;
+
+    memset(reader, 0, sizeof(*reader));
+
+    if (len < sizeof(magic)) {
+        return -1;
+    }
+    memcpy(&magic, data, sizeof(magic));
+
+    reader->data = data;
+    reader->len = len;
+
+    if (magic == HISTORY_SEGMENT_MAGIC) {
+        struct history_segment_header header;
+
+        if (len < sizeof(header)) {
+            return -1;
+        }
+        memcpy(&header, data, sizeof(header));
+
+        if (header.version != HISTORY_SEGMENT_VERSION) {
+            return -1;
+        }
+
+        reader->offset = sizeof(header);
+        reader->end = len;
+        reader->last_ms = header.base_ms;
+
+        return 0;
+    } else if (magic == HISTORY_PACKED_MAGIC) {
+        struct history_packed_header header;
+
+        if (len < sizeof(header)) {
+            return -1;
+        }
+        memcpy(&header, data, sizeof(header));
+
+        if (header.version != HISTORY_PACKED_VERSION || \
+                header.state_len > len - sizeof(header) || \
+                header.delta_len > len - sizeof(header) - header.state_len
+        ) {
+            return -1;
+        }
+
+        reader->packed = 1;
+        reader->events_left = header.event_count;
+        reader->active = header.first_active ? 1 : 0;
+        reader->state_offset = sizeof(header);
+        reader->state_end = reader->state_offset + header.state_len;
+        reader->offset = reader->state_end;
+        reader->end = reader->offset + header.delta_len;
+        reader->last_ms = header.base_ms;
+
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * Decode the next event from a packed segment
+ **/
+static int history_reader_next_packed(struct history_reader *reader,
+    struct history_event *event)
+{
+    uint64_t value;
+
+    if (reader->events_left == 0) {
+        return 0;
+    }
+
+    /**
+     * The first event's state is in the header, the rest are runs (every event
+     * uses up at least one byte of deltas, so this is past the first one)
+     **/
+    if (reader->offset > reader->state_end) {
+        while (reader->run_left == 0) {
+            if (history_decode_varint(
+                    reader->data, &(reader->state_offset), reader->state_end,
+                    &(reader->run_left)
+                ) != 1
+            ) {
+                return -1;
+            }
+            reader->flipping = !reader->flipping;
+        }
+
+        reader->run_left--;
+        if (reader->flipping) {
+            reader->active = !reader->active;
+        }
+    }
+
+    if (reader->repeat_left > 0) {
+        reader->repeat_left--;
+    } else {
+        if (history_decode_varint(
+                reader->data, &(reader->offset), reader->end, &value
+            ) != 1
+        ) {
+            return -1;
+        }
+
+        if (value == 0) {
+            /* A run of the last delta (this event being the first of it) */
+            if (history_decode_varint(
+                    reader->data, &(reader->offset), reader->end, &value
+                ) != 1 || value == 0
+            ) {
+                return -1;
+            }
+            reader->repeat_left = value - 1;
+        } else {
+            reader->last_delta = history_unzigzag(value - 1);
+        }
+    }
+
+    reader->events_left--;
+    reader->last_ms += reader->last_delta;
+
+    event->time_ms = reader->last_ms;
+    event->active = reader->active;
+
+    return 1;
+}
+
+/**
+ * Decode the next event from a segment
+ *
+ * Returns 1 if an event was decoded, 0 at the end of the segment (including
+ * when the last event of a plain segment is incomplete), or -1 if the segment
+ * is corrupt
+ **/
+int history_reader_next(struct history_reader *reader,
+    struct history_event *event)
+{
+    uint64_t value;
+
+    if (reader->packed) {
+        return history_reader_next_packed(reader, event);
+    }
+
+    int result = history_decode_varint(
+        reader->data, &(reader->offset), reader->end, &value
+    );
+
+    if (result != 1) {
+        return result;
+    }
+
+    reader->last_ms += history_unzigzag(value >> 1);
+
+    event->time_ms = reader->last_ms;
+    event->active = (int)(value & 1);
+
+    return 1;
+}
+
+/**
+ * Append a varint to a buffer
+ *
+ * Returns 0 on success, -1 if the buffer couldn't be grown
+ **/
+static int history_codec_append(struct history_codec_buffer *buffer,
+    uint64_t value)
+{
+    if (buffer->capacity - buffer->len < 10) {
+        size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : 4096;
+        unsigned char *data = realloc(buffer->data, capacity);
+
+        if (data == NULL) {
+            return -1;
+        }
+
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+
+    buffer->len += history_encode_varint(value, &(buffer->data[buffer->len]));
+
+    return 0;
+}
+
+/**
+ * Pack a plain segment. The packed segment is allocated, and has to be freed by
+ * the caller.
+ *
+ * Returns 0 on success, -1 if the segment is corrupt (or out of memory)
+ **/
+int history_pack(const void *data, size_t len, unsigned char **packed,
+    size_t *packed_len)
+{
+    struct history_reader reader;
+    struct history_event event;
+    struct history_codec_buffer states = {0};
+    struct history_codec_buffer deltas = {0};
+    struct history_packed_header header = {
+        .magic = HISTORY_PACKED_MAGIC,
+        .version = HISTORY_PACKED_VERSION,
+    };
+    int result;
+    int failed = 0;
+    int flipping = 1;
+    uint64_t run = 0;
+    int64_t last_delta = 0;
+    uint64_t repeats = 0;
+
+    if (history_reader_init(&reader, data, len) == -1 || reader.packed) {
+        return -1;
+    }
+    header.base_ms = reader.last_ms;
+
+    int64_t last_ms = reader.last_ms;
+    int last_active = 0;
+
+    while (!failed && (result = history_reader_next(&reader, &event)) == 1) {
+        int64_t delta = event.time_ms - last_ms;
+
+        if (header.event_count == 0) {
+            header.first_active = event.active;
+        } else if ((event.active != last_active) == flipping) {
+            run++;
+        } else {
+            failed |= history_codec_append(&states, run);
+            flipping = !flipping;
+            run = 1;
+        }
+
+        if (header.event_count > 0 && delta == last_delta) {
+            repeats++;
+        } else {
+            if (repeats > 0) {
+                failed |= history_codec_append(&deltas, 0);
+                failed |= history_codec_append(&deltas, repeats);
+                repeats = 0;
+            }
+            failed |= history_codec_append(
+                &deltas, history_zigzag(delta) + 1
+            );
+            last_delta = delta;
+        }
+
+        last_ms = event.time_ms;
+        last_active = event.active;
+        header.event_count++;
+    }
+
+    if (header.event_count > 1) {
+        failed |= history_codec_append(&states, run);
+    }
+    if (repeats > 0) {
+        failed |= history_codec_append(&deltas, 0);
+        failed |= history_codec_append(&deltas, repeats);
+    }
+
+    *packed_len = sizeof(header) + states.len + deltas.len;
+    *packed = failed || result == -1 ? NULL : malloc(*packed_len);
+
+    if (*packed != NULL) {
+        header.state_len = states.len;
+        header.delta_len = deltas.len;
+
+        memcpy(*packed, &header, sizeof(header));
+        if (states.len > 0) {
+            memcpy(&((*packed)[sizeof(header)]), states.data, states.len);
+        }
+        if (deltas.len > 0) {
+            memcpy(
+                &((*packed)[sizeof(header) + states.len]),
+                deltas.data,
+                deltas.len
+            );
+        }
+    }
+
+    free(states.data);
+    free(deltas.data);
+
+    return *packed != NULL ? 0 : -1;
+}
@@ -0,0 +1,755 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Append-only log of every idle/active transition, kept in segment files under
+ * the state folder (e.g. ~/.local/state/norsi/history/1600000000000.seg, named
+ * after the segment's base time).
+ *
+ * Each event is stored as a single varint holding the zig-zag encoded delta (in
+ * ms) from the previous event, with the new state in the lowest bit. Most
+ * events take 3-4 bytes, so years of history only need a few MB.
+ *
+ * Recording an event only touches memory. A one-shot timer batches events up
+ * for a single write (sooner once the buffer is half full), and the fdatasync
+ * is left to the compactor's thread, so the wayland callbacks never wait on
+ * the disk.
+ *
+ * A new segment is started (from the timer) once the current one is big or old
+ * enough. The compactor syncs and closes the finished segment, and later packs
+ * it (into e.g. 1600000000000.segp).
+ **/
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "compactor.h"
+#include "event-loop.h"
+#include "history.h"
+#include "paths.h"
+
+/**
+ * How much encoded history is held in memory before being written out
+ **/
+#define HISTORY_BUFFER_SIZE 4096
+
+/**
+ * The longest a recorded event waits before it's written and synced
+ **/
+#define HISTORY_SYNC_INTERVAL_MS 30000
+
+/**
+ * How soon events are written out once the buffer is half full, or a new
+ * segment is due
+ **/
+#define HISTORY_WRITE_SOON_MS 1
+
+/**
+ * A new segment is started once the current one reaches this size
+ **/
+#define HISTORY_SEGMENT_MAX_BYTES (1024 * 1024)
+
+/**
+ * A new segment is started once the current one is this old, so that closed
+ * segments can be packed without waiting months to fill one up
+ **/
+#define HISTORY_SEGMENT_MAX_AGE_MS (7 * 24 * 60 * 60 * 1000LL)
+
+/**
+ * The most bytes a single encoded event can take (a 64-bit varint)
+ **/
+#define HISTORY_MAX_EVENT_BYTES 10
+
+/**
+ * e.g. /home/user/.local/state/norsi/history
+ **/
+static char history_folder[PATH_MAX] = {0};
+
+/**
+ * The segment being appended to (or -1 if history is disabled)
+ **/
+static int segment_fd = -1;
+
+/**
+ * Base time of the current segment
+ **/
+static int64_t segment_base_ms = -1;
+
+/**
+ * Number of bytes written to the current segment so far
+ **/
+static size_t segment_len = 0;
+
+/**
+ * Time of the last event recorded (which the next delta is taken from)
+ **/
+static int64_t last_event_ms = 0;
+
+/**
+ * Encoded events waiting to be written
+ **/
+static unsigned char pending[HISTORY_BUFFER_SIZE];
+
+/**
+ * Number of bytes used in `pending`
+ **/
+static size_t pending_len = 0;
+
+/**
+ * non-zero => data has been written since the last fdatasync
+ **/
+static int unsynced = 0;
+
+/**
+ * Fires once recorded events have waited long enough to be synced
+ **/
+static struct event_source *sync_timer = NULL;
+
+/**
+ * non-zero => `sync_timer` is armed
+ **/
+static int sync_timer_armed = 0;
+
+/**
+ * non-zero => `sync_timer` is armed to go off soon
+ **/
+static int sync_timer_soon = 0;
+
+/**
+ * non-zero => a new segment should be started the next time `sync_timer` goes
+ * off
+ **/
+static int rotation_due = 0;
+
+/**
+ * Get the wall clock time in milliseconds
+ **/
+static int64_t history_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
+}
+
+/**
+ * Write everything in `pending` to the current segment
+ **/
+static void history_write_pending(void)
+{
+    size_t written = 0;
+
+    while (written < pending_len) {
+        ssize_t result = write(
+            segment_fd, &(pending[written]), pending_len - written
+        );
+
+        if (result == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* History is best-effort, so don't let it take anything else down */
+            fprintf(
+                stderr, "failed to write history, dropped %zu bytes (%s)\n",
+                pending_len - written, strerror(errno)
+            );
+            break;
+        }
+
+        written += result;
+    }
+
+    segment_len += written;
+    unsynced = unsynced || written > 0;
+    pending_len = 0;
+}
+
+/**
+ * Make sure changes to the history folder's entries (new or renamed segments)
+ * survive a crash
+ **/
+void history_sync_folder(void)
+{
+    int folder_fd = open(history_folder, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+    if (folder_fd != -1) {
+        fsync(folder_fd);
+        close(folder_fd);
+    }
+}
+
+/**
+ * Build the path (at least PATH_MAX long) of the segment starting at
+ * `base_ms`, either plain (while it's being appended to) or packed
+ *
+ * Returns 0 on success, -1 if the path doesn't fit
+ **/
+int history_segment_path(char *path, int64_t base_ms, int packed)
+{
+    char name[32];
+
+    snprintf(
+        name, sizeof(name), "%013lld.%s",
+        (long long)base_ms, packed ? "segp" : "seg"
+    );
+
+    return paths_join(path, PATH_MAX, history_folder, name);
+}
+
+/**
+ * Check if a file in the history folder is a segment (plain or packed)
+ *
+ * Returns non-zero if it is, with its base time in `base_ms`
+ **/
+static int history_parse_segment_name(const char *name, int64_t *base_ms)
+{
+    char *end;
+
+    *base_ms = strtoll(name, &end, 10);
+
+    return end != name && \
+        (strcmp(end, ".seg") == 0 || strcmp(end, ".segp") == 0);
+}
+
+/**
+ * Start a new segment whose deltas are taken from `base_ms`
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+static int history_create_segment(int64_t base_ms)
+{
+    char path[PATH_MAX];
+
+    if (history_segment_path(path, base_ms, 0)) {
+        fprintf(stderr, "no path for history segment\n");
+        return -1;
+    }
+
+    segment_fd = open(
+        path, O_WRONLY | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600
+    );
+
+    if (segment_fd == -1) {
+        fprintf(stderr, "couldn't create %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    struct history_segment_header header = {
+        .magic = HISTORY_SEGMENT_MAGIC,
+        .version = HISTORY_SEGMENT_VERSION,
+        .base_ms = base_ms,
+    };
+
+    memcpy(pending, &header, sizeof(header));
+    pending_len = sizeof(header);
+    segment_len = 0;
+    segment_base_ms = base_ms;
+    last_event_ms = base_ms;
+
+    return 0;
+}
+
+/**
+ * Find the newest segment in the history folder
+ *
+ * Returns the segment's base time, or -1 if there are no segments
+ **/
+static int64_t history_find_latest_segment(void)
+{
+    DIR *folder = opendir(history_folder);
+    int64_t latest = -1;
+
+    if (folder == NULL) {
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(folder)) != NULL) {
+        int64_t base_ms;
+
+        if (history_parse_segment_name(entry->d_name, &base_ms) && \
+                base_ms > latest
+        ) {
+            latest = base_ms;
+        }
+    }
+
+    closedir(folder);
+
+    return latest;
+}
+
+/**
+ * Carry on appending to an existing segment, after dropping anything a crash
+ * left half-written at its end.
+ *
+ * Returns 0 on success, -1 if a new segment should be started instead
+ **/
+static int history_resume_segment(int64_t base_ms)
+{
+    char path[PATH_MAX];
+    struct stat info;
+
+    if (history_segment_path(path, base_ms, 0)) {
+        return -1;
+    }
+
+    /* Packed segments are closed, so this only finds plain ones */
+    int fd = open(path, O_RDWR | O_APPEND | O_CLOEXEC);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &info) == -1 || info.st_size >= HISTORY_SEGMENT_MAX_BYTES) {
+        close(fd);
+        return -1;
+    }
+
+    unsigned char *data = malloc(info.st_size > 0 ? info.st_size : 1);
+    struct history_reader reader;
+    struct history_event event;
+    int result;
+
+    if (data == NULL || \
+            pread(fd, data, info.st_size, 0) != info.st_size || \
+            history_reader_init(&reader, data, info.st_size) == -1
+    ) {
+        free(data);
+        close(fd);
+        return -1;
+    }
+
+    while ((result = history_reader_next(&reader, &event)) == 1) {
+        /* Just finding the end */
+    }
+    free(data);
+
+    if (result == -1) {
+        close(fd);
+        return -1;
+    }
+
+    if (reader.offset < (size_t)info.st_size) {
+        fprintf(
+            stderr, "dropping %zu incomplete bytes from %s\n",
+            (size_t)info.st_size - reader.offset, path
+        );
+        if (ftruncate(fd, reader.offset) == -1) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    segment_fd = fd;
+    segment_len = reader.offset;
+    segment_base_ms = base_ms;
+    last_event_ms = reader.last_ms;
+
+    return 0;
+}
+
+/**
+ * Finish off the current segment, and start the next one from now. The
+ * finished segment is left to the compactor to sync, close, and pack.
+ **/
+static void history_rotate(void)
+{
+    history_write_pending();
+
+    int finished_fd = segment_fd;
+
+    if (history_create_segment(history_now_ms()) == -1) {
+        segment_fd = -1;
+    }
+
+    compactor_close_segment(finished_fd);
+    unsynced = 0;
+    rotation_due = 0;
+
+    if (segment_fd != -1) {
+        compactor_wake(segment_base_ms);
+    }
+}
+
+/**
+ * Called by the event loop once recorded events have waited long enough (or
+ * the buffer is filling up, or a new segment is due)
+ **/
+static void history_sync_due(void *data)
+{
+    sync_timer_armed = 0;
+    sync_timer_soon = 0;
+
+    if (segment_fd == -1) {
+        return;
+    }
+
+    if (rotation_due) {
+        history_rotate();
+    }
+
+    history_flush();
+}
+
+/**
+ * Call this once at start-up, after the event loop has been initialized
+ *
+ * Returns 0 on success, -1 otherwise (history won't be recorded)
+ **/
+int history_init(void)
+{
+    const char *state_folder = paths_get_state_folder();
+
+    if (state_folder == NULL || \
+            paths_join(history_folder, PATH_MAX, state_folder, "history")
+    ) {
+        fprintf(stderr, "no path for history\n");
+        return -1;
+    }
+
+    if (paths_make_folders(history_folder) == -1) {
+        fprintf(
+            stderr, "failed to create %s (%s)\n", history_folder, strerror(errno)
+        );
+        return -1;
+    }
+
+    sync_timer = event_loop_add_timer(history_sync_due, NULL);
+    if (sync_timer == NULL) {
+        return -1;
+    }
+
+    int64_t latest = history_find_latest_segment();
+
+    if (latest == -1 || history_resume_segment(latest) == -1) {
+        int64_t now_ms = history_now_ms();
+
+        /* Never reuse an existing segment's name */
+        if (now_ms <= latest) {
+            now_ms = latest + 1;
+        }
+
+        if (history_create_segment(now_ms) == -1) {
+            event_loop_remove_source(sync_timer);
+            sync_timer = NULL;
+            return -1;
+        }
+
+        history_sync_folder();
+    }
+
+    return 0;
+}
+
+/**
+ * Record that the user just became active (non-zero) or idle (0)
+ **/
+void history_record(int active)
+{
+    if (segment_fd == -1) {
+        return;
+    }
+
+    int64_t now_ms = history_now_ms();
+
+    if (pending_len + HISTORY_MAX_EVENT_BYTES > HISTORY_BUFFER_SIZE) {
+        /* Only if the timer somehow hasn't gone off since it was half full */
+        fprintf(stderr, "history buffer is full, dropped an event\n");
+        return;
+    }
+
+    if (segment_len + pending_len + HISTORY_MAX_EVENT_BYTES > \
+            HISTORY_SEGMENT_MAX_BYTES || \
+            now_ms - segment_base_ms > HISTORY_SEGMENT_MAX_AGE_MS
+    ) {
+        /* Still goes in this segment, the next one is started from the timer */
+        rotation_due = 1;
+    }
+
+    /* Zig-zag the delta, since the wall clock can go backwards */
+    int64_t delta = now_ms - last_event_ms;
+    uint64_t zigzag = ((uint64_t)delta << 1) ^ (uint64_t)(delta >> 63);
+
+    pending_len += history_encode_varint(
+        (zigzag << 1) | (active ? 1 : 0), &(pending[pending_len])
+    );
+    last_event_ms = now_ms;
+
+    if (rotation_due || pending_len * 2 >= HISTORY_BUFFER_SIZE) {
+        if (!sync_timer_soon) {
+            event_loop_arm_timer(sync_timer, HISTORY_WRITE_SOON_MS, 0);
+            sync_timer_armed = 1;
+            sync_timer_soon = 1;
+        }
+    } else if (!sync_timer_armed) {
+        event_loop_arm_timer(sync_timer, HISTORY_SYNC_INTERVAL_MS, 0);
+        sync_timer_armed = 1;
+    }
+}
+
+/**
+ * Write out any recorded events, and have the compactor make sure they reach
+ * the disk (once it's stopped, this waits for them to get there)
+ **/
+void history_flush(void)
+{
+    if (segment_fd == -1) {
+        return;
+    }
+
+    history_write_pending();
+
+    if (unsynced) {
+        compactor_sync_segment(segment_fd);
+        unsynced = 0;
+    }
+}
+
+/**
+ * Call this before shutting down, before the event loop is cleaned up
+ **/
+void history_cleanup(void)
+{
+    history_flush();
+
+    if (segment_fd != -1) {
+        close(segment_fd);
+        segment_fd = -1;
+    }
+
+    event_loop_remove_source(sync_timer);
+    sync_timer = NULL;
+    sync_timer_armed = 0;
+    sync_timer_soon = 0;
+    rotation_due = 0;
+}
+
+/**
+ * Used to sort segment base times
+ **/
+static int history_compare_bases(const void *a, const void *b)
+{
+    int64_t lhs = *(const int64_t *)a;
+    int64_t rhs = *(const int64_t *)b;
+
+    return (lhs > rhs) - (lhs < rhs);
+}
+
+/**
+ * Read a whole segment (plain or packed) into memory, and call `handler` for
+ * each of its events. Safe to call from any thread.
+ *
+ * Returns 0 on success, -1 if the segment couldn't be read
+ **/
+int history_replay_segment(int64_t base_ms, history_event_handler handler,
+    void *data)
+{
+    struct stat info;
+    int fd = history_open_segment(base_ms, NULL);
+
+    if (fd == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    unsigned char *contents = malloc(info.st_size > 0 ? info.st_size : 1);
+    struct history_reader reader;
+    struct history_event event;
+
+    if (contents == NULL || \
+            pread(fd, contents, info.st_size, 0) != info.st_size
+    ) {
+        free(contents);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    if (history_reader_init(&reader, contents, info.st_size) == 0) {
+        while (history_reader_next(&reader, &event) == 1) {
+            handler(&event, data);
+        }
+    }
+
+    free(contents);
+
+    return 0;
+}
+
+/**
+ * Get the base times of all segments, oldest first, without writing out any
+ * recorded events first. Safe to call from any thread. The list is allocated,
+ * and has to be freed by the caller.
+ *
+ * Returns the number of segments, or -1 on failure
+ **/
+int history_scan_segments(int64_t **bases)
+{
+    int count = 0;
+    int capacity = 0;
+
+    *bases = NULL;
+
+    if (history_folder[0] == '\0') {
+        return -1;
+    }
+
+    DIR *folder = opendir(history_folder);
+
+    if (folder == NULL) {
+        return -1;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(folder)) != NULL) {
+        int64_t base_ms;
+
+        if (!history_parse_segment_name(entry->d_name, &base_ms)) {
+            continue;
+        }
+
+        if (count == capacity) {
+            int new_capacity = capacity > 0 ? capacity * 2 : 16;
+            int64_t *grown = realloc(*bases, new_capacity * sizeof(int64_t));
+
+            if (grown == NULL) {
+                free(*bases);
+                *bases = NULL;
+                closedir(folder);
+                return -1;
+            }
+
+            *bases = grown;
+            capacity = new_capacity;
+        }
+
+        (*bases)[count++] = base_ms;
+    }
+    closedir(folder);
+
+    qsort(*bases, count, sizeof(int64_t), history_compare_bases);
+
+    /* A segment is briefly both plain and packed while it's being packed */
+    int unique = 0;
+    for (int i = 0; i < count; i++) {
+        if (unique == 0 || (*bases)[unique - 1] != (*bases)[i]) {
+            (*bases)[unique++] = (*bases)[i];
+        }
+    }
+
+    return unique;
+}
+
+/**
+ * Get the base times of all segments, oldest first (everything recorded so far
+ * is written out first, so the segments can be read back in full). The list
+ * is allocated, and has to be freed by the caller.
+ *
+ * Returns the number of segments, or -1 on failure
+ **/
+int history_list_segments(int64_t **bases)
+{
+    if (segment_fd != -1) {
+        history_write_pending();
+    }
+
+    return history_scan_segments(bases);
+}
+
+/**
+ * Open the segment starting at `base_ms` for reading, whether it's plain or
+ * packed. If `packed` isn't NULL, it's set to say which it was.
+ *
+ * Returns the FD, or -1 on failure (check errno)
+ **/
+int history_open_segment(int64_t base_ms, int *packed)
+{
+    char path[PATH_MAX];
+
+    for (int is_packed = 0; is_packed < 2; is_packed++) {
+        if (history_segment_path(path, base_ms, is_packed)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+
+        int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+        if (fd != -1 || errno != ENOENT) {
+            if (packed != NULL) {
+                *packed = is_packed;
+            }
+            return fd;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Get the base time of the segment being appended to
+ *
+ * Returns the base time, or -1 if history isn't being recorded
+ **/
+int64_t history_get_current_segment(void)
+{
+    return segment_fd != -1 ? segment_base_ms : -1;
+}
+
+/**
+ * Call `handler` for every recorded event in segments starting at or after
+ * `since_ms`, oldest first (including any which are still waiting to be
+ * synced)
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+int history_replay(history_event_handler handler, void *data,
+    int64_t since_ms)
+{
+    int64_t *bases;
+    int count = history_list_segments(&bases);
+
+    if (count == -1) {
+        return -1;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (bases[i] < since_ms) {
+            continue;
+        }
+        if (history_replay_segment(bases[i], handler, data) == -1) {
+            fprintf(stderr, "skipped unreadable history segment\n");
+        }
+    }
+
+    free(bases);
+
+    return 0;
+}
@@ -0,0 +1,150 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Idle backend for the `ext_idle_notifier_v1` protocol (wlroots-based
+ * compositors, KDE, GNOME, ...)
+ *
+ * From version 2 of the protocol, timeouts can ignore idle inhibitors (e.g. a
+ * video player keeping the screen on), so only the user's own input counts as
+ * activity. That's what noRSI cares about, so it's used whenever available.
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ext-idle-notify-v1-client-protocol.h"
+#include "idle-source.h"
+
+/**
+ * The newest version of the protocol we know how to use
+ **/
+#define IDLE_EXT_MAX_VERSION 2
+
+/**
+ * Idle notifier (hands out notification objects)
+ **/
+static struct ext_idle_notifier_v1 *notifier = NULL;
+
+/**
+ * The version of `notifier` that was bound
+ **/
+static uint32_t notifier_version = 0;
+
+static void idle_ext_notification_idled(void *data,
+    struct ext_idle_notification_v1 *object
+)
+{
+    struct idle_timeout *timeout = data;
+    timeout->listener->idle(timeout->data);
+}
+
+static void idle_ext_notification_resumed(void *data,
+    struct ext_idle_notification_v1 *object
+)
+{
+    struct idle_timeout *timeout = data;
+    timeout->listener->resumed(timeout->data);
+}
+
+/* Passes notification events on to the timeout's listener */
+static const struct ext_idle_notification_v1_listener idle_ext_listener = {
+    .idled = idle_ext_notification_idled,
+    .resumed = idle_ext_notification_resumed,
+};
+
+static int idle_ext_bind(struct wl_registry *registry, uint32_t name,
+    const char *interface, uint32_t version)
+{
+    if (strcmp(interface, ext_idle_notifier_v1_interface.name) != 0) {
+        return 0;
+    }
+
+    notifier_version = version < IDLE_EXT_MAX_VERSION ? \
+        version : IDLE_EXT_MAX_VERSION;
+    notifier = wl_registry_bind(
+        registry, name, &ext_idle_notifier_v1_interface, notifier_version
+    );
+
+    return 1;
+}
+
+static int idle_ext_available(void)
+{
+    return notifier != NULL;
+}
+
+static struct idle_timeout *idle_ext_get_timeout(struct wl_seat *seat,
+    int timeout_ms, const struct idle_timeout_listener *listener, void *data)
+{
+    struct idle_timeout *timeout = malloc(sizeof(*timeout));
+
+    if (timeout == NULL) {
+        return NULL;
+    }
+
+    timeout->listener = listener;
+    timeout->data = data;
+
+    if (notifier_version >= \
+            EXT_IDLE_NOTIFIER_V1_GET_INPUT_IDLE_NOTIFICATION_SINCE_VERSION
+    ) {
+        /* Only the user's input counts, inhibitors are ignored */
+        timeout->object = ext_idle_notifier_v1_get_input_idle_notification(
+            notifier, timeout_ms, seat
+        );
+    } else {
+        timeout->object = ext_idle_notifier_v1_get_idle_notification(
+            notifier, timeout_ms, seat
+        );
+    }
+
+    if (timeout->object == NULL) {
+        free(timeout);
+        return NULL;
+    }
+
+    ext_idle_notification_v1_add_listener(
+        timeout->object, &idle_ext_listener, timeout
+    );
+
+    return timeout;
+}
+
+static void idle_ext_destroy_timeout(struct idle_timeout *timeout)
+{
+    ext_idle_notification_v1_destroy(timeout->object);
+    free(timeout);
+}
+
+static void idle_ext_cleanup(void)
+{
+    if (notifier != NULL) {
+        ext_idle_notifier_v1_destroy(notifier);
+        notifier = NULL;
+    }
+}
+
+const struct idle_backend idle_backend_ext = {
+    .name = "ext-idle-notify-v1",
+    .bind = idle_ext_bind,
+    .available = idle_ext_available,
+    .get_timeout = idle_ext_get_timeout,
+    .destroy_timeout = idle_ext_destroy_timeout,
+    .cleanup = idle_ext_cleanup,
+};
@@ -0,0 +1,126 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Idle backend for KDE's `org_kde_kwin_idle` protocol
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "idle-client-protocol.h"
+#include "idle-source.h"
+
+/**
+ * KDE Idle Manager (hands out timeout objects)
+ **/
+static struct org_kde_kwin_idle *idle_manager = NULL;
+
+static void idle_kde_timeout_idle(void *data,
+    struct org_kde_kwin_idle_timeout *object
+)
+{
+    struct idle_timeout *timeout = data;
+    timeout->listener->idle(timeout->data);
+}
+
+static void idle_kde_timeout_resumed(void *data,
+    struct org_kde_kwin_idle_timeout *object
+)
+{
+    struct idle_timeout *timeout = data;
+    timeout->listener->resumed(timeout->data);
+}
+
+/* Passes timeout events on to the timeout's listener */
+static const struct org_kde_kwin_idle_timeout_listener idle_kde_listener = {
+    .idle = idle_kde_timeout_idle,
+    .resumed = idle_kde_timeout_resumed,
+};
+
+static int idle_kde_bind(struct wl_registry *registry, uint32_t name,
+    const char *interface, uint32_t version)
+{
+    if (strcmp(interface, org_kde_kwin_idle_interface.name) != 0) {
+        return 0;
+    }
+
+    /* Bind to the idle manager interface to set up timeouts */
+    idle_manager = wl_registry_bind(
+        registry, name, &org_kde_kwin_idle_interface, 1
+    );
+
+    return 1;
+}
+
+static int idle_kde_available(void)
+{
+    return idle_manager != NULL;
+}
+
+static struct idle_timeout *idle_kde_get_timeout(struct wl_seat *seat,
+    int timeout_ms, const struct idle_timeout_listener *listener, void *data)
+{
+    struct idle_timeout *timeout = malloc(sizeof(*timeout));
+
+    if (timeout == NULL) {
+        return NULL;
+    }
+
+    timeout->listener = listener;
+    timeout->data = data;
+    timeout->object = org_kde_kwin_idle_get_idle_timeout(
+        idle_manager, seat, timeout_ms
+    );
+
+    if (timeout->object == NULL) {
+        free(timeout);
+        return NULL;
+    }
+
+    org_kde_kwin_idle_timeout_add_listener(
+        timeout->object, &idle_kde_listener, timeout
+    );
+
+    return timeout;
+}
+
+static void idle_kde_destroy_timeout(struct idle_timeout *timeout)
+{
+    org_kde_kwin_idle_timeout_release(timeout->object);
+    /* TODO: figure out why call to _timeout_destroy causes segfault */
+    /* Is _timeout_release handling this for us? */
+    free(timeout);
+}
+
+static void idle_kde_cleanup(void)
+{
+    if (idle_manager != NULL) {
+        org_kde_kwin_idle_destroy(idle_manager);
+        idle_manager = NULL;
+    }
+}
+
+const struct idle_backend idle_backend_kde = {
+    .name = "org-kde-kwin-idle",
+    .bind = idle_kde_bind,
+    .available = idle_kde_available,
+    .get_timeout = idle_kde_get_timeout,
+    .destroy_timeout = idle_kde_destroy_timeout,
+    .cleanup = idle_kde_cleanup,
+};
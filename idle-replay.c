@@ -0,0 +1,476 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * An idle backend which replays recorded activity (history segments, see
+ * history.c) instead of listening to a compositor. The clock is switched over
+ * to a virtual one (see clock-source.c) which jumps straight from one event to
+ * the next, so months of activity can be put through the tracker in seconds.
+ *
+ * The recorded idle events are when the shortest timeout fired, so input is
+ * taken to have stopped that long beforehand. Each timeout then reports
+ * idleness once its own duration has passed since then, unless the user is
+ * active again first. Once all events have been replayed, a summary is
+ * printed as JSON.
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock-source.h"
+#include "history.h"
+#include "idle-replay.h"
+#include "idle-source.h"
+#include "safety-tracker.h"
+
+#define IDLE_REPLAY_NS_PER_MS 1000000LL
+
+/**
+ * A timeout handed out to the daemon
+ **/
+struct idle_replay_timeout {
+    /* What the daemon sees (`object` points back at this) */
+    struct idle_timeout timeout;
+    /* How long after input stops that this reports idleness */
+    int64_t timeout_ns;
+    /* non-zero => idleness has been reported, and resuming hasn't */
+    int idle;
+};
+
+/**
+ * Every timeout that's been handed out (and not yet destroyed)
+ **/
+static struct idle_replay_timeout **timeouts = NULL;
+static int timeout_count = 0;
+static int timeout_capacity = 0;
+
+/**
+ * The events to replay, in the order they were loaded
+ **/
+static struct history_event *events = NULL;
+static size_t event_count = 0;
+static size_t event_capacity = 0;
+
+/**
+ * How the periods have fared so far in the replay
+ **/
+struct idle_replay_results {
+    /* Number of periods being tracked */
+    int count;
+    /* Whether each period was within its limit after the last step */
+    int *safe;
+    /* Number of times each period has gone beyond its limit */
+    long *exceeded;
+};
+
+static int idle_replay_bind(struct wl_registry *registry, uint32_t name,
+    const char *interface, uint32_t version)
+{
+    /* Nothing to bind, see `idle_source_use` */
+    return 0;
+}
+
+static int idle_replay_available(void)
+{
+    return 1;
+}
+
+static struct idle_timeout *idle_replay_get_timeout(struct wl_seat *seat,
+    int timeout_ms, const struct idle_timeout_listener *listener, void *data)
+{
+    if (timeout_count == timeout_capacity) {
+        int capacity = timeout_capacity > 0 ? timeout_capacity * 2 : 16;
+        void *grown = realloc(timeouts, capacity * sizeof(*timeouts));
+
+        if (grown == NULL) {
+            return NULL;
+        }
+
+        timeouts = grown;
+        timeout_capacity = capacity;
+    }
+
+    struct idle_replay_timeout *replay_timeout = calloc(
+        1, sizeof(*replay_timeout)
+    );
+    if (replay_timeout == NULL) {
+        return NULL;
+    }
+
+    replay_timeout->timeout.object = replay_timeout;
+    replay_timeout->timeout.listener = listener;
+    replay_timeout->timeout.data = data;
+    replay_timeout->timeout_ns = timeout_ms * IDLE_REPLAY_NS_PER_MS;
+    timeouts[timeout_count++] = replay_timeout;
+
+    return &(replay_timeout->timeout);
+}
+
+static void idle_replay_destroy_timeout(struct idle_timeout *timeout)
+{
+    for (int i = 0; i < timeout_count; i++) {
+        if (timeouts[i] == timeout->object) {
+            timeouts[i] = timeouts[--timeout_count];
+            break;
+        }
+    }
+
+    free(timeout->object);
+}
+
+static void idle_replay_backend_cleanup(void)
+{
+    /* Timeouts belong to whoever asked for them */
+}
+
+const struct idle_backend idle_backend_replay = {
+    .name = "replay",
+    .bind = idle_replay_bind,
+    .available = idle_replay_available,
+    .get_timeout = idle_replay_get_timeout,
+    .destroy_timeout = idle_replay_destroy_timeout,
+    .cleanup = idle_replay_backend_cleanup,
+};
+
+/**
+ * Add an event to the end of the replay
+ *
+ * Returns 0 on success, -1 if there was no memory for it
+ **/
+static int idle_replay_append(const struct history_event *event)
+{
+    if (event_count == event_capacity) {
+        size_t capacity = event_capacity > 0 ? event_capacity * 2 : 1024;
+        void *grown = realloc(events, capacity * sizeof(*events));
+
+        if (grown == NULL) {
+            return -1;
+        }
+
+        events = grown;
+        event_capacity = capacity;
+    }
+
+    events[event_count++] = *event;
+
+    return 0;
+}
+
+/**
+ * Read a whole file into memory
+ *
+ * Returns the contents (to be freed by the caller) with their size in `len`,
+ * or NULL on failure
+ **/
+static unsigned char *idle_replay_read_file(const char *path, size_t *len)
+{
+    struct stat info;
+    unsigned char *data = NULL;
+    size_t got = 0;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &info) == -1) {
+        close(fd);
+        return NULL;
+    }
+
+    data = malloc(info.st_size > 0 ? info.st_size : 1);
+    if (data == NULL) {
+        close(fd);
+        return NULL;
+    }
+
+    while (got < (size_t)info.st_size) {
+        ssize_t n = read(fd, data + got, info.st_size - got);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            free(data);
+            close(fd);
+            return NULL;
+        }
+
+        got += n;
+    }
+
+    close(fd);
+    *len = got;
+
+    return data;
+}
+
+/**
+ * Add the events from a history segment (plain or packed) to the replay.
+ * Segments should be loaded oldest first.
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+int idle_replay_load(const char *path)
+{
+    struct history_reader reader;
+    struct history_event event;
+    size_t len = 0;
+    unsigned char *data = idle_replay_read_file(path, &len);
+    int rc = 0;
+
+    if (data == NULL) {
+        fprintf(stderr, "unable to read %s (%s)\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (history_reader_init(&reader, data, len) == -1) {
+        fprintf(stderr, "%s isn't a history segment\n", path);
+        free(data);
+        return -1;
+    }
+
+    while (history_reader_next(&reader, &event) == 1) {
+        if (idle_replay_append(&event) == -1) {
+            fprintf(stderr, "out of memory loading %s\n", path);
+            rc = -1;
+            break;
+        }
+    }
+
+    free(data);
+
+    return rc;
+}
+
+/**
+ * Order timeouts from shortest to longest
+ **/
+static int idle_replay_compare_timeouts(const void *a, const void *b)
+{
+    const struct idle_replay_timeout *ta = *(const void * const *)a;
+    const struct idle_replay_timeout *tb = *(const void * const *)b;
+
+    return (ta->timeout_ns > tb->timeout_ns) - \
+        (ta->timeout_ns < tb->timeout_ns);
+}
+
+/**
+ * Note any periods which have just gone beyond their limits
+ **/
+static void idle_replay_check(struct idle_replay_results *results)
+{
+    for (int i = 0; i < results->count; i++) {
+        int safe = tracker_is_period_safe(i);
+
+        if (results->safe[i] && !safe) {
+            results->exceeded[i]++;
+        }
+        results->safe[i] = safe;
+    }
+}
+
+/**
+ * While the user is idle, report idleness for every timeout whose duration
+ * (counted from `idle_from_ns`) has passed by `until_ns`. `next` is the index
+ * of the shortest timeout that hasn't reported yet, and is updated.
+ **/
+static void idle_replay_fire(int64_t idle_from_ns, int64_t until_ns,
+    int *next, idle_replay_step_handler step, void *data,
+    struct idle_replay_results *results)
+{
+    while (*next < timeout_count && \
+            idle_from_ns + timeouts[*next]->timeout_ns <= until_ns
+    ) {
+        struct idle_replay_timeout *timeout = timeouts[(*next)++];
+
+        clock_source_set_virtual(idle_from_ns + timeout->timeout_ns);
+        timeout->idle = 1;
+        timeout->timeout.listener->idle(timeout->timeout.data);
+
+        step(data);
+        idle_replay_check(results);
+    }
+}
+
+/**
+ * Report that the user is active again, to every timeout that reported
+ * idleness (or to all of them, if none had, e.g. for the very first event)
+ **/
+static void idle_replay_resume(void)
+{
+    int any_idle = 0;
+
+    for (int i = 0; i < timeout_count; i++) {
+        any_idle |= timeouts[i]->idle;
+    }
+
+    for (int i = 0; i < timeout_count; i++) {
+        struct idle_replay_timeout *timeout = timeouts[i];
+
+        if (timeout->idle || !any_idle) {
+            timeout->idle = 0;
+            timeout->timeout.listener->resumed(timeout->timeout.data);
+        }
+    }
+}
+
+/**
+ * Print the summary of a replay
+ **/
+static void idle_replay_report(const struct idle_replay_results *results,
+    size_t replayed, size_t skipped, double simulated_s, double wall_s)
+{
+    printf(
+        "{\"events\":%zu,\"skipped\":%zu,\"simulated_seconds\":%.3f,"
+        "\"wall_seconds\":%.6f,\"events_per_second\":%.0f,\"periods\":[",
+        replayed, skipped, simulated_s, wall_s,
+        wall_s > 0 ? replayed / wall_s : 0
+    );
+
+    for (int i = 0; i < results->count; i++) {
+        printf(
+            "%s{\"name\":\"%s\",\"limit_exceeded\":%li,"
+            "\"accumulated_seconds\":%i}",
+            i > 0 ? "," : "",
+            tracker_get_period_name(i),
+            results->exceeded[i],
+            tracker_get_period_active_seconds(i)
+        );
+    }
+
+    printf("]}\n");
+}
+
+/**
+ * Replay every loaded event through the timeouts that have been handed out,
+ * calling `step` after each one (as the main loop would after dispatching
+ * events). The tracker must be set up, and its periods shouldn't change while
+ * replaying.
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+int idle_replay_run(idle_replay_step_handler step, void *data)
+{
+    struct idle_replay_results results = {0};
+    struct timespec wall_start;
+    struct timespec wall_end;
+    int64_t idle_from_ns = -1;
+    int64_t first_ns = 0;
+    int64_t last_ns = 0;
+    size_t replayed = 0;
+    size_t skipped = 0;
+    int next = 0;
+    int active = -1;
+
+    if (timeout_count == 0) {
+        fprintf(stderr, "nothing is listening for the replay\n");
+        return -1;
+    }
+
+    results.count = tracker_count_periods();
+    results.safe = malloc(results.count * sizeof(int));
+    results.exceeded = calloc(results.count, sizeof(long));
+    if (results.count > 0 && \
+            (results.safe == NULL || results.exceeded == NULL)
+    ) {
+        free(results.safe);
+        free(results.exceeded);
+        return -1;
+    }
+    for (int i = 0; i < results.count; i++) {
+        results.safe[i] = tracker_is_period_safe(i);
+    }
+
+    qsort(
+        timeouts, timeout_count, sizeof(*timeouts),
+        idle_replay_compare_timeouts
+    );
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+
+    for (size_t e = 0; e < event_count; e++) {
+        int64_t at_ns = events[e].time_ms * IDLE_REPLAY_NS_PER_MS;
+        int event_active = events[e].active != 0;
+
+        if ((replayed > 0 && at_ns < last_ns) || event_active == active) {
+            /* Out of order, or not actually a change */
+            skipped++;
+            continue;
+        }
+
+        if (replayed == 0) {
+            first_ns = at_ns;
+        }
+
+        if (event_active) {
+            /* Whatever would have been reported before they came back */
+            if (idle_from_ns != -1) {
+                idle_replay_fire(
+                    idle_from_ns, at_ns - 1, &next, step, data, &results
+                );
+            }
+
+            clock_source_set_virtual(at_ns);
+            idle_replay_resume();
+            idle_from_ns = -1;
+
+            step(data);
+            idle_replay_check(&results);
+        } else {
+            /* The shortest timeout fires now, and maybe others with it */
+            idle_from_ns = at_ns - timeouts[0]->timeout_ns;
+            next = 0;
+            idle_replay_fire(idle_from_ns, at_ns, &next, step, data, &results);
+        }
+
+        active = event_active;
+        last_ns = at_ns;
+        replayed++;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+
+    idle_replay_report(
+        &results, replayed, skipped,
+        (last_ns - first_ns) / 1e9,
+        (wall_end.tv_sec - wall_start.tv_sec) + \
+            (wall_end.tv_nsec - wall_start.tv_nsec) / 1e9
+    );
+
+    free(results.safe);
+    free(results.exceeded);
+
+    return 0;
+}
+
+/**
+ * Release the loaded events
+ **/
+void idle_replay_cleanup(void)
+{
+    free(events);
+    events = NULL;
+    event_count = 0;
+    event_capacity = 0;
+}
@@ -0,0 +1,135 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Picks how to find out when the user is idle. Each compositor protocol for
+ * this is a backend (see `struct idle_backend`), which gets a look at every
+ * registry global. Once the registry has been gone through, the best backend
+ * that the compositor supports is used for everything.
+ **/
+
+#include <stddef.h>
+
+#include "idle-source.h"
+
+/**
+ * Every backend, best first
+ **/
+static const struct idle_backend *const backends[] = {
+    /* Only counts real input (ignores inhibitors), and is widely supported */
+    &idle_backend_ext,
+    /* KDE's older protocol */
+    &idle_backend_kde,
+};
+
+#define IDLE_SOURCE_BACKEND_COUNT (sizeof(backends)/sizeof(backends[0]))
+
+/**
+ * The backend in use (NULL until one is selected)
+ **/
+static const struct idle_backend *selected = NULL;
+
+/**
+ * Offer a registry global to every backend
+ *
+ * Returns non-zero if some backend bound it
+ **/
+int idle_source_registry_global(struct wl_registry *registry, uint32_t name,
+    const char *interface, uint32_t version)
+{
+    for (size_t i = 0; i < IDLE_SOURCE_BACKEND_COUNT; i++) {
+        if (backends[i]->bind(registry, name, interface, version)) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * Call this once the registry has been gone through, to pick the best backend
+ * that the compositor supports. Any others are released.
+ *
+ * Returns 0 on success, -1 if the compositor doesn't support any of them
+ **/
+int idle_source_select(void)
+{
+    for (size_t i = 0; i < IDLE_SOURCE_BACKEND_COUNT; i++) {
+        if (selected == NULL && backends[i]->available()) {
+            selected = backends[i];
+        } else {
+            backends[i]->cleanup();
+        }
+    }
+
+    return selected != NULL ? 0 : -1;
+}
+
+/**
+ * Use `backend` without asking the compositor (e.g. to replay a trace)
+ **/
+void idle_source_use(const struct idle_backend *backend)
+{
+    selected = backend;
+}
+
+/**
+ * Get the name of the backend in use, or NULL if there isn't one
+ **/
+const char *idle_source_name(void)
+{
+    return selected != NULL ? selected->name : NULL;
+}
+
+/**
+ * Ask the compositor to let `listener` know once the user has been idle for
+ * `timeout_ms` (and when they're active again afterwards)
+ *
+ * Returns NULL on failure
+ **/
+struct idle_timeout *idle_source_get_timeout(struct wl_seat *seat,
+    int timeout_ms, const struct idle_timeout_listener *listener, void *data)
+{
+    if (selected == NULL) {
+        return NULL;
+    }
+
+    return selected->get_timeout(seat, timeout_ms, listener, data);
+}
+
+/**
+ * Release a timeout from `idle_source_get_timeout`
+ **/
+void idle_source_destroy_timeout(struct idle_timeout *timeout)
+{
+    if (selected != NULL && timeout != NULL) {
+        selected->destroy_timeout(timeout);
+    }
+}
+
+/**
+ * Release every backend (destroy any timeouts first)
+ **/
+void idle_source_cleanup(void)
+{
+    for (size_t i = 0; i < IDLE_SOURCE_BACKEND_COUNT; i++) {
+        backends[i]->cleanup();
+    }
+
+    selected = NULL;
+}
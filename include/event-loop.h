@@ -0,0 +1,55 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <time.h>
+
+/* A file descriptor or timer being watched by the event loop */
+struct event_source;
+
+/* Called with the epoll flags (EPOLLIN, EPOLLOUT, ...) that are ready */
+typedef void (*event_loop_fd_handler)(int fd, uint32_t events, void *data);
+/* Called each time a timer expires */
+typedef void (*event_loop_timer_handler)(void *data);
+/* Called each time the loop wakes up, before any other handlers */
+typedef void (*event_loop_wakeup_handler)(void *data);
+
+int event_loop_init(void);
+int event_loop_dispatch(int timeout_ms);
+void event_loop_cleanup(void);
+void event_loop_set_wakeup_handler(event_loop_wakeup_handler handler,
+    void *data);
+
+struct event_source *event_loop_add_fd(int fd, uint32_t events,
+    event_loop_fd_handler handler, void *data);
+int event_loop_update_fd(struct event_source *source, uint32_t events);
+
+struct event_source *event_loop_add_timer(event_loop_timer_handler handler,
+    void *data);
+int event_loop_arm_timer(struct event_source *source, int initial_ms,
+    int interval_ms);
+int event_loop_arm_timer_at(struct event_source *source,
+    const struct timespec *when);
+
+void event_loop_remove_source(struct event_source *source);
+
+#endif
@@ -0,0 +1,140 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* "NRSH" */
+#define HISTORY_SEGMENT_MAGIC 0x4853524e
+#define HISTORY_SEGMENT_VERSION 1
+
+/* "NRSP" */
+#define HISTORY_PACKED_MAGIC 0x5053524e
+#define HISTORY_PACKED_VERSION 1
+
+/**
+ * Every segment file starts with this header, followed by the encoded events
+ * (see `history_reader_next`)
+ **/
+struct history_segment_header {
+    /* Always HISTORY_SEGMENT_MAGIC */
+    uint32_t magic;
+    /* Always HISTORY_SEGMENT_VERSION for this layout */
+    uint32_t version;
+    /* Wall clock time the first event's delta is taken from (ms) */
+    int64_t base_ms;
+};
+
+/**
+ * Closed segments are packed (see history-codec.c), and start with this header
+ * instead
+ **/
+struct history_packed_header {
+    /* Always HISTORY_PACKED_MAGIC */
+    uint32_t magic;
+    /* Always HISTORY_PACKED_VERSION for this layout */
+    uint32_t version;
+    /* Wall clock time the first event's delta is taken from (ms) */
+    int64_t base_ms;
+    /* Number of events in the segment */
+    uint32_t event_count;
+    /* State of the first event */
+    uint32_t first_active;
+    /* Size of the state runs, which come straight after the header */
+    uint32_t state_len;
+    /* Size of the deltas, which come straight after the state runs */
+    uint32_t delta_len;
+};
+
+/**
+ * A single idle/active transition
+ **/
+struct history_event {
+    /* Wall clock time of the transition (ms since the epoch) */
+    int64_t time_ms;
+    /* non-zero => the user became active, 0 => the user became idle */
+    int active;
+};
+
+/**
+ * Decodes the events from a segment (plain or packed) held in memory
+ **/
+struct history_reader {
+    /* The whole segment, including its header */
+    const unsigned char *data;
+    /* Size of `data` */
+    size_t len;
+    /* Offset of the next event (or packed delta) in `data` */
+    size_t offset;
+    /* End of the events (or packed deltas) in `data` */
+    size_t end;
+    /* Time of the last event decoded (or the segment's base time) */
+    int64_t last_ms;
+    /* non-zero => the segment is packed */
+    int packed;
+    /* Packed only: events left to decode */
+    uint32_t events_left;
+    /* Packed only: state of the last event decoded */
+    int active;
+    /* Packed only: offset of the next state run in `data` */
+    size_t state_offset;
+    /* Packed only: end of the state runs in `data` */
+    size_t state_end;
+    /* Packed only: non-zero => the current run is of state changes */
+    int flipping;
+    /* Packed only: events left in the current state run */
+    uint64_t run_left;
+    /* Packed only: repeats left of `last_delta` */
+    uint64_t repeat_left;
+    /* Packed only: the last delta decoded */
+    int64_t last_delta;
+};
+
+/* Called for each event while replaying the history */
+typedef void (*history_event_handler)(const struct history_event *event,
+    void *data);
+
+int history_init(void);
+void history_record(int active);
+void history_flush(void);
+void history_cleanup(void);
+int history_replay(history_event_handler handler, void *data,
+    int64_t since_ms);
+int history_list_segments(int64_t **bases);
+int64_t history_get_current_segment(void);
+
+/* These are safe to call from any thread (once history is initialized) */
+int history_scan_segments(int64_t **bases);
+int history_segment_path(char *path, int64_t base_ms, int packed);
+int history_open_segment(int64_t base_ms, int *packed);
+int history_replay_segment(int64_t base_ms, history_event_handler handler,
+    void *data);
+void history_sync_folder(void);
+
+size_t history_encode_varint(uint64_t value, unsigned char *out);
+int history_reader_init(struct history_reader *reader, const void *data,
+    size_t len);
+int history_reader_next(struct history_reader *reader,
+    struct history_event *event);
+int history_pack(const void *data, size_t len, unsigned char **packed,
+    size_t *packed_len);
+
+#endif
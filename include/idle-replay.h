@@ -0,0 +1,29 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef IDLE_REPLAY_H
+#define IDLE_REPLAY_H
+
+/* Called after each replayed event, like one pass of the main loop */
+typedef void (*idle_replay_step_handler)(void *data);
+
+int idle_replay_load(const char *path);
+int idle_replay_run(idle_replay_step_handler step, void *data);
+void idle_replay_cleanup(void);
+
+#endif
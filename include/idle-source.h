@@ -0,0 +1,81 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef IDLE_SOURCE_H
+#define IDLE_SOURCE_H
+
+#include <stdint.h>
+#include <wayland-client.h>
+
+/**
+ * Called when the user has been idle for a timeout's duration, and when
+ * they're active again afterwards
+ **/
+struct idle_timeout_listener {
+    void (*idle)(void *data);
+    void (*resumed)(void *data);
+};
+
+/**
+ * A timeout handed out by an idle backend
+ **/
+struct idle_timeout {
+    /* The backend's protocol object (e.g. `struct ext_idle_notification_v1`) */
+    void *object;
+    /* Who to tell about this timeout */
+    const struct idle_timeout_listener *listener;
+    void *data;
+};
+
+/**
+ * A way of finding out when the user is idle, i.e. a compositor protocol
+ **/
+struct idle_backend {
+    /* e.g. "ext-idle-notify-v1" */
+    const char *name;
+    /**
+     * Offered every registry global. Returns non-zero if it was this backend's
+     * manager (and it has been bound).
+     **/
+    int (*bind)(struct wl_registry *registry, uint32_t name,
+        const char *interface, uint32_t version);
+    /* Non-zero once the backend has bound what it needs */
+    int (*available)(void);
+    /* Returns NULL on failure */
+    struct idle_timeout *(*get_timeout)(struct wl_seat *seat, int timeout_ms,
+        const struct idle_timeout_listener *listener, void *data);
+    void (*destroy_timeout)(struct idle_timeout *timeout);
+    /* Release the manager, if it was bound */
+    void (*cleanup)(void);
+};
+
+extern const struct idle_backend idle_backend_ext;
+extern const struct idle_backend idle_backend_kde;
+extern const struct idle_backend idle_backend_replay;
+
+int idle_source_registry_global(struct wl_registry *registry, uint32_t name,
+    const char *interface, uint32_t version);
+int idle_source_select(void);
+void idle_source_use(const struct idle_backend *backend);
+const char *idle_source_name(void);
+struct idle_timeout *idle_source_get_timeout(struct wl_seat *seat,
+    int timeout_ms, const struct idle_timeout_listener *listener, void *data);
+void idle_source_destroy_timeout(struct idle_timeout *timeout);
+void idle_source_cleanup(void);
+
+#endif
@@ -0,0 +1,185 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Counters and latency histograms kept by the daemon, and reported by the
+ * `metrics` request.
+ *
+ * Each thread updates a block of its own, so updates need no locks or atomic
+ * read-modify-writes (just relaxed loads/stores, which are plain moves on
+ * common CPUs). Reports add up every thread's block.
+ **/
+
+enum metrics_counter {
+    /* Times the event loop woke up */
+    METRICS_LOOP_WAKEUPS,
+    /* Times wayland events were read and dispatched */
+    METRICS_WAYLAND_DISPATCHES,
+    /* Client connections accepted */
+    METRICS_ACCEPTS,
+    /* Client connections that were given up on (e.g. aborted, no memory) */
+    METRICS_REFUSALS,
+    /* Times accepting was paused, leaving connections waiting (e.g. no FDs) */
+    METRICS_ACCEPT_PAUSES,
+    /* Bytes read from / written to clients */
+    METRICS_BYTES_IN,
+    METRICS_BYTES_OUT,
+    /* Requests, by command */
+    METRICS_REQUESTS_STATUS,
+    METRICS_REQUESTS_SUBSCRIBE,
+    METRICS_REQUESTS_HISTORY,
+    METRICS_REQUESTS_EXPORT,
+    METRICS_REQUESTS_INFO,
+    METRICS_REQUESTS_METRICS,
+    METRICS_REQUESTS_UNKNOWN,
+    METRICS_REQUESTS_OVERSIZED,
+    /* History segments packed by the compactor */
+    METRICS_SEGMENTS_PACKED,
+    METRICS_COUNTER_COUNT,
+};
+
+enum metrics_histogram {
+    /* Reading and dispatching wayland events */
+    METRICS_WAYLAND_DISPATCH_NS,
+    /* Handling a single request (queueing its answer) */
+    METRICS_REQUEST_NS,
+    /* Rendering the status JSON */
+    METRICS_STATUS_RENDER_NS,
+    METRICS_HISTOGRAM_COUNT,
+};
+
+/**
+ * Histograms are log-linear: METRICS_SUB_BUCKETS buckets for each power of two
+ * (so each bucket is within 12.5% of the values in it), up to
+ * 2^METRICS_MAX_BITS nanoseconds (~18 minutes). Anything longer goes in the
+ * last bucket.
+ **/
+#define METRICS_SUB_BITS 3
+#define METRICS_SUB_BUCKETS (1 << METRICS_SUB_BITS)
+#define METRICS_MAX_BITS 40
+#define METRICS_BUCKETS \
+    ((METRICS_MAX_BITS - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+
+/**
+ * The number of threads that get a block of their own. Any more share one
+ * block (and may lose the odd update).
+ **/
+#define METRICS_MAX_THREADS 8
+
+struct metrics_histogram_data {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[METRICS_BUCKETS];
+};
+
+/**
+ * Everything one thread has counted
+ **/
+struct metrics_block {
+    uint64_t counters[METRICS_COUNTER_COUNT];
+    struct metrics_histogram_data histograms[METRICS_HISTOGRAM_COUNT];
+};
+
+/**
+ * The calling thread's block (NULL until it first counts something)
+ **/
+extern _Thread_local struct metrics_block *metrics_local;
+
+struct metrics_block *metrics_attach(void);
+
+/**
+ * Add to a value in the calling thread's block. Nothing else writes to it, and
+ * reports only need each value to be read whole, so relaxed ordering is enough.
+ **/
+static inline void metrics_bump(uint64_t *value, uint64_t amount)
+{
+    __atomic_store_n(
+        value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount,
+        __ATOMIC_RELAXED
+    );
+}
+
+static inline struct metrics_block *metrics_block(void)
+{
+    return metrics_local != NULL ? metrics_local : metrics_attach();
+}
+
+/**
+ * Count `amount` more of `counter`
+ **/
+static inline void metrics_add(enum metrics_counter counter, uint64_t amount)
+{
+    metrics_bump(&(metrics_block()->counters[counter]), amount);
+}
+
+/**
+ * Get the histogram bucket that `value_ns` falls in
+ **/
+static inline int metrics_bucket(uint64_t value_ns)
+{
+    if (value_ns < METRICS_SUB_BUCKETS) {
+        return (int)value_ns;
+    }
+
+    int shift = 63 - __builtin_clzll(value_ns) - METRICS_SUB_BITS;
+    int bucket = ((shift + 1) << METRICS_SUB_BITS) + \
+        (int)((value_ns >> shift) & (METRICS_SUB_BUCKETS - 1));
+
+    return bucket < METRICS_BUCKETS ? bucket : METRICS_BUCKETS - 1;
+}
+
+/**
+ * Record a duration (in nanoseconds) in `histogram`
+ **/
+static inline void metrics_observe(enum metrics_histogram histogram,
+    int64_t value_ns)
+{
+    struct metrics_histogram_data *data = \
+        &(metrics_block()->histograms[histogram]);
+    uint64_t value = value_ns > 0 ? (uint64_t)value_ns : 0;
+
+    metrics_bump(&(data->buckets[metrics_bucket(value)]), 1);
+    metrics_bump(&(data->count), 1);
+    metrics_bump(&(data->sum_ns), value);
+    if (value > __atomic_load_n(&(data->max_ns), __ATOMIC_RELAXED)) {
+        __atomic_store_n(&(data->max_ns), value, __ATOMIC_RELAXED);
+    }
+}
+
+/**
+ * Get the current monotonic time in nanoseconds, for timing things
+ **/
+static inline int64_t metrics_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void metrics_init(void);
+const char *metrics_get_json(int *len);
+
+#endif
@@ -0,0 +1,30 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef PATHS_H
+#define PATHS_H
+
+#include <stddef.h>
+
+const char *paths_get_runtime_folder(void);
+const char *paths_get_state_folder(void);
+const char *paths_get_config_folder(void);
+int paths_make_folders(const char *path);
+int paths_join(char *dst, size_t size, const char *folder, const char *name);
+
+#endif
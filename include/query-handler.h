@@ -19,8 +19,13 @@
 #ifndef QUERY_HANDLER_H
 #define QUERY_HANLDER_H
 
+/**
+ * Maximum length of a single request (excluding the trailing newline)
+ **/
+#define QUERY_HANDLER_MAX_REQUEST_LENGTH 1024
+
 int query_handler_init_server(void);
-int query_handler_run(void);
+void query_handler_publish_status(void);
 int query_handler_cleanup(void);
 
 #endif
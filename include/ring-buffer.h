@@ -0,0 +1,56 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef RING_BUFFER_H
+#define RING_BUFFER_H
+
+#include <stddef.h>
+#include <sys/uio.h>
+
+/**
+ * A byte queue which grows as needed, and gives its storage back once it's
+ * empty. A zeroed struct is a valid empty buffer.
+ **/
+struct ring_buffer {
+    /* Storage (NULL until something is written) */
+    unsigned char *data;
+    /* Size of `data`, always a power of two (or 0) */
+    size_t capacity;
+    /* Free-running read index */
+    size_t head;
+    /* Free-running write index */
+    size_t tail;
+};
+
+size_t ring_buffer_len(const struct ring_buffer *rb);
+int ring_buffer_reserve(struct ring_buffer *rb, size_t extra);
+int ring_buffer_write(struct ring_buffer *rb, const void *src, size_t len);
+size_t ring_buffer_peek(const struct ring_buffer *rb, void *dst, size_t len);
+long ring_buffer_find(const struct ring_buffer *rb, size_t from, int byte);
+long ring_buffer_take_line(struct ring_buffer *rb, size_t *scanned, char *dst,
+    size_t size);
+void ring_buffer_consume(struct ring_buffer *rb, size_t len);
+void ring_buffer_free(struct ring_buffer *rb);
+
+int ring_buffer_readable_regions(const struct ring_buffer *rb,
+    struct iovec regions[2]);
+int ring_buffer_writable_regions(const struct ring_buffer *rb,
+    struct iovec regions[2]);
+void ring_buffer_commit(struct ring_buffer *rb, size_t len);
+
+#endif
@@ -0,0 +1,69 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef ROLLUP_H
+#define ROLLUP_H
+
+#include <stdint.h>
+
+/**
+ * Resolutions that activity is rolled up at
+ **/
+enum rollup_level {
+    ROLLUP_MINUTE,
+    ROLLUP_HOUR,
+    ROLLUP_DAY,
+    ROLLUP_LEVELS,
+};
+
+/**
+ * Activity during a single minute/hour/day (UTC), or a summary of a range
+ **/
+struct rollup_bucket {
+    /* Wall clock time the bucket starts at (s since the epoch) */
+    int64_t start;
+    /* Time the user was active during the bucket */
+    int32_t active_seconds;
+    /* Number of breaks which started during the bucket */
+    int32_t break_count;
+    /* Longest stretch of activity (without a break) reached in the bucket */
+    int32_t longest_streak_seconds;
+};
+
+/* A set of rollup tables separate from the live ones */
+struct rollup_set;
+struct history_event;
+
+int rollup_init(void);
+void rollup_cleanup(void);
+void rollup_provide_active_seconds(int active_seconds);
+void rollup_provide_idle_seconds(int idle_seconds);
+
+int rollup_level_seconds(enum rollup_level level);
+const struct rollup_bucket *rollup_get_buckets(enum rollup_level level,
+    int64_t from, int64_t to, int *count);
+void rollup_summarize(int64_t from, int64_t to, struct rollup_bucket *summary);
+int rollup_get_break_seconds(void);
+
+/* These are safe to use from any thread */
+struct rollup_set *rollup_set_create(int break_seconds);
+void rollup_set_add_event(const struct history_event *event, void *data);
+void rollup_set_destroy(struct rollup_set *set);
+int rollup_archive(struct rollup_set *set, int64_t covered_until_ms);
+
+#endif
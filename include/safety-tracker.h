@@ -19,9 +19,44 @@
 #ifndef SAFETY_TRACKER_H
 #define SAFETY_TRACKER_H
 
-void tracker_provide_idle_seconds(int idle_seconds);
-void tracker_provide_active_seconds(int active_seconds);
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Longest period name (including terminator)
+ **/
+#define TRACKER_NAME_LENGTH 32
+
+/**
+ * Most periods a config can define (the state file and status page have room
+ * for this many)
+ **/
+#define TRACKER_MAX_PERIODS 64
+
+/**
+ * The tracker accounts for time in nanoseconds
+ **/
+#define TRACKER_NS_PER_SECOND 1000000000LL
+
+int tracker_init(void);
+int tracker_load_config(const char *path);
+int tracker_get_config_path(char *path, size_t size);
+void tracker_cleanup(void);
+
+int tracker_count_periods(void);
+const char *tracker_get_period_name(int period);
+int tracker_get_period_limit_seconds(int period);
+int tracker_get_period_active_seconds(int period);
+void tracker_set_period_active_seconds(int period, int active_seconds);
+int tracker_is_period_safe(int period);
+
+void tracker_provide_idle_ns(int64_t idle_ns);
+void tracker_provide_active_ns(int64_t active_ns);
+void tracker_schedule_active(int64_t elapsed_ns);
+int tracker_get_idle_thresholds(int *thresholds, int max_thresholds);
+int64_t tracker_ns_until_deadline(int64_t elapsed_ns);
 void tracker_display_nag_status(void);
-char *tracker_get_status_json(void);
+const char *tracker_get_status_json(int *len);
+unsigned long tracker_get_status_generation(void);
 
 #endif
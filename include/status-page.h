@@ -0,0 +1,99 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef STATUS_PAGE_H
+#define STATUS_PAGE_H
+
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * The status page is a file at `$XDG_RUNTIME_DIR/norsi/status.shm` which
+ * clients can mmap (read-only) to see the status of every tracking period
+ * without talking to noRSI at all.
+ *
+ * The page is protected by a sequence lock: `sequence` is odd while the page
+ * is being written, and changes every time it is written. Use
+ * `status_page_read` (or follow the same steps) to get a consistent copy.
+ **/
+
+/* "NRSI" */
+#define STATUS_PAGE_MAGIC 0x4953524eu
+#define STATUS_PAGE_VERSION 1
+#define STATUS_PAGE_MAX_PERIODS 64
+#define STATUS_PAGE_NAME_LENGTH 32
+
+/**
+ * The published state of a single tracking period
+ **/
+struct status_page_period {
+    /* NUL-terminated (and possibly truncated) period name */
+    char name[STATUS_PAGE_NAME_LENGTH];
+    /* Active time accumulated for the period */
+    int64_t active_seconds;
+    /* How much active time is allowed before a break is needed */
+    int64_t limit_seconds;
+    /* non-zero => no break needed yet */
+    uint32_t safe;
+    uint32_t reserved;
+};
+
+/**
+ * Layout of the whole status page
+ **/
+struct status_page {
+    /* Always STATUS_PAGE_MAGIC */
+    uint32_t magic;
+    /* Always STATUS_PAGE_VERSION for this layout */
+    uint32_t version;
+    /* Sequence lock (odd => write in progress) */
+    uint32_t sequence;
+    /* Number of valid entries in `periods` */
+    uint32_t period_count;
+    /* Changes every time the status changes */
+    uint64_t generation;
+    struct status_page_period periods[STATUS_PAGE_MAX_PERIODS];
+};
+
+/**
+ * Take a consistent copy of a mapped status page, retrying while it's being
+ * written. No system calls are made.
+ **/
+static inline void status_page_read(const struct status_page *page,
+    struct status_page *copy)
+{
+    uint32_t before, after;
+
+    do {
+        before = __atomic_load_n(&(page->sequence), __ATOMIC_ACQUIRE);
+        if (before & 1) {
+            continue;
+        }
+
+        memcpy(copy, page, sizeof(struct status_page));
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&(page->sequence), __ATOMIC_RELAXED);
+    } while ((before & 1) || before != after);
+}
+
+int status_page_init(void);
+void status_page_publish(void);
+void status_page_cleanup(void);
+
+#endif
@@ -0,0 +1,47 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+#ifndef TRACKER_KERNEL_H
+#define TRACKER_KERNEL_H
+
+#include <stdint.h>
+
+/**
+ * The per-period arrays an update is applied to, in nanoseconds (see
+ * safety-tracker.c). Times have to stay within 2^62 ns (about 146 years)
+ * either way.
+ **/
+struct tracker_kernel_periods {
+    int count;
+    const int64_t *limit_ns;
+    const int64_t *reset_ns;
+    const int64_t *break_ns;
+    int64_t *active_ns;
+};
+
+int tracker_kernel_select(const char *name);
+const char *tracker_kernel_name(void);
+const char *tracker_kernel_list(int index);
+int tracker_kernel_idle(
+    const struct tracker_kernel_periods *periods, int64_t idle_ns
+);
+int tracker_kernel_active(
+    const struct tracker_kernel_periods *periods, int64_t active_ns
+);
+
+#endif
@@ -0,0 +1,820 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * norsi-loadgen: puts load on a running daemon's query socket and measures
+ * how quickly it answers.
+ *
+ * Requests are spread over a number of connections, each with up to a given
+ * number of requests in flight (pipelined). With a target rate, requests are
+ * due at fixed intervals, and latency is measured from when each was due (not
+ * from when there was room to send it), so a daemon that falls behind can't
+ * hide it. Without one, each connection sends a new request as soon as an
+ * answer comes back.
+ *
+ * Only requests with a well-defined end to their answer can be used: `status`
+ * and `metrics` (one line each) and `history ...` (ends with the `total`
+ * line). An `error` line ends any answer, and is counted separately.
+ **/
+
+#include <errno.h>
+#include <linux/limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "paths.h"
+
+#define LOADGEN_NS_PER_SECOND 1000000000LL
+
+/**
+ * The most requests each connection can have in flight
+ **/
+#define LOADGEN_MAX_DEPTH 4096
+
+/**
+ * The most distinct requests that can be given (they're sent in turn)
+ **/
+#define LOADGEN_MAX_REQUESTS 16
+
+/**
+ * How long to wait for outstanding answers once everything has been sent (ms)
+ **/
+#define LOADGEN_DRAIN_MS 5000
+
+/**
+ * Latencies are kept in a log-linear histogram: 2^LOADGEN_SUB_BITS buckets for
+ * each power of two, so every bucket is within ~6% of the values in it
+ **/
+#define LOADGEN_SUB_BITS 4
+#define LOADGEN_SUB_BUCKETS (1 << LOADGEN_SUB_BITS)
+#define LOADGEN_BUCKETS ((64 - LOADGEN_SUB_BITS + 1) * LOADGEN_SUB_BUCKETS)
+
+/**
+ * How the answer to a request ends
+ **/
+enum loadgen_request_kind {
+    /* After a single line */
+    LOADGEN_SINGLE_LINE,
+    /* After a line starting with LOADGEN_TOTAL_PREFIX */
+    LOADGEN_UNTIL_TOTAL,
+};
+
+#define LOADGEN_TOTAL_PREFIX "{\"total\""
+#define LOADGEN_TOTAL_PREFIX_LEN (sizeof(LOADGEN_TOTAL_PREFIX) - 1)
+
+/**
+ * Any answer can be cut short by a line starting with this instead
+ **/
+#define LOADGEN_ERROR_PREFIX "{\"error\""
+#define LOADGEN_ERROR_PREFIX_LEN (sizeof(LOADGEN_ERROR_PREFIX) - 1)
+
+/**
+ * How much of the start of each answer line is kept (enough for either prefix)
+ **/
+#define LOADGEN_LINE_START_LEN 8
+
+/**
+ * A request that's been asked for on the command line
+ **/
+struct loadgen_request {
+    /* The line sent, including its newline */
+    char line[256];
+    size_t len;
+    enum loadgen_request_kind kind;
+};
+
+/**
+ * A connection to the daemon
+ **/
+struct loadgen_connection {
+    int fd;
+    /* When each request in flight was due, oldest first (ring of `depth`) */
+    long long *due_ns;
+    /* Which of `requests` each request in flight was */
+    unsigned char *request;
+    int head;
+    int in_flight;
+    /* Requests queued but not yet written */
+    char out[LOADGEN_MAX_DEPTH];
+    size_t out_len;
+    /* non-zero => waiting for the socket to take more */
+    int blocked;
+    /* How much of the current answer line has arrived, and how it starts */
+    size_t line_len;
+    char line_start[LOADGEN_LINE_START_LEN];
+};
+
+/**
+ * Options
+ **/
+static int connection_count = 1;
+static int depth = 1;
+static long rate = 0;
+static long total_requests = 100000;
+static double duration_s = 0;
+static int show_histogram = 0;
+static struct loadgen_request requests[LOADGEN_MAX_REQUESTS];
+static int request_count = 0;
+
+/**
+ * Progress
+ **/
+static struct loadgen_connection *connections = NULL;
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static long sent = 0;
+static long answered = 0;
+static long errors = 0;
+static long long start_ns = 0;
+static long long last_answer_ns = 0;
+
+/**
+ * Latency histogram (ns)
+ **/
+static long histogram[LOADGEN_BUCKETS];
+static long long max_latency_ns = 0;
+
+/**
+ * Get the current monotonic time in nanoseconds
+ **/
+static long long loadgen_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * LOADGEN_NS_PER_SECOND + now.tv_nsec;
+}
+
+/*******************************************************************************
+ * Histogram
+ ******************************************************************************/
+
+/**
+ * Get the bucket that `value` falls in
+ **/
+static int loadgen_bucket(long long value)
+{
+    if (value < LOADGEN_SUB_BUCKETS) {
+        return value < 0 ? 0 : (int)value;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - LOADGEN_SUB_BITS;
+
+    return ((shift + 1) << LOADGEN_SUB_BITS) + \
+        (int)((value >> shift) & (LOADGEN_SUB_BUCKETS - 1));
+}
+
+/**
+ * Get the largest value that falls in `bucket`
+ **/
+static long long loadgen_bucket_max(int bucket)
+{
+    if (bucket < LOADGEN_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int shift = (bucket >> LOADGEN_SUB_BITS) - 1;
+    long long sub = bucket & (LOADGEN_SUB_BUCKETS - 1);
+
+    return ((LOADGEN_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+static void loadgen_record(long long latency_ns)
+{
+    histogram[loadgen_bucket(latency_ns)]++;
+
+    if (latency_ns > max_latency_ns) {
+        max_latency_ns = latency_ns;
+    }
+}
+
+/**
+ * Get the latency that a fraction `p` of answers came within
+ **/
+static long long loadgen_percentile(double p)
+{
+    long target = (long)(p * answered + 0.999999);
+    long seen = 0;
+
+    for (int i = 0; i < LOADGEN_BUCKETS; i++) {
+        seen += histogram[i];
+
+        if (seen >= target && seen > 0) {
+            long long value = loadgen_bucket_max(i);
+            return value < max_latency_ns ? value : max_latency_ns;
+        }
+    }
+
+    return max_latency_ns;
+}
+
+/*******************************************************************************
+ * Connections
+ ******************************************************************************/
+
+/**
+ * Update which events are watched for on `connection`
+ **/
+static void loadgen_watch(struct loadgen_connection *connection)
+{
+    struct epoll_event event = {
+        .events = EPOLLIN | (connection->blocked ? EPOLLOUT : 0),
+        .data.ptr = connection,
+    };
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+}
+
+/**
+ * Write out whatever has been queued on `connection`
+ *
+ * Returns 0 on success, -1 if the connection failed
+ **/
+static int loadgen_flush(struct loadgen_connection *connection)
+{
+    size_t written = 0;
+
+    while (written < connection->out_len) {
+        ssize_t n = write(
+            connection->fd, &(connection->out[written]),
+            connection->out_len - written
+        );
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1 && errno == EAGAIN) {
+            break;
+        }
+        if (n == -1) {
+            fprintf(stderr, "unable to send (%s)\n", strerror(errno));
+            return -1;
+        }
+
+        written += n;
+    }
+
+    memmove(
+        connection->out, &(connection->out[written]),
+        connection->out_len - written
+    );
+    connection->out_len -= written;
+
+    int blocked = connection->out_len > 0;
+    if (blocked != connection->blocked) {
+        connection->blocked = blocked;
+        loadgen_watch(connection);
+    }
+
+    return 0;
+}
+
+/**
+ * Queue the next request on `connection`, which was due at `due_ns`
+ *
+ * Returns 0 on success, -1 if there's no room for it
+ **/
+static int loadgen_queue(struct loadgen_connection *connection,
+    long long due_ns)
+{
+    int which = sent % request_count;
+    const struct loadgen_request *request = &(requests[which]);
+
+    if (connection->in_flight == depth || \
+            connection->out_len + request->len > sizeof(connection->out)
+    ) {
+        return -1;
+    }
+
+    int slot = (connection->head + connection->in_flight) % depth;
+
+    connection->due_ns[slot] = due_ns;
+    connection->request[slot] = which;
+    connection->in_flight++;
+
+    memcpy(
+        &(connection->out[connection->out_len]), request->line, request->len
+    );
+    connection->out_len += request->len;
+    sent++;
+
+    return 0;
+}
+
+/**
+ * Check whether the line that just ended on `connection` starts with `prefix`
+ **/
+static int loadgen_line_starts(const struct loadgen_connection *connection,
+    const char *prefix, size_t prefix_len)
+{
+    return connection->line_len >= prefix_len && \
+        memcmp(connection->line_start, prefix, prefix_len) == 0;
+}
+
+/**
+ * Handle a complete line of an answer on `connection`. An error ends the
+ * answer, and is counted, but its latency isn't.
+ **/
+static void loadgen_line(struct loadgen_connection *connection, long long now)
+{
+    if (connection->in_flight == 0) {
+        /* Not an answer to anything we asked */
+        return;
+    }
+
+    const struct loadgen_request *request = \
+        &(requests[connection->request[connection->head]]);
+    int error = loadgen_line_starts(
+        connection, LOADGEN_ERROR_PREFIX, LOADGEN_ERROR_PREFIX_LEN
+    );
+
+    if (request->kind == LOADGEN_UNTIL_TOTAL && !error && \
+            !loadgen_line_starts(
+                connection, LOADGEN_TOTAL_PREFIX, LOADGEN_TOTAL_PREFIX_LEN
+            )
+    ) {
+        /* More of the answer to come */
+        return;
+    }
+
+    if (error) {
+        errors++;
+    } else {
+        loadgen_record(now - connection->due_ns[connection->head]);
+        answered++;
+    }
+    connection->head = (connection->head + 1) % depth;
+    connection->in_flight--;
+    last_answer_ns = now;
+}
+
+/**
+ * Read whatever answers have arrived on `connection`
+ *
+ * Returns 0 on success, -1 if the connection failed
+ **/
+static int loadgen_read(struct loadgen_connection *connection)
+{
+    char buffer[65536];
+    ssize_t n = read(connection->fd, buffer, sizeof(buffer));
+    long long now = loadgen_now_ns();
+
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+        return 0;
+    }
+    if (n <= 0) {
+        fprintf(stderr, "lost connection to the daemon\n");
+        return -1;
+    }
+
+    for (ssize_t i = 0; i < n; i++) {
+        if (buffer[i] == '\n') {
+            loadgen_line(connection, now);
+            connection->line_len = 0;
+            continue;
+        }
+
+        if (connection->line_len < LOADGEN_LINE_START_LEN) {
+            connection->line_start[connection->line_len] = buffer[i];
+        }
+        connection->line_len++;
+    }
+
+    return 0;
+}
+
+/**
+ * Connect `connection_count` connections to the daemon's socket
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+static int loadgen_connect(void)
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    const char *folder = paths_get_runtime_folder();
+
+    if (folder == NULL || \
+            paths_join(
+                addr.sun_path, sizeof(addr.sun_path), folder, "socket.sock"
+            ) == -1
+    ) {
+        fprintf(stderr, "unable to find the daemon's socket\n");
+        return -1;
+    }
+
+    connections = calloc(connection_count, sizeof(*connections));
+    if (connections == NULL) {
+        return -1;
+    }
+    for (int i = 0; i < connection_count; i++) {
+        connections[i].fd = -1;
+    }
+
+    for (int i = 0; i < connection_count; i++) {
+        struct loadgen_connection *connection = &(connections[i]);
+
+        connection->due_ns = malloc(depth * sizeof(long long));
+        connection->request = malloc(depth);
+        connection->fd = socket(
+            AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0
+        );
+
+        if (connection->due_ns == NULL || connection->request == NULL || \
+                connection->fd == -1
+        ) {
+            fprintf(stderr, "unable to set up connection %i\n", i);
+            return -1;
+        }
+
+        /* Connecting to a unix socket doesn't wait on the other side */
+        if (connect(
+                connection->fd, (struct sockaddr *)&addr, sizeof(addr)
+            ) == -1
+        ) {
+            fprintf(
+                stderr, "unable to connect to %s (%s)\n", addr.sun_path,
+                strerror(errno)
+            );
+            return -1;
+        }
+
+        struct epoll_event event = {
+            .events = EPOLLIN,
+            .data.ptr = connection,
+        };
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) == -1) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static void loadgen_disconnect(void)
+{
+    for (int i = 0; connections != NULL && i < connection_count; i++) {
+        if (connections[i].fd != -1) {
+            close(connections[i].fd);
+        }
+        free(connections[i].due_ns);
+        free(connections[i].request);
+    }
+
+    free(connections);
+}
+
+/*******************************************************************************
+ * Main Logic
+ ******************************************************************************/
+
+/**
+ * Queue every request that's due (or, without a target rate, as many as there
+ * is room for)
+ *
+ * Returns 1 if it stopped because every connection was full, 0 otherwise
+ **/
+static int loadgen_queue_due(long long now)
+{
+    static int next_connection = 0;
+    int full = 0;
+
+    while (sent < total_requests && full < connection_count) {
+        long long due_ns = now;
+
+        if (rate > 0) {
+            due_ns = start_ns + sent * LOADGEN_NS_PER_SECOND / rate;
+            if (due_ns > now) {
+                break;
+            }
+        }
+
+        /* Spread requests over the connections, skipping any that are full */
+        if (loadgen_queue(&(connections[next_connection]), due_ns) == -1) {
+            full++;
+        } else {
+            full = 0;
+        }
+        next_connection = (next_connection + 1) % connection_count;
+    }
+
+    return full == connection_count;
+}
+
+/**
+ * Arm the timer for when the next request is due, or the run ends (whichever
+ * comes first). Waiting with a timer rather than an `epoll_wait` timeout
+ * keeps requests from being sent up to a millisecond late. While every
+ * connection is full (`all_full`), the next request has to wait for an answer
+ * instead, so only the end of the run is timed.
+ **/
+static void loadgen_arm_timer(long long end_ns, int all_full)
+{
+    long long until_ns = -1;
+
+    if (sent < total_requests && rate > 0 && !all_full) {
+        until_ns = start_ns + sent * LOADGEN_NS_PER_SECOND / rate;
+    }
+    if (end_ns != -1 && (until_ns == -1 || end_ns < until_ns)) {
+        until_ns = end_ns;
+    }
+
+    struct itimerspec spec = {0};
+    if (until_ns != -1) {
+        /* An all-zero time would disarm it */
+        spec.it_value.tv_sec = until_ns / LOADGEN_NS_PER_SECOND;
+        spec.it_value.tv_nsec = until_ns % LOADGEN_NS_PER_SECOND | 1;
+    }
+
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+/**
+ * Send the requests and collect the answers
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+static int loadgen_run(void)
+{
+    struct epoll_event events[64];
+    long long end_ns = -1;
+    int draining = 0;
+
+    start_ns = loadgen_now_ns();
+    if (duration_s > 0) {
+        end_ns = start_ns + (long long)(duration_s * LOADGEN_NS_PER_SECOND);
+    }
+
+    while (1) {
+        long long now = loadgen_now_ns();
+
+        if (!draining && (sent == total_requests || \
+                (end_ns != -1 && now >= end_ns)
+        )) {
+            /* Nothing more to send, wait for what's still in flight */
+            draining = 1;
+            total_requests = sent;
+            end_ns = now + LOADGEN_DRAIN_MS * 1000000LL;
+        }
+
+        if (draining && answered + errors == sent) {
+            return 0;
+        }
+        if (draining && now >= end_ns) {
+            fprintf(
+                stderr, "%li requests weren't answered\n",
+                sent - answered - errors
+            );
+            return -1;
+        }
+
+        int all_full = 0;
+        if (!draining) {
+            all_full = loadgen_queue_due(now);
+        }
+
+        for (int i = 0; i < connection_count; i++) {
+            if (connections[i].out_len > 0 && !connections[i].blocked && \
+                    loadgen_flush(&(connections[i])) == -1
+            ) {
+                return -1;
+            }
+        }
+
+        loadgen_arm_timer(end_ns, all_full);
+
+        int count = epoll_wait(epoll_fd, events, 64, -1);
+        if (count == -1 && errno != EINTR) {
+            fprintf(stderr, "epoll_wait failed (%s)\n", strerror(errno));
+            return -1;
+        }
+
+        for (int i = 0; i < count; i++) {
+            struct loadgen_connection *connection = events[i].data.ptr;
+
+            if (connection == NULL) {
+                /* The timer (it's re-armed before waiting again) */
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) < 0) {
+                    /* Already handled */
+                }
+                continue;
+            }
+
+            if ((events[i].events & EPOLLOUT) && \
+                    loadgen_flush(connection) == -1
+            ) {
+                return -1;
+            }
+            if ((events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) && \
+                    loadgen_read(connection) == -1
+            ) {
+                return -1;
+            }
+        }
+    }
+}
+
+/**
+ * Print the throughput and latencies
+ **/
+static void loadgen_report(void)
+{
+    long long elapsed_ns = last_answer_ns - start_ns;
+
+    printf(
+        "%li requests over %i connections (depth %i) in %.3fs: "
+        "%.0f requests/s\n",
+        answered, connection_count, depth, elapsed_ns / 1e9,
+        elapsed_ns > 0 ? answered * 1e9 / elapsed_ns : 0
+    );
+    if (errors > 0) {
+        printf("%li more requests were answered with an error\n", errors);
+    }
+    if (answered == 0) {
+        return;
+    }
+    printf(
+        "latency: p50 %.1fus, p99 %.1fus, p999 %.1fus, max %.1fus\n",
+        loadgen_percentile(0.5) / 1e3,
+        loadgen_percentile(0.99) / 1e3,
+        loadgen_percentile(0.999) / 1e3,
+        max_latency_ns / 1e3
+    );
+
+    if (!show_histogram) {
+        return;
+    }
+
+    long seen = 0;
+    for (int i = 0; i < LOADGEN_BUCKETS; i++) {
+        if (histogram[i] == 0) {
+            continue;
+        }
+
+        seen += histogram[i];
+        printf(
+            "  <= %10.1fus: %10li (%7.3f%%)\n",
+            loadgen_bucket_max(i) / 1e3, histogram[i], seen * 100.0 / answered
+        );
+    }
+}
+
+/**
+ * Add a request to send (in turn with any others)
+ *
+ * Returns 0 on success, -1 if it can't be used
+ **/
+static int loadgen_add_request(const char *line)
+{
+    struct loadgen_request *request = &(requests[request_count]);
+    size_t len = strlen(line);
+
+    if (request_count == LOADGEN_MAX_REQUESTS || \
+            len + 1 >= sizeof(request->line)
+    ) {
+        fprintf(stderr, "too many (or too long) requests\n");
+        return -1;
+    }
+
+    if (strcmp(line, "status") == 0 || strcmp(line, "metrics") == 0) {
+        request->kind = LOADGEN_SINGLE_LINE;
+    } else if (strncmp(line, "history ", 8) == 0) {
+        request->kind = LOADGEN_UNTIL_TOTAL;
+    } else {
+        fprintf(
+            stderr, "\"%s\" doesn't have an answer that can be timed\n", line
+        );
+        return -1;
+    }
+
+    memcpy(request->line, line, len);
+    request->line[len] = '\n';
+    request->len = len + 1;
+    request_count++;
+
+    return 0;
+}
+
+static void loadgen_usage(const char *name)
+{
+    fprintf(
+        stderr,
+        "usage: %s [-c CONNECTIONS] [-d DEPTH] [-r REQUESTS_PER_SECOND]\n"
+        "    [-n REQUESTS] [-t SECONDS] [-q REQUEST]... [-H]\n",
+        name
+    );
+}
+
+int main(int argc, char *argv[])
+{
+    int option;
+    int rc = 0;
+
+    while ((option = getopt(argc, argv, "c:d:r:n:t:q:H")) != -1) {
+        switch (option) {
+        case 'c':
+            connection_count = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 'r':
+            rate = atol(optarg);
+            break;
+        case 'n':
+            total_requests = atol(optarg);
+            break;
+        case 't':
+            duration_s = atof(optarg);
+            break;
+        case 'q':
+            if (loadgen_add_request(optarg) == -1) {
+                return 1;
+            }
+            break;
+        case 'H':
+            show_histogram = 1;
+            break;
+        default:
+            loadgen_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind != argc || connection_count <= 0 || depth <= 0 || \
+            depth > LOADGEN_MAX_DEPTH || rate < 0 || total_requests <= 0
+    ) {
+        loadgen_usage(argv[0]);
+        return 1;
+    }
+    if (request_count == 0) {
+        loadgen_add_request("status");
+    }
+
+    /* Every connection needs an FD */
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && \
+            limit.rlim_cur < (rlim_t)connection_count + 16
+    ) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+
+    struct epoll_event timer_event = {
+        .events = EPOLLIN,
+        .data.ptr = NULL,
+    };
+    if (epoll_fd == -1 || timer_fd == -1 || \
+            epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_event) == -1
+    ) {
+        fprintf(stderr, "unable to set up (%s)\n", strerror(errno));
+        rc = 1;
+    } else if (loadgen_connect() == -1 || loadgen_run() == -1) {
+        rc = 1;
+    }
+
+    if (answered + errors > 0) {
+        loadgen_report();
+    }
+    if (errors > 0) {
+        rc = 1;
+    }
+
+    loadgen_disconnect();
+    if (timer_fd != -1) {
+        close(timer_fd);
+    }
+    if (epoll_fd != -1) {
+        close(epoll_fd);
+    }
+
+    return rc;
+}
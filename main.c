@@ -18,24 +18,35 @@
 
 #include <bits/time.h>
 #include <errno.h>
-#include <poll.h>
+#include <linux/limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/signalfd.h>
 #include <time.h>
+#include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-client-core.h>
 #include <wayland-client-protocol.h>
 
-#include "idle-client-protocol.h"
+#include "compactor.h"
+#include "clock-source.h"
+#include "config-watch.h"
+#include "event-loop.h"
+#include "history.h"
+#include "idle-replay.h"
+#include "idle-source.h"
+#include "metrics.h"
 #include "query-handler.h"
+#include "rollup.h"
 #include "safety-tracker.h"
+#include "state-file.h"
+#include "status-page.h"
 
 void handle_sigterm(void);
 void handle_sigint(void);
 void cleanup_all(void);
-void signal_handler(int signo);
 
 /**
  * TODO: if user remains active for some period while program starts up, then
@@ -53,16 +64,41 @@ enum user_activity_state {
     USER_ACTIVE,
 };
 
+/**
+ * The maximum number of distinct idle thresholds the compositor is asked to
+ * watch for
+ **/
+#define MAX_IDLE_THRESHOLDS 64
+
+/**
+ * The longest the tracker goes without an update while the user is active, so
+ * the saved state is never more than this far behind
+ **/
+#define CHECKPOINT_SECONDS 60
+
+/**
+ * A compositor timeout which fires once the user has been idle long enough
+ * that some tracking period may need to be reset
+ **/
+struct idle_threshold {
+    /* Idle timeout for this threshold */
+    struct idle_timeout *timeout;
+    /* How long the user has been idle when it fires */
+    int idle_seconds;
+};
+
 /* Global state singleton */
 struct norsi_state {
     /* Wayland display */
     struct wl_display *display;
     /* Wayland seat */
     struct wl_seat *seat;
-    /* KDE Idle Manager (hands out timeout objects) */
-    struct org_kde_kwin_idle *idle_manager;
-    /* KDE Idle Timeout (used to see when user is inactive) */
-    struct org_kde_kwin_idle_timeout *idle_timeout;
+    /* Idle timeout (used to see when user is inactive), see idle-source.c */
+    struct idle_timeout *idle_timeout;
+    /* Timeouts for the longer idle durations the safety tracker cares about */
+    struct idle_threshold idle_thresholds[MAX_IDLE_THRESHOLDS];
+    /* Number of entries in `idle_thresholds` */
+    int idle_threshold_count;
     /* --- */
     /* 0 => no change in user state, other => check for change */
     int check_user_state;
@@ -70,18 +106,61 @@ struct norsi_state {
     enum user_activity_state user_state;
     /* Monotonic timestamp from when user state last changed */
     struct timespec user_state_timestamp;
+    /* Event loop registration for the wayland display */
+    struct event_source *display_source;
+    /* Timer set for the next instant the safety tracker could change state */
+    struct event_source *deadline_timer;
+    /* SIGINT/SIGTERM are read from this, rather than handled asynchronously */
+    int signal_fd;
+    /* Event loop registration for `signal_fd` */
+    struct event_source *signal_source;
 };
 
 static struct norsi_state main_state = {
     .display = NULL,
     .seat = NULL,
-    .idle_manager = NULL,
     .idle_timeout = NULL,
+    .idle_thresholds = {0},
+    .idle_threshold_count = 0,
     .check_user_state = 1,
     .user_state = USER_UNKNOWN,
-    .user_state_timestamp = {0}
+    .user_state_timestamp = {0},
+    .display_source = NULL,
+    .deadline_timer = NULL,
+    .signal_fd = -1,
+    .signal_source = NULL,
 };
 
+/**
+ * When this isn't -1, it gives the timestamp (in nanoseconds) for when we last
+ * told the safety tracker that the user was active (for a given period of
+ * activity, i.e. it will always be reset when the user goes from IDLE ->
+ * ACTIVE).
+ **/
+static int64_t last_active_update_ns = -1;
+
+/**
+ * non-zero => changes in the user's state are logged (not while replaying,
+ * where there can be millions of them)
+ **/
+static int log_user_state = 1;
+
+/**
+ * non-zero => activity is added to the rollups (not while replaying, as the
+ * rollups are dated by the wall clock, and the trace is already history)
+ **/
+static int update_rollups = 1;
+
+/**
+ * Get a timestamp in nanoseconds
+ **/
+static int64_t timespec_to_ns(const struct timespec *ts)
+{
+    return ts->tv_sec * TRACKER_NS_PER_SECOND + ts->tv_nsec;
+}
+
+static void update_tracker(void);
+
 /*******************************************************************************
  * Registry Handlers
  ******************************************************************************/
@@ -101,12 +180,8 @@ static void registry_listener_global(void *data,
             wl_registry, name, &wl_seat_interface, 7
         );
     }
-    if (strcmp(interface, org_kde_kwin_idle_interface.name) == 0) {
-        /* Bind to the idle manager interface to set up timeouts */
-        state->idle_manager = wl_registry_bind(
-            wl_registry, name, &org_kde_kwin_idle_interface, 1
-        );
-    }
+    /* The idle backends bind whichever idle managers they can use */
+    idle_source_registry_global(wl_registry, name, interface, version);
 }
 
 static void registry_listener_global_remove(void *data,
@@ -127,33 +202,111 @@ static const struct wl_registry_listener registry_listener = {
  ******************************************************************************/
 
 /* Handler for when user goes idle */
-static void idle_timer_idle(void *data, 
-    struct org_kde_kwin_idle_timeout *timeout
-)
+static void idle_timer_idle(void *data)
 {
     struct norsi_state *state = data;
+
+    /* Make sure all activity up to now is accounted for */
+    update_tracker();
+
     state->user_state = USER_IDLE;
-    clock_gettime(CLOCK_MONOTONIC, &(state->user_state_timestamp));
+    clock_source_now(&(state->user_state_timestamp));
     state->check_user_state = 1;
+    history_record(0);
 }
 
 /* handler for when user becomes active */
-static void idle_timer_resumed(void *data,
-    struct org_kde_kwin_idle_timeout *timeout
-)
+static void idle_timer_resumed(void *data)
 {
     struct norsi_state *state = data;
+    struct timespec now;
+    clock_source_now(&now);
+
+    if (state->user_state == USER_IDLE && update_rollups) {
+        /* Let the rollups know if that was a break */
+        rollup_provide_idle_seconds(
+            now.tv_sec - state->user_state_timestamp.tv_sec
+        );
+    }
+
     state->user_state = USER_ACTIVE;
-    clock_gettime(CLOCK_MONOTONIC, &(state->user_state_timestamp));
+    state->user_state_timestamp = now;
     state->check_user_state = 1;
+    history_record(1);
 }
 
 /* Listener to pick up changes in user's activity level */
-struct org_kde_kwin_idle_timeout_listener idle_timer_listener = {
+static const struct idle_timeout_listener idle_timer_listener = {
     .idle = idle_timer_idle,
     .resumed = idle_timer_resumed,
 };
 
+/* Handler for when user has been idle long enough to cross a threshold */
+static void idle_threshold_idle(void *data)
+{
+    struct idle_threshold *threshold = data;
+    tracker_provide_idle_ns(threshold->idle_seconds * TRACKER_NS_PER_SECOND);
+}
+
+/* Handler for when user becomes active after crossing a threshold */
+static void idle_threshold_resumed(void *data)
+{
+    /* Unused (the main idle timeout handles this) */
+}
+
+/* Listener to pick up idle thresholds being crossed */
+static const struct idle_timeout_listener idle_threshold_listener = {
+    .idle = idle_threshold_idle,
+    .resumed = idle_threshold_resumed,
+};
+
+/**
+ * Ask the compositor to let us know each time the user has been idle long
+ * enough that the safety tracker may need to reset some period
+ **/
+static void create_idle_thresholds(struct norsi_state *state)
+{
+    int thresholds[MAX_IDLE_THRESHOLDS];
+    int count = tracker_get_idle_thresholds(thresholds, MAX_IDLE_THRESHOLDS);
+    int created = 0;
+
+    for (int i = 0; i < count; i++) {
+        struct idle_threshold *threshold = &(state->idle_thresholds[created]);
+
+        threshold->idle_seconds = thresholds[i];
+        threshold->timeout = idle_source_get_timeout(
+            state->seat,
+            thresholds[i] * 1000, /* ms */
+            &idle_threshold_listener,
+            threshold
+        );
+
+        if (threshold->timeout == NULL) {
+            fprintf(
+                stderr, "unable to watch for %is of idleness\n", thresholds[i]
+            );
+            continue;
+        }
+
+        created++;
+    }
+
+    state->idle_threshold_count = created;
+}
+
+/**
+ * Release all timeouts created by `create_idle_thresholds`
+ **/
+static void destroy_idle_thresholds(struct norsi_state *state)
+{
+    for (int i = 0; i < state->idle_threshold_count; i++) {
+        idle_source_destroy_timeout(state->idle_thresholds[i].timeout);
+        state->idle_thresholds[i].timeout = NULL;
+    }
+
+    state->idle_threshold_count = 0;
+}
+
 /*******************************************************************************
  * Main Logic
  ******************************************************************************/
@@ -163,22 +316,49 @@ struct org_kde_kwin_idle_timeout_listener idle_timer_listener = {
  **/
 void cleanup_all(void)
 {
+    printf("saving tracker state\n");
+    state_file_cleanup();
+
+    printf("cleaning up status page\n");
+    status_page_cleanup();
+
     printf("cleaning up query handler\n");
     query_handler_cleanup();
 
+    printf("cleaning up history\n");
+    compactor_stop();
+    rollup_cleanup();
+    history_cleanup();
+
+    printf("cleaning up config watch\n");
+    config_watch_cleanup();
+
+    printf("cleaning up event loop\n");
+    event_loop_remove_source(main_state.deadline_timer);
+    main_state.deadline_timer = NULL;
+    event_loop_remove_source(main_state.display_source);
+    main_state.display_source = NULL;
+    event_loop_remove_source(main_state.signal_source);
+    main_state.signal_source = NULL;
+    event_loop_cleanup();
+
+    if (main_state.signal_fd != -1) {
+        close(main_state.signal_fd);
+        main_state.signal_fd = -1;
+    }
+
+    printf("cleaning up tracker\n");
+    tracker_cleanup();
+
     printf("cleaning up wayland objects\n");
+    destroy_idle_thresholds(&main_state);
+
     if (main_state.idle_timeout != NULL) {
-        org_kde_kwin_idle_timeout_release(main_state.idle_timeout);
-        /* TODO: figure out why call to _timeout_destroy causes segfault */
-        //org_kde_kwin_idle_timeout_destroy(main_state.idle_timeout);
-        /* Is _timeout_release handling this for us? */
+        idle_source_destroy_timeout(main_state.idle_timeout);
         main_state.idle_timeout = NULL;
     }
 
-    if (main_state.idle_manager != NULL) {
-        org_kde_kwin_idle_destroy(main_state.idle_manager);
-        main_state.idle_manager = NULL;
-    }
+    idle_source_cleanup();
 
     if (main_state.seat != NULL) {
         wl_seat_destroy(main_state.seat);
@@ -211,11 +391,19 @@ void handle_sigterm(void)
 }
 
 /**
- * Global signal handler
+ * Called by the event loop when SIGINT/SIGTERM have been received. Shutting
+ * down from here (rather than a signal handler) means it always happens on
+ * the main thread, between handlers, with no locks held.
  **/
-void signal_handler(int signo)
+static void signal_ready(int fd, uint32_t events, void *data)
 {
-    switch (signo) {
+    struct signalfd_siginfo info;
+
+    if (read(fd, &info, sizeof(info)) != sizeof(info)) {
+        return;
+    }
+
+    switch (info.ssi_signo) {
         case SIGINT:
             fprintf(stderr, "received SIGINT\n");
             handle_sigint();
@@ -225,18 +413,281 @@ void signal_handler(int signo)
             handle_sigterm();
             break;
         default:
-            fprintf(stderr, "received unhandled signal (%i)\n", signo);
+            fprintf(
+                stderr, "received unhandled signal (%i)\n", info.ssi_signo
+            );
+            break;
+    }
+}
+
+/**
+ * Set the deadline timer for the next instant that some tracking period will go
+ * beyond its limit, given how long the user has been active (or the next
+ * checkpoint, if that comes first).
+ **/
+static void schedule_tracker_update(int64_t now_ns, int64_t elapsed_ns)
+{
+    int64_t remaining_ns = tracker_ns_until_deadline(elapsed_ns);
+    int64_t when_ns;
+
+    if (remaining_ns == -1 || \
+            remaining_ns > CHECKPOINT_SECONDS * TRACKER_NS_PER_SECOND
+    ) {
+        remaining_ns = CHECKPOINT_SECONDS * TRACKER_NS_PER_SECOND;
+    }
+
+    when_ns = now_ns + remaining_ns;
+
+    event_loop_arm_timer_at(main_state.deadline_timer, &(struct timespec){
+        .tv_sec = when_ns / TRACKER_NS_PER_SECOND,
+        .tv_nsec = when_ns % TRACKER_NS_PER_SECOND,
+    });
+}
+
+/**
+ * Tell the safety tracker how much time the user has spent in their current
+ * state since it was last told.
+ **/
+static void update_tracker(void)
+{
+    /* Take note if the timeouts indicate a change in the user's state */
+    if (main_state.check_user_state) {
+        main_state.check_user_state = 0;
+
+        switch (main_state.user_state) {
+        case USER_UNKNOWN:
+            if (log_user_state) {
+                fprintf(stderr, "user state unknown\n");
+            }
+            break;
+        case USER_IDLE:
+            if (log_user_state) {
+                fprintf(stderr, "user is idle\n");
+            }
+            /* Idle thresholds are reported by the compositor */
+            event_loop_arm_timer_at(
+                main_state.deadline_timer, &(struct timespec){0}
+            );
+            break;
+        case USER_ACTIVE:
+            if (log_user_state) {
+                fprintf(stderr, "user is active\n");
+            }
+            last_active_update_ns = -1;
+            tracker_schedule_active(0);
             break;
+        }
+    }
+
+    if (main_state.user_state == USER_ACTIVE) {
+        struct timespec now;
+        clock_source_now(&now);
+
+        int64_t now_ns = timespec_to_ns(&now);
+        int64_t change_ns = timespec_to_ns(&main_state.user_state_timestamp);
+
+        if (last_active_update_ns == -1) {
+            /* We just changed to the active state */
+            last_active_update_ns = change_ns;
+        }
+
+        /* Tell the tracker how much longer we've been ACTIVE */
+        if (now_ns > last_active_update_ns) {
+            /**
+             * The rollups count whole seconds, so give them the seconds
+             * boundaries crossed since last time (which add up over time)
+             **/
+            int active_s = \
+                now.tv_sec - last_active_update_ns / TRACKER_NS_PER_SECOND;
+
+            tracker_provide_active_ns(now_ns - last_active_update_ns);
+            if (active_s > 0 && update_rollups) {
+                rollup_provide_active_seconds(active_s);
+            }
+            last_active_update_ns = now_ns;
+        }
+
+        schedule_tracker_update(now_ns, now_ns - change_ns);
     }
 }
 
+/**
+ * Called by the event loop when the deadline timer expires, or whenever the
+ * loop wakes up (so that the tracker is current before queries are answered)
+ **/
+static void tracker_update_due(void *data)
+{
+    update_tracker();
+}
+
+/**
+ * Called by the event loop when a new version of the config file is in place.
+ * The tracker has already been brought up to date (by the wakeup handler), so
+ * the new periods can be swapped in right away.
+ **/
+static void config_changed(void *data)
+{
+    char path[PATH_MAX];
+
+    /* Problems are reported by the tracker, and the old periods are kept */
+    if (tracker_get_config_path(path, sizeof(path)) == -1 || \
+            tracker_load_config(path) != 0
+    ) {
+        return;
+    }
+
+    fprintf(stderr, "reloaded %s\n", path);
+
+    /**
+     * The new periods may need different idle thresholds. Note that the new
+     * timeouts only start counting now, so if the user is already idle the
+     * thresholds are crossed later than they really were.
+     **/
+    destroy_idle_thresholds(&main_state);
+    create_idle_thresholds(&main_state);
+
+    /**
+     * Deadlines were dropped along with the old periods. If a change in the
+     * user's state is still pending, they'll be scheduled when it's handled.
+     **/
+    if (main_state.user_state == USER_ACTIVE && !main_state.check_user_state) {
+        int64_t provided_ns = 0;
+
+        if (last_active_update_ns != -1) {
+            provided_ns = last_active_update_ns - \
+                timespec_to_ns(&main_state.user_state_timestamp);
+        }
+
+        tracker_schedule_active(provided_ns);
+        update_tracker();
+    }
+}
+
+/**
+ * Called by the event loop when the wayland display has events for us
+ **/
+static void display_ready(int fd, uint32_t events, void *data)
+{
+    struct norsi_state *state = data;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        fprintf(stderr, "lost connection to wayland display\n");
+        cleanup_all();
+    }
+
+    /* process incoming events */
+    int64_t started_ns = metrics_now_ns();
+
+    if (wl_display_dispatch(state->display) == -1) {
+        fprintf(
+            stderr, "failed to dispatch wayland events (%s)\n", strerror(errno)
+        );
+        cleanup_all();
+    }
+
+    metrics_add(METRICS_WAYLAND_DISPATCHES, 1);
+    metrics_observe(METRICS_WAYLAND_DISPATCH_NS, metrics_now_ns() - started_ns);
+}
+
+/**
+ * Called after each replayed event, as the main loop would be after
+ * dispatching wayland events
+ **/
+static void replay_step(void *data)
+{
+    if (main_state.check_user_state) {
+        update_tracker();
+    }
+}
+
+/**
+ * Put recorded history through the tracker instead of watching the compositor
+ * (see idle-replay.c). `argv` holds the arguments after `--replay`: optionally
+ * `--config FILE`, then the history segments to replay, oldest first. Nothing
+ * is saved, and the summary is printed to stdout.
+ *
+ * Returns the exit code
+ **/
+static int run_replay(int argc, char *argv[])
+{
+    const char *config = NULL;
+    int first = 0;
+    int rc = 0;
+
+    if (argc >= 2 && strcmp(argv[0], "--config") == 0) {
+        config = argv[1];
+        first = 2;
+    }
+    if (first >= argc) {
+        fprintf(stderr, "usage: norsi --replay [--config FILE] SEGMENT...\n");
+        return 1;
+    }
+
+    if (tracker_init() == -1) {
+        return 1;
+    }
+    if (config != NULL && (rc = tracker_load_config(config)) != 0) {
+        if (rc == 1) {
+            fprintf(stderr, "unable to read %s\n", config);
+        }
+        tracker_cleanup();
+        return 1;
+    }
+
+    for (int i = first; i < argc; i++) {
+        if (idle_replay_load(argv[i]) == -1) {
+            idle_replay_cleanup();
+            tracker_cleanup();
+            return 1;
+        }
+    }
+
+    /* The same handlers as usual, driven by the trace */
+    log_user_state = 0;
+    update_rollups = 0;
+    idle_source_use(&idle_backend_replay);
+
+    main_state.idle_timeout = idle_source_get_timeout(
+        NULL,
+        1000, /* ms */
+        &idle_timer_listener,
+        &main_state
+    );
+    if (main_state.idle_timeout == NULL) {
+        fprintf(stderr, "unable to create idle timeout\n");
+        rc = 1;
+    } else {
+        create_idle_thresholds(&main_state);
+        rc = idle_replay_run(replay_step, NULL) == 0 ? 0 : 1;
+    }
+
+    destroy_idle_thresholds(&main_state);
+    idle_source_destroy_timeout(main_state.idle_timeout);
+    idle_source_cleanup();
+    idle_replay_cleanup();
+    tracker_cleanup();
+
+    return rc;
+}
+
 int main(int argc, char *argv[])
 {
     /* TODO: ensure that noRSI isn't already running */
 
-    /* Set-up signal handlers */
-    signal(SIGINT, signal_handler);
-    signal(SIGTERM, signal_handler);
+    /* Writing to a client that has gone away is reported by write() instead */
+    signal(SIGPIPE, SIG_IGN);
+
+    metrics_init();
+
+    /* Replaying a trace doesn't need the compositor (or anything else) */
+    if (argc >= 2 && strcmp(argv[1], "--replay") == 0) {
+        return run_replay(argc - 2, argv + 2);
+    }
+
+    /* The periods decide which idle thresholds we'll need */
+    if (tracker_init() == -1) {
+        return -1;
+    }
 
     /** 
      * Connect to the display, and check the registry for the support we need
@@ -254,111 +705,114 @@ int main(int argc, char *argv[])
         fprintf(stderr, "No seat was found\n");
         return -1;
     }
-    if (main_state.idle_manager == NULL) {
+    if (idle_source_select() == -1) {
         fprintf(stderr, "No support for idle management found\n");
         return -1;
     }
+    printf("using %s for idle notifications\n", idle_source_name());
 
-    /* Create a new timeout */
-    main_state.idle_timeout = org_kde_kwin_idle_get_idle_timeout(
-        main_state.idle_manager,
+    /* Create a new timeout, and listen for it */
+    main_state.idle_timeout = idle_source_get_timeout(
         main_state.seat,
-        1000 /* ms */
-    );
-
-    /* Add listeners to the newly created timeout */
-    org_kde_kwin_idle_timeout_add_listener(
-        main_state.idle_timeout,
+        1000, /* ms */
         &idle_timer_listener,
         &main_state
     );
+    if (main_state.idle_timeout == NULL) {
+        fprintf(stderr, "unable to create idle timeout\n");
+        return -1;
+    }
+
+    /* Longer timeouts tell us when idleness should reset tracking periods */
+    create_idle_thresholds(&main_state);
     wl_display_roundtrip(main_state.display);
 
+    /* Everything we wait on is driven by a single event loop */
+    if (event_loop_init() == -1) {
+        return -1;
+    }
+
     /* we need this to manually manage the event loop */
     int display_fd = wl_display_get_fd(main_state.display);
 
-    /* Now that idle management is sorted, start up our query handler */
-    query_handler_init_server();
+    main_state.display_source = event_loop_add_fd(
+        display_fd, EPOLLIN, display_ready, &main_state
+    );
+    main_state.deadline_timer = event_loop_add_timer(tracker_update_due, NULL);
 
-    /* Here we'll poll only the wayland display's FD */
-    struct pollfd display_poll_fd = {
-        .fd = display_fd,
-        .events = POLLIN,
-        .revents = 0,
-    };
+    /**
+     * SIGINT/SIGTERM are blocked (before any other thread starts, so they all
+     * inherit it) and read through the event loop instead. Until now, they
+     * just end the program, as there's nothing to save yet.
+     **/
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    main_state.signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (main_state.signal_fd != -1) {
+        main_state.signal_source = event_loop_add_fd(
+            main_state.signal_fd, EPOLLIN, signal_ready, NULL
+        );
+    }
+
+    if (main_state.display_source == NULL || \
+            main_state.deadline_timer == NULL || \
+            main_state.signal_source == NULL
+    ) {
+        fprintf(stderr, "unable to set up event loop\n");
+        return -1;
+    }
 
     /**
-     * When this isn't -1, it gives the timestamp for when we last told the
-     * safety tracker that the user was active (for a given period of activity,
-     * i.e. it will always be reset when the user goes from IDLE -> ACTIVE).
+     * The tracker is only updated when something could change, so bring it up
+     * to date any time we wake up for other reasons (e.g. status requests)
      **/
-    int last_active_update = -1;
+    event_loop_set_wakeup_handler(tracker_update_due, NULL);
+
+    /* Pick up where we left off before anyone can ask for the status */
+    state_file_init();
+
+    /* Keep a log of every change in the user's state */
+    history_init();
+    rollup_init();
+
+    /* Old history is packed/trimmed on a separate thread */
+    compactor_start();
+
+    /* Now that idle management is sorted, start up our query handler */
+    query_handler_init_server();
+
+    /* Clients can also map the status without going through the socket */
+    status_page_init();
+
+    /* Changes to the config file take effect without a restart */
+    char config_path[PATH_MAX];
+    if (tracker_get_config_path(config_path, sizeof(config_path)) == 0) {
+        config_watch_init(config_path, config_changed, NULL);
+    }
 
     /* This will keep running until it receives a signal from the OS */
     while (1) {
-        /* Handle Wayland business*/
-        if (poll(&display_poll_fd, 1, 20) > 0) {
-            /* process incoming events */
-            wl_display_dispatch(main_state.display);
-            /* flush outgoing requests */
-            wl_display_flush(main_state.display);
-        }
+        /* Handle anything already queued, and flush outgoing requests */
+        wl_display_dispatch_pending(main_state.display);
+        wl_display_flush(main_state.display);
 
-        /* Take note if the timeouts indicate a change in the user's state */
-        if (main_state.check_user_state) {
-          main_state.check_user_state = 0;
-
-          switch (main_state.user_state) {
-          case USER_UNKNOWN:
-            fprintf(stderr, "user state unknown\n");
-            break;
-          case USER_IDLE:
-            fprintf(stderr, "user is idle\n");
-            break;
-          case USER_ACTIVE:
-            fprintf(stderr, "user is active\n");
-            last_active_update = -1;
-            break;
-          }
+        /* Sleep until there's something to do */
+        if (event_loop_dispatch(-1) == -1) {
+            cleanup_all();
         }
 
-        if (main_state.user_state != USER_UNKNOWN) {
-            struct timespec now;
-            struct timespec *last_change = \
-                &main_state.user_state_timestamp;
-            clock_gettime(CLOCK_MONOTONIC, &now);
-
-            /* If we're IDLE, we've already been idle for t_timeout */
-            /* If we're active, it starts at 0 (immediately) */
-            int offset = main_state.user_state == USER_IDLE ? 1 : 0;
-            int elapsed_s = offset + now.tv_sec - last_change->tv_sec;
-
-            switch (main_state.user_state) {
-                case USER_UNKNOWN:
-                    /* Nothing to report */
-                    break;
-                case USER_IDLE:
-                    /* Tell the tracker the total time we've been IDLE */
-                    tracker_provide_idle_seconds(elapsed_s);
-                    break;
-                case USER_ACTIVE:
-                    /* Tell the tracker how much longer we've been ACTIVE */
-                    if (elapsed_s > 0 && last_active_update < now.tv_sec) {
-                        /* Only report if at least 1 second has elapsed */
-                        if (last_active_update == -1) {
-                            /* We just chanaged to the active state */
-                            last_active_update = last_change->tv_sec;
-                        }
-                        tracker_provide_active_seconds(
-                            now.tv_sec - last_active_update
-                        );
-                        last_active_update = now.tv_sec;
-                    }
-                    break;
-            }
+        /* Handle any change in the user's state right away */
+        if (main_state.check_user_state) {
+            update_tracker();
         }
 
-        /* Handle any network activity from clients */
-        query_handler_run();
+        /* Let subscribed clients know if anything changed */
+        query_handler_publish_status();
+        status_page_publish();
+        state_file_save();
     }
 }
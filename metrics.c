@@ -0,0 +1,304 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Per-thread counters and histograms (see metrics.h), and the JSON report that
+ * adds them all up.
+ **/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "metrics.h"
+
+/**
+ * Starting size of the buffer the report is rendered into
+ **/
+#define METRICS_JSON_INITIAL_CAPACITY 4096
+
+static const char *const counter_names[METRICS_COUNTER_COUNT] = {
+    [METRICS_LOOP_WAKEUPS] = "loop_wakeups",
+    [METRICS_WAYLAND_DISPATCHES] = "wayland_dispatches",
+    [METRICS_ACCEPTS] = "accepts",
+    [METRICS_REFUSALS] = "refusals",
+    [METRICS_ACCEPT_PAUSES] = "accept_pauses",
+    [METRICS_BYTES_IN] = "bytes_in",
+    [METRICS_BYTES_OUT] = "bytes_out",
+    [METRICS_REQUESTS_STATUS] = "requests_status",
+    [METRICS_REQUESTS_SUBSCRIBE] = "requests_subscribe",
+    [METRICS_REQUESTS_HISTORY] = "requests_history",
+    [METRICS_REQUESTS_EXPORT] = "requests_export",
+    [METRICS_REQUESTS_INFO] = "requests_info",
+    [METRICS_REQUESTS_METRICS] = "requests_metrics",
+    [METRICS_REQUESTS_UNKNOWN] = "requests_unknown",
+    [METRICS_REQUESTS_OVERSIZED] = "requests_oversized",
+    [METRICS_SEGMENTS_PACKED] = "segments_packed",
+};
+
+static const char *const histogram_names[METRICS_HISTOGRAM_COUNT] = {
+    [METRICS_WAYLAND_DISPATCH_NS] = "wayland_dispatch_ns",
+    [METRICS_REQUEST_NS] = "request_ns",
+    [METRICS_STATUS_RENDER_NS] = "status_render_ns",
+};
+
+_Thread_local struct metrics_block *metrics_local = NULL;
+
+/**
+ * Every thread's block. The last one is shared by any threads beyond
+ * METRICS_MAX_THREADS.
+ **/
+static struct metrics_block blocks[METRICS_MAX_THREADS];
+
+/**
+ * Number of blocks handed out (may go past METRICS_MAX_THREADS)
+ **/
+static int block_count = 0;
+
+/**
+ * When `metrics_init` was called
+ **/
+static int64_t started_ns = 0;
+
+/**
+ * The last report, see `metrics_append`
+ **/
+static char *json = NULL;
+static size_t json_len = 0;
+static size_t json_capacity = 0;
+
+/**
+ * Give the calling thread a block of its own. This happens the first time it
+ * counts anything.
+ **/
+struct metrics_block *metrics_attach(void)
+{
+    int index = __atomic_fetch_add(&block_count, 1, __ATOMIC_RELAXED);
+
+    if (index >= METRICS_MAX_THREADS) {
+        index = METRICS_MAX_THREADS - 1;
+    }
+
+    metrics_local = &(blocks[index]);
+
+    return metrics_local;
+}
+
+/**
+ * Call this once at start-up (it's when uptime is counted from)
+ **/
+void metrics_init(void)
+{
+    started_ns = metrics_now_ns();
+}
+
+/**
+ * Get the largest value that falls in `bucket`
+ **/
+static uint64_t metrics_bucket_max(int bucket)
+{
+    if (bucket < METRICS_SUB_BUCKETS) {
+        return bucket;
+    }
+
+    int shift = (bucket >> METRICS_SUB_BITS) - 1;
+    uint64_t sub = bucket & (METRICS_SUB_BUCKETS - 1);
+
+    return ((METRICS_SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+/**
+ * Append to the report, growing the buffer as needed
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+static int metrics_append(const char *format, ...)
+{
+    va_list args;
+
+    while (1) {
+        size_t available = json_capacity - json_len;
+
+        va_start(args, format);
+        int needed = vsnprintf(&(json[json_len]), available, format, args);
+        va_end(args);
+
+        if (needed < 0) {
+            return -1;
+        }
+        if ((size_t)needed < available) {
+            json_len += needed;
+            return 0;
+        }
+
+        size_t capacity = json_capacity * 2;
+        if (capacity < json_len + needed + 1) {
+            capacity = json_len + needed + 1;
+        }
+
+        char *grown = realloc(json, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+
+        json = grown;
+        json_capacity = capacity;
+    }
+}
+
+/**
+ * Read a value from any thread's block
+ **/
+static uint64_t metrics_load(const uint64_t *value)
+{
+    return __atomic_load_n(value, __ATOMIC_RELAXED);
+}
+
+/**
+ * Get the value that a fraction `p` of the `count` values in `buckets` are at
+ * or below (an upper bound, within the precision of the buckets)
+ **/
+static uint64_t metrics_percentile(const uint64_t *buckets, uint64_t count,
+    uint64_t max_ns, double p)
+{
+    uint64_t target = (uint64_t)(p * count + 0.999999);
+    uint64_t seen = 0;
+
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += buckets[i];
+
+        if (seen >= target && seen > 0) {
+            uint64_t value = metrics_bucket_max(i);
+            return value < max_ns ? value : max_ns;
+        }
+    }
+
+    return max_ns;
+}
+
+/**
+ * Append a histogram (added up across threads) to the report
+ **/
+static void metrics_append_histogram(enum metrics_histogram histogram,
+    int threads)
+{
+    uint64_t buckets[METRICS_BUCKETS] = {0};
+    uint64_t count = 0;
+    uint64_t sum_ns = 0;
+    uint64_t max_ns = 0;
+
+    for (int t = 0; t < threads; t++) {
+        const struct metrics_histogram_data *data = \
+            &(blocks[t].histograms[histogram]);
+        uint64_t thread_max_ns = metrics_load(&(data->max_ns));
+
+        for (int i = 0; i < METRICS_BUCKETS; i++) {
+            buckets[i] += metrics_load(&(data->buckets[i]));
+        }
+        count += metrics_load(&(data->count));
+        sum_ns += metrics_load(&(data->sum_ns));
+        if (thread_max_ns > max_ns) {
+            max_ns = thread_max_ns;
+        }
+    }
+
+    metrics_append(
+        "\"%s\":{\"count\":%llu,\"mean\":%llu,\"max\":%llu,\"p50\":%llu,"
+        "\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"buckets\":[",
+        histogram_names[histogram],
+        (unsigned long long)count,
+        (unsigned long long)(count > 0 ? sum_ns / count : 0),
+        (unsigned long long)max_ns,
+        (unsigned long long)metrics_percentile(buckets, count, max_ns, 0.5),
+        (unsigned long long)metrics_percentile(buckets, count, max_ns, 0.9),
+        (unsigned long long)metrics_percentile(buckets, count, max_ns, 0.99),
+        (unsigned long long)metrics_percentile(buckets, count, max_ns, 0.999)
+    );
+
+    /* Only buckets with something in them, as [upper bound, count] */
+    int first = 1;
+    for (int i = 0; i < METRICS_BUCKETS; i++) {
+        if (buckets[i] == 0) {
+            continue;
+        }
+
+        metrics_append(
+            "%s[%llu,%llu]", first ? "" : ",",
+            (unsigned long long)metrics_bucket_max(i),
+            (unsigned long long)buckets[i]
+        );
+        first = 0;
+    }
+
+    metrics_append("]}");
+}
+
+/**
+ * Get a JSON report of every counter and histogram, on a single line. The
+ * returned string is valid until the next call, and its length is stored in
+ * `len`.
+ **/
+const char *metrics_get_json(int *len)
+{
+    int threads = __atomic_load_n(&block_count, __ATOMIC_RELAXED);
+
+    if (threads > METRICS_MAX_THREADS) {
+        threads = METRICS_MAX_THREADS;
+    }
+
+    json_len = 0;
+    if (json == NULL) {
+        json = malloc(METRICS_JSON_INITIAL_CAPACITY);
+        if (json == NULL) {
+            *len = 0;
+            return "";
+        }
+        json_capacity = METRICS_JSON_INITIAL_CAPACITY;
+    }
+
+    metrics_append(
+        "{\"uptime_seconds\":%.3f,\"threads\":%i,\"counters\":{",
+        (metrics_now_ns() - started_ns) / 1e9, threads
+    );
+
+    for (int c = 0; c < METRICS_COUNTER_COUNT; c++) {
+        uint64_t total = 0;
+
+        for (int t = 0; t < threads; t++) {
+            total += metrics_load(&(blocks[t].counters[c]));
+        }
+
+        metrics_append(
+            "%s\"%s\":%llu", c > 0 ? "," : "", counter_names[c],
+            (unsigned long long)total
+        );
+    }
+
+    metrics_append("},\"histograms\":{");
+    for (int h = 0; h < METRICS_HISTOGRAM_COUNT; h++) {
+        if (h > 0) {
+            metrics_append(",");
+        }
+        metrics_append_histogram(h, threads);
+    }
+    metrics_append("}}\n");
+
+    *len = json_len;
+
+    return json;
+}
@@ -0,0 +1,189 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Locations of the files/folders that noRSI uses.
+ **/
+
+#include <errno.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "paths.h"
+
+/**
+ * e.g. /run/user/1000/norsi
+ **/
+static char runtime_folder[PATH_MAX] = {0};
+
+/**
+ * e.g. /home/user/.local/state/norsi
+ **/
+static char state_folder[PATH_MAX] = {0};
+
+/**
+ * e.g. /home/user/.config/norsi
+ **/
+static char config_folder[PATH_MAX] = {0};
+
+/**
+ * Get the folder that runtime files (socket, status page, ...) are created in
+ *
+ * e.g. /run/user/1000/norsi
+ *
+ * note: in the future we may support systems that don't use XDG
+ **/
+const char *paths_get_runtime_folder(void)
+{
+    char *folder = NULL;
+    int curr_path_len = 0;
+
+    if (runtime_folder[0] == '\0') {
+        /* runtime folder hasn't been calculated yet */
+        char *xdg_path = getenv("XDG_RUNTIME_DIR");
+
+        if (xdg_path != NULL) {
+            strncpy(runtime_folder, xdg_path, PATH_MAX - 1);
+            curr_path_len += strlen(runtime_folder);
+
+            strncat(runtime_folder, "/norsi", PATH_MAX - 1 - curr_path_len);
+
+            folder = runtime_folder;
+        } else {
+            /* TODO: handle XDG not available (e.g. use /tmp instead) */
+        }
+    } else {
+        /* cached value can be returned */
+        folder = runtime_folder;
+    }
+
+    return folder;
+}
+
+/**
+ * Get the folder that persistent state (tracker snapshot, history, ...) is kept
+ * in. This is `$XDG_STATE_HOME/norsi`, falling back to
+ * `$HOME/.local/state/norsi`.
+ *
+ * e.g. /home/user/.local/state/norsi
+ **/
+const char *paths_get_state_folder(void)
+{
+    if (state_folder[0] == '\0') {
+        /* state folder hasn't been calculated yet */
+        const char *xdg_path = getenv("XDG_STATE_HOME");
+        const char *home_path = getenv("HOME");
+        int len = -1;
+
+        if (xdg_path != NULL && xdg_path[0] != '\0') {
+            len = snprintf(state_folder, PATH_MAX, "%s/norsi", xdg_path);
+        } else if (home_path != NULL) {
+            len = snprintf(
+                state_folder, PATH_MAX, "%s/.local/state/norsi", home_path
+            );
+        }
+
+        if (len < 0 || len >= PATH_MAX) {
+            state_folder[0] = '\0';
+            return NULL;
+        }
+    }
+
+    return state_folder;
+}
+
+/**
+ * Get the folder that the user's configuration is read from. This is
+ * `$XDG_CONFIG_HOME/norsi`, falling back to `$HOME/.config/norsi`.
+ *
+ * e.g. /home/user/.config/norsi
+ **/
+const char *paths_get_config_folder(void)
+{
+    if (config_folder[0] == '\0') {
+        /* config folder hasn't been calculated yet */
+        const char *xdg_path = getenv("XDG_CONFIG_HOME");
+        const char *home_path = getenv("HOME");
+        int len = -1;
+
+        if (xdg_path != NULL && xdg_path[0] != '\0') {
+            len = snprintf(config_folder, PATH_MAX, "%s/norsi", xdg_path);
+        } else if (home_path != NULL) {
+            len = snprintf(
+                config_folder, PATH_MAX, "%s/.config/norsi", home_path
+            );
+        }
+
+        if (len < 0 || len >= PATH_MAX) {
+            config_folder[0] = '\0';
+            return NULL;
+        }
+    }
+
+    return config_folder;
+}
+
+/**
+ * Create a folder (with mode 0700), along with any missing parents
+ *
+ * Returns 0 on success, -1 otherwise (check errno)
+ **/
+int paths_make_folders(const char *path)
+{
+    char partial[PATH_MAX];
+
+    if (strlen(path) >= PATH_MAX) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    strcpy(partial, path);
+
+    /* Create each parent in turn (skipping the root) */
+    for (char *sep = strchr(partial + 1, '/'); sep; sep = strchr(sep + 1, '/')) {
+        *sep = '\0';
+        if (mkdir(partial, 0700) == -1 && errno != EEXIST) {
+            return -1;
+        }
+        *sep = '/';
+    }
+
+    if (mkdir(partial, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Build the path to `name` inside `folder`
+ *
+ * Returns 0 on success, -1 if it doesn't fit in `size` bytes
+ **/
+int paths_join(char *dst, size_t size, const char *folder, const char *name)
+{
+    int len = snprintf(dst, size, "%s/%s", folder, name);
+
+    if (len < 0 || (size_t)len >= size) {
+        return -1;
+    }
+
+    return 0;
+}
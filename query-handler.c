@@ -29,54 +29,145 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/limits.h>
-#include <poll.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "event-loop.h"
+#include "history.h"
+#include "metrics.h"
+#include "paths.h"
 #include "query-handler.h"
+#include "ring-buffer.h"
+#include "rollup.h"
 #include "safety-tracker.h"
 
 /**
- * The maximum number of backlogged connection requests
+ * The maximum number of backlogged connection requests (the kernel caps this
+ * at `net.core.somaxconn`)
  **/
-#define QUERY_HANDLER_MAX_CONNECTION_BACKLOG 1
+#define QUERY_HANDLER_MAX_CONNECTION_BACKLOG SOMAXCONN
 
 /**
- * The maximum number of simultaneous active client connections
+ * How long to stop accepting connections for after running out of FDs (unless
+ * a client leaves first)
  **/
-#define QUERY_HANDLER_MAX_CLIENTS 16
+#define QUERY_HANDLER_ACCEPT_RETRY_MS 1000
 
 /**
- * Maximum buffer length for incoming/outgoing data
+ * The number of client slots allocated up front (the table grows as needed)
  **/
-#define QUERY_HANDLER_MAX_CLIENT_BUFFER 1024
+#define QUERY_HANDLER_INITIAL_CLIENT_SLOTS 16
+
+/**
+ * How much room is made in a client's input buffer for each read
+ **/
+#define QUERY_HANDLER_READ_CHUNK 4096
+
+/**
+ * Once this much output is queued for a client, no more of its requests are
+ * handled, and no status is pushed to it, until some of it has been written
+ * (so a client that doesn't read its responses can't use up unbounded memory)
+ **/
+#define QUERY_HANDLER_OUT_HIGH_WATER (64 * 1024)
+
+/**
+ * The longest interval a subscriber can ask for between status pushes (longer
+ * ones are cut down to this)
+ **/
+#define QUERY_HANDLER_MAX_PUSH_INTERVAL_MS (60 * 60 * 1000)
+
+/**
+ * The number of history buckets rendered at a time while streaming a history
+ * response
+ **/
+#define QUERY_HANDLER_HISTORY_CHUNK 64
+
+/**
+ * Progress through a `history` response that is being streamed to a client
+ **/
+struct history_stream {
+    /* non-zero => the response is still being streamed */
+    int active;
+    /* Resolution of the buckets being sent */
+    enum rollup_level level;
+    /* Start of the next bucket to send */
+    int64_t next;
+    /* Start of the requested range */
+    int64_t from;
+    /* End of the requested range */
+    int64_t to;
+};
+
+/**
+ * Progress through an `export` response, which is sent straight from the
+ * history segment files to the client's socket
+ **/
+struct export_stream {
+    /* non-zero => the export is still being sent */
+    int active;
+    /* Base times of the segments being exported */
+    int64_t *segments;
+    /* Number of entries in `segments` */
+    int segment_count;
+    /* Index of the next segment to open */
+    int next_segment;
+    /* Number of segments sent so far */
+    int sent_count;
+    /* The segment being sent (or -1 between segments) */
+    int file_fd;
+    /* Offset of the next byte to send from `file_fd` */
+    off_t offset;
+    /* Bytes left to send from `file_fd` */
+    size_t remaining;
+};
 
 /**
  * The state kept for each connected client
  **/
 struct client_state {
+    /* Index of this client's slot in `clients` */
+    int id;
+    /* Connection FD */
+    int fd;
+    /* Event loop registration for the connection */
+    struct event_source *source;
     /* Input buffer */
-    unsigned char in[QUERY_HANDLER_MAX_CLIENT_BUFFER];
-    /* Amount of data in input buffer */
-    int in_len;
-    /* non-zero => a full message is ready for handling in input buffer */
-    int in_ready;
+    struct ring_buffer in;
+    /* Bytes at the front of `in` already known not to contain a newline */
+    size_t in_scanned;
+    /* non-zero => the client has shut down its end, and won't send more */
+    int read_closed;
+    /* non-zero => the rest of an oversized request is being skipped */
+    int discarding;
     /* Output buffer */
-    unsigned char out[QUERY_HANDLER_MAX_CLIENT_BUFFER];
-    /* Amount of data in output buffer */
-    int out_len;
+    struct ring_buffer out;
+    /* non-zero => status is pushed to this client whenever it changes */
+    int subscribed;
+    /* Minimum time between status pushes (for subscribed clients) */
+    int push_interval_ms;
+    /* Monotonic time (in ms) of the last status push */
+    long long last_push_ms;
+    /* The status generation that was last pushed */
+    unsigned long pushed_generation;
+    /* non-zero => a push was skipped because too much output was queued */
+    int push_held;
+    /* Neighbours in the list of subscribed clients */
+    struct client_state *prev_subscriber;
+    struct client_state *next_subscriber;
+    /* `history` response being streamed (other requests wait for it) */
+    struct history_stream history;
+    /* `export` response being sent (other requests wait for it) */
+    struct export_stream export;
 };
 
-/**
- * e.g. /run/user/1000/norsi
- **/
-static char socket_folder[PATH_MAX] = {0};
-
 /**
  * e.g. /run/user/1000/norsi/socket.sock
  **/
@@ -88,48 +179,73 @@ static char socket_path_full[PATH_MAX] = {0};
 static int socket_listener_fd = -1;
 
 /**
- * An entry for the state of each connected client
+ * Event loop registration for the listening socket
  **/
-static struct client_state client_state[QUERY_HANDLER_MAX_CLIENTS] = {0};
+static struct event_source *socket_listener_source = NULL;
 
 /**
- * Polling configuration for active client connections
+ * non-zero => new connections are being left in the backlog, as there were no
+ * FDs (or memory) for them
  **/
-static struct pollfd conn_poll_fds[QUERY_HANDLER_MAX_CLIENTS] = {0};
+static int accept_paused = 0;
 
 /**
- * Get the folder that the socket file is created in
- *
- * e.g. /run/user/1000/norsi
- *
- * note: in the future we may support systems that don't use XDG
+ * Timer for accepting connections again, in case no client leaves to free up
+ * an FD (e.g. when the whole system ran out)
  **/
-static const char *query_handler_get_socket_folder(void)
-{
-    char *folder = NULL;
-    int curr_path_len = 0;
+static struct event_source *accept_retry_timer = NULL;
 
-    if (socket_folder[0] == '\0') {
-        /* socket folder hasn't been calculated yet */
-        char *xdg_path = getenv("XDG_RUNTIME_DIR");
+/**
+ * The state of each connected client, indexed by client ID (NULL for slots
+ * that aren't in use)
+ **/
+static struct client_state **clients = NULL;
 
-        if (xdg_path != NULL) {
-            strncpy(socket_folder, xdg_path, PATH_MAX);
-            curr_path_len += strlen(socket_folder);
+/**
+ * Number of slots allocated in `clients`
+ **/
+static int client_slots = 0;
 
-            strncat(socket_folder, "/norsi", PATH_MAX - 1 - curr_path_len);
+/**
+ * Number of connected clients
+ **/
+static int client_count = 0;
 
-            folder = socket_folder;
-        } else {
-            /* TODO: handle XDG not available (e.g. use /tmp instead) */
-        }
-    } else {
-        /* cached value can be returned */
-        folder = socket_folder;
-    }
+/**
+ * Stack of unused slots in `clients`, so that a free one can be found without
+ * searching
+ **/
+static int *free_slots = NULL;
 
-    return folder;
-}
+/**
+ * Number of entries in `free_slots`
+ **/
+static int free_slot_count = 0;
+
+/**
+ * Clients that have subscribed to status pushes
+ **/
+static struct client_state *subscribers = NULL;
+
+/**
+ * Timer for status pushes held back by a subscriber's push interval
+ **/
+static struct event_source *push_timer = NULL;
+
+/**
+ * Monotonic time (in ms) the push timer is set for, or -1 if it isn't set
+ **/
+static long long push_timer_due_ms = -1;
+
+/**
+ * The status generation that subscribers were last told about
+ **/
+static unsigned long published_generation = 0;
+
+static void query_handler_accept(int fd, uint32_t events, void *data);
+static void query_handler_client_ready(int fd, uint32_t events, void *data);
+static void query_handler_push_timer_expired(void *data);
+static void query_handler_accept_retry_expired(void *data);
 
 /**
  * Get the full path to the filename of the socket file
@@ -141,25 +257,19 @@ static const char *query_handler_get_socket_folder(void)
 static const char *query_handler_get_full_socket_path(void)
 {
     char *path = NULL;
-    int curr_path_len = 0;
 
     if (socket_path_full[0] == '\0') {
         /* full socket path hasn't been calculated yet */
-        const char *folder = query_handler_get_socket_folder();
-
-        if (folder != NULL) {
-            strncpy(socket_path_full, folder, PATH_MAX);
-            curr_path_len += strlen(socket_path_full);
-
-            strncat(
-                socket_path_full,
-                "/socket.sock",
-                PATH_MAX - 1 - curr_path_len
-            );
+        const char *folder = paths_get_runtime_folder();
 
+        if (folder != NULL && paths_join(
+                socket_path_full, PATH_MAX, folder, "socket.sock"
+            ) == 0
+        ) {
             path = socket_path_full;
         } else {
             /* TODO: handle not being able to get socket folder */
+            socket_path_full[0] = '\0';
         }
     } else {
         /* cached value can be returned */
@@ -181,6 +291,41 @@ static int query_handler_make_socket_nonblocking(int fd)
     return fcntl(fd, F_SETFL, socket_flags);
 }
 
+/**
+ * Double the number of client slots (or allocate the initial slots), adding the
+ * new ones to the free list.
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+static int query_handler_grow_client_slots(void)
+{
+    int slots = client_slots > 0 ? \
+        client_slots * 2 : QUERY_HANDLER_INITIAL_CLIENT_SLOTS;
+
+    struct client_state **grown_clients = realloc(
+        clients, slots * sizeof(struct client_state *)
+    );
+    if (grown_clients == NULL) {
+        return -1;
+    }
+    clients = grown_clients;
+
+    int *grown_free_slots = realloc(free_slots, slots * sizeof(int));
+    if (grown_free_slots == NULL) {
+        return -1;
+    }
+    free_slots = grown_free_slots;
+
+    /* Push in reverse so that lower IDs get handed out first */
+    for (int i = slots - 1; i >= client_slots; i--) {
+        clients[i] = NULL;
+        free_slots[free_slot_count++] = i;
+    }
+    client_slots = slots;
+
+    return 0;
+}
+
 /**
  * Call this once at start-up to initialize the query handler
  **/
@@ -188,13 +333,13 @@ int query_handler_init_server(void)
 {
     int socket_fd;
     struct sockaddr_un addr;
-    const char *sock_folder = query_handler_get_socket_folder();
+    const char *sock_folder = paths_get_runtime_folder();
     const char *sock_path = query_handler_get_full_socket_path();
 
-    /* Initialize connection polling configs */
-    memset(conn_poll_fds, 0, sizeof(struct pollfd) * QUERY_HANDLER_MAX_CLIENTS);
-    for (int i = 0; i < QUERY_HANDLER_MAX_CLIENTS; i++) {
-        conn_poll_fds[i].fd = -1;
+    /* Initialize client slots */
+    if (query_handler_grow_client_slots() == -1) {
+        fprintf(stderr, "unable to allocate client slots during init\n");
+        return -1;
     }
 
     /* validate socket configuration */
@@ -260,272 +405,918 @@ int query_handler_init_server(void)
     /* Hang on to this FD globally */
     socket_listener_fd = socket_fd;
 
+    /* New connections are accepted as the event loop sees them come in */
+    socket_listener_source = event_loop_add_fd(
+        socket_fd, EPOLLIN, query_handler_accept, NULL
+    );
+
+    /* Used to hold back status pushes for rate-limited subscribers */
+    push_timer = event_loop_add_timer(query_handler_push_timer_expired, NULL);
+
+    accept_retry_timer = event_loop_add_timer(
+        query_handler_accept_retry_expired, NULL
+    );
+
     return 0;
 }
 
 /**
- * Get the number of actively connected clients
- */
-static int query_handler_current_client_count(void)
+ * Stop watching the listener (which is level-triggered, so it would wake us up
+ * straight away) until an FD is likely to be free again
+ **/
+static void query_handler_pause_accepting(void)
 {
-    int count = 0;
+    if (accept_paused || socket_listener_source == NULL) {
+        return;
+    }
 
-    for (int i = 0; i < QUERY_HANDLER_MAX_CLIENTS; i++) {
-        if (conn_poll_fds[i].fd >= 0) {
-            count++;
-        }
+    fprintf(
+        stderr, "unable to accept connections (%s), they'll have to wait\n",
+        strerror(errno)
+    );
+
+    event_loop_update_fd(socket_listener_source, 0);
+    event_loop_arm_timer(accept_retry_timer, QUERY_HANDLER_ACCEPT_RETRY_MS, 0);
+    accept_paused = 1;
+    metrics_add(METRICS_ACCEPT_PAUSES, 1);
+}
+
+/**
+ * Start accepting connections again after `query_handler_pause_accepting`
+ **/
+static void query_handler_resume_accepting(void)
+{
+    if (!accept_paused || socket_listener_source == NULL) {
+        return;
     }
 
-    return count;
+    event_loop_arm_timer(accept_retry_timer, 0, 0);
+    event_loop_update_fd(socket_listener_source, EPOLLIN);
+    accept_paused = 0;
+}
+
+/**
+ * Called by the event loop once it's time to try accepting connections again
+ **/
+static void query_handler_accept_retry_expired(void *data)
+{
+    query_handler_resume_accepting();
 }
 
 /**
  * Given a newly connected client's FD, store it in the global list used to
  * manage connections.
+ *
+ * Returns 0 on success, -1 otherwise
  **/
-static void query_handler_store_connection(int fd)
+static int query_handler_store_connection(int fd)
 {
-    for (int i = 0; i < QUERY_HANDLER_MAX_CLIENTS; i++) {
-        if (conn_poll_fds[i].fd == -1) {
-            conn_poll_fds[i].fd = fd;
-            conn_poll_fds[i].events = POLLIN;
-            conn_poll_fds[i].revents = 0;
+    if (free_slot_count == 0 && query_handler_grow_client_slots() == -1) {
+        return -1;
+    }
 
-            memset(&(client_state[i]), 0, sizeof(struct client_state));
+    struct client_state *cs = calloc(1, sizeof(struct client_state));
+    if (cs == NULL) {
+        return -1;
+    }
 
-            query_handler_make_socket_nonblocking(fd);
+    query_handler_make_socket_nonblocking(fd);
 
-            break;
+    /**
+     * Edge-triggered, so the registration never has to change: we read and
+     * write until the socket would block, and wait for the next edge.
+     **/
+    cs->fd = fd;
+    cs->export.file_fd = -1;
+    cs->source = event_loop_add_fd(
+        fd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+        query_handler_client_ready, cs
+    );
+    if (cs->source == NULL) {
+        free(cs);
+        return -1;
+    }
+
+    cs->id = free_slots[--free_slot_count];
+    clients[cs->id] = cs;
+    client_count++;
+
+    return 0;
+}
+
+/**
+ * Stop pushing status to a client
+ **/
+static void query_handler_unsubscribe(struct client_state *cs)
+{
+    if (!cs->subscribed) {
+        return;
+    }
+
+    if (cs->prev_subscriber != NULL) {
+        cs->prev_subscriber->next_subscriber = cs->next_subscriber;
+    } else {
+        subscribers = cs->next_subscriber;
+    }
+    if (cs->next_subscriber != NULL) {
+        cs->next_subscriber->prev_subscriber = cs->prev_subscriber;
+    }
+
+    cs->prev_subscriber = NULL;
+    cs->next_subscriber = NULL;
+    cs->subscribed = 0;
+}
+
+/**
+ * Shut down a client's connection and free up its slot. The client's state
+ * is freed, so it mustn't be used after this.
+ **/
+static void query_handler_drop_connection(struct client_state *cs)
+{
+    query_handler_unsubscribe(cs);
+
+    event_loop_remove_source(cs->source);
+
+    shutdown(cs->fd, SHUT_RDWR);
+    close(cs->fd);
+
+    ring_buffer_free(&(cs->in));
+    ring_buffer_free(&(cs->out));
+
+    if (cs->export.file_fd != -1) {
+        close(cs->export.file_fd);
+    }
+    free(cs->export.segments);
+
+    clients[cs->id] = NULL;
+    free_slots[free_slot_count++] = cs->id;
+    client_count--;
+
+    free(cs);
+
+    /* That freed up an FD for anyone waiting */
+    query_handler_resume_accepting();
+}
+
+/**
+ * Write out as much of a client's output buffer as the socket will take
+ *
+ * Returns 0 on success, -1 if the client had to be dropped
+ **/
+static int query_handler_flush(struct client_state *cs)
+{
+    while (ring_buffer_len(&(cs->out)) > 0) {
+        struct iovec regions[2];
+        int count = ring_buffer_readable_regions(&(cs->out), regions);
+
+        ssize_t write_count = writev(cs->fd, regions, count);
+
+        if (write_count == -1) {
+            if (errno == EAGAIN) {
+                /* Wait for the socket to become writeable again */
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+
+            fprintf(
+                stderr,
+                "unable to write to client (%s)\n",
+                strerror(errno)
+            );
+            query_handler_drop_connection(cs);
+            return -1;
         }
+
+        metrics_add(METRICS_BYTES_OUT, write_count);
+        ring_buffer_consume(&(cs->out), write_count);
     }
+
+    return 0;
 }
 
 /**
- * Checks if there are any complete messages that need handling
+ * Read whatever a client has sent into its input buffer
  *
- * Returns 1 if any complete messages are ready for handling
+ * Returns 1 if anything was read, 0 if the socket would block or the client
+ * has finished sending, or -1 if the client had to be dropped
  **/
-static int query_handler_message_ready(int client_id)
+static int query_handler_read(struct client_state *cs)
 {
-    struct client_state *cs = &(client_state[client_id]);
-    unsigned char *buff = cs->in;
+    struct iovec regions[2];
 
-    for (int i = 0; i < cs->in_len; i++) {
-        if (buff[i] == '\n') {
+    if (ring_buffer_reserve(&(cs->in), QUERY_HANDLER_READ_CHUNK) == -1) {
+        fprintf(stderr, "unable to grow input buffer for client %i\n", cs->id);
+        query_handler_drop_connection(cs);
+        return -1;
+    }
+
+    int count = ring_buffer_writable_regions(&(cs->in), regions);
+
+    while (1) {
+        ssize_t read_count = readv(cs->fd, regions, count);
+
+        if (read_count > 0) {
+            metrics_add(METRICS_BYTES_IN, read_count);
+            ring_buffer_commit(&(cs->in), read_count);
             return 1;
+        } else if (read_count == 0) {
+            /* Client has finished sending, but may still be reading */
+            cs->read_closed = 1;
+            return 0;
+        } else if (errno == EAGAIN) {
+            /* Nothing more to read for now */
+            return 0;
+        } else if (errno != EINTR) {
+            fprintf(
+                stderr,
+                "unable to read client request (%s)\n",
+                strerror(errno)
+            );
+            query_handler_drop_connection(cs);
+            return -1;
         }
     }
+}
 
-    return 0;
+/**
+ * Get the current monotonic time in milliseconds
+ **/
+static long long query_handler_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000LL + now.tv_nsec / 1000000;
 }
 
 /**
- * Handle a single message from some client's input buffer, causing responses
- * to be written to their output buffer.
+ * Add the current status to a client's output buffer
  *
- * returns non-zero on success
+ * Returns non-zero if the status was queued
  **/
-static int query_handler_handle_message(int client_id)
+static int query_handler_queue_status(struct client_state *cs)
 {
-    /* TODO: bounds checks */
-    struct client_state *cs = &(client_state[client_id]);
-    unsigned char *buff = cs->in;
-    char parse_buff[QUERY_HANDLER_MAX_CLIENT_BUFFER];
-    int msg_len = 0;
-    
-    memset(parse_buff, 0, QUERY_HANDLER_MAX_CLIENT_BUFFER);
-
-    for (int i = 0; i < cs->in_len; i++) {
-        if (buff[i] == '\n') {
-            msg_len = i;
-            break;
+    int status_len;
+    const char *status = tracker_get_status_json(&status_len);
+
+    if (ring_buffer_write(&(cs->out), status, status_len) == -1) {
+        fprintf(stderr, "unable to queue status for client %i\n", cs->id);
+        return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Queue the current status for a subscribed client
+ **/
+static void query_handler_push_status(struct client_state *cs, long long now_ms)
+{
+    if (query_handler_queue_status(cs)) {
+        cs->last_push_ms = now_ms;
+        cs->pushed_generation = tracker_get_status_generation();
+        cs->push_held = 0;
+    }
+}
+
+/**
+ * Make sure the push timer goes off by `due_ms` (which must be after `now_ms`)
+ **/
+static void query_handler_arm_push_timer(long long due_ms, long long now_ms)
+{
+    if (push_timer_due_ms > now_ms && push_timer_due_ms <= due_ms) {
+        /* It's already set to go off soon enough */
+        return;
+    }
+
+    push_timer_due_ms = due_ms;
+    event_loop_arm_timer(push_timer, due_ms - now_ms, 0);
+}
+
+/**
+ * Push the status to any subscribers that haven't seen the latest one, unless
+ * their push interval is holding them back (in which case the push timer is
+ * set for when the earliest of them is due).
+ **/
+static void query_handler_push_pending(void)
+{
+    unsigned long generation = tracker_get_status_generation();
+    long long now_ms = query_handler_now_ms();
+    long long next_due_ms = -1;
+    struct client_state *next = NULL;
+
+    for (struct client_state *cs = subscribers; cs != NULL; cs = next) {
+        /* Flushing may drop the client, so move along first */
+        next = cs->next_subscriber;
+
+        if (cs->pushed_generation == generation || cs->export.active) {
+            /* Nothing new, or it would land in the middle of an export */
+            continue;
+        }
+
+        if (ring_buffer_len(&(cs->out)) >= QUERY_HANDLER_OUT_HIGH_WATER) {
+            /* Only the latest status is sent once the client catches up */
+            cs->push_held = 1;
+            continue;
+        }
+
+        long long due_ms = cs->last_push_ms + cs->push_interval_ms;
+
+        if (due_ms <= now_ms) {
+            query_handler_push_status(cs, now_ms);
+            query_handler_flush(cs);
+        } else if (next_due_ms == -1 || due_ms < next_due_ms) {
+            next_due_ms = due_ms;
         }
     }
 
-    memcpy(parse_buff, cs->in, msg_len);
-    parse_buff[msg_len] = '\0';
+    if (next_due_ms != -1) {
+        query_handler_arm_push_timer(next_due_ms, now_ms);
+    }
+}
 
-    if (strcmp(parse_buff, "status") == 0) {
-        printf("client %i requested status\n", client_id);
+/**
+ * Called by the event loop once a held-back status push is due
+ **/
+static void query_handler_push_timer_expired(void *data)
+{
+    push_timer_due_ms = -1;
+    query_handler_push_pending();
+}
 
-        char *status = tracker_get_status_json();
-        /**
-         * TODO: can't do this if we don't have enough in out buffer (i.e. N
-         * consecutive status requests)
-         **/
-        memcpy(cs->out, status, strlen(status));
-        cs->out_len = strlen(status);
-        free(status);
-    } else if (strcmp(parse_buff, "info") == 0) {
-        /* TODO: this is just a dummy handler for testing */
-        printf("client %i requested info\n", client_id);
-    } else {
-        printf("client %i made unknown request\n", client_id);
+/**
+ * Queue a formatted line for a client
+ *
+ * Returns non-zero if the line was queued
+ **/
+static int query_handler_queue_line(struct client_state *cs,
+    const char *format, ...)
+{
+    char line[256];
+    va_list args;
+
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    if (len < 0 || (size_t)len >= sizeof(line)) {
+        return 0;
     }
 
-    /* Shift the input buffer to handle the next message */
-    /* +1 is for trailing newline */
-    memmove(cs->in, &(cs->in[msg_len + 1]), cs->in_len - (msg_len + 1));
-    cs->in_len -= msg_len + 1;
+    if (ring_buffer_write(&(cs->out), line, len) == -1) {
+        fprintf(stderr, "unable to queue response for client %i\n", cs->id);
+        return 0;
+    }
 
     return 1;
 }
 
 /**
- * This function is non-blocking and must be called continuously by the main
- * loop so that new connections are accepted, existing connections can have
- * their requests responded to, and so on.
- *
- * Returns 0 if everything is fine, -1 otherwise
+ * Handle a `subscribe [interval_ms]` request: the current status is sent
+ * straight away, then again each time it changes (but not more often than
+ * once per `interval_ms`) until the client disconnects.
  **/
-int query_handler_run(void)
+static void query_handler_subscribe(struct client_state *cs, const char *args)
 {
-    /**
-     * 1. Accept any new connections and store the FD, and set up for polling
-     * 2. Read in any new data from existing connections, buffer it till a full
-     *    request is present
-     * 3. Create and send responses for any connections that have made valid
-     *    requests
-     * 4. Shutdown/cleanup any connections that have been let go
-     **/
+    long interval_ms = 0;
+
+    if (*args != '\0') {
+        char *end;
+
+        interval_ms = strtol(args, &end, 10);
+        if (end == args || *end != '\0' || interval_ms < 0) {
+            query_handler_queue_line(
+                cs, "{\"error\":\"invalid interval\"}\n"
+            );
+            return;
+        }
+        if (interval_ms > QUERY_HANDLER_MAX_PUSH_INTERVAL_MS) {
+            interval_ms = QUERY_HANDLER_MAX_PUSH_INTERVAL_MS;
+        }
+    }
+
+    if (!cs->subscribed) {
+        cs->subscribed = 1;
+        cs->prev_subscriber = NULL;
+        cs->next_subscriber = subscribers;
+        if (subscribers != NULL) {
+            subscribers->prev_subscriber = cs;
+        }
+        subscribers = cs;
+    }
+    cs->push_interval_ms = interval_ms;
+
+    query_handler_push_status(cs, query_handler_now_ms());
+}
+
+/**
+ * Queue the next chunk of a `history` response. Once every bucket has been
+ * sent, a summary of the whole range ends the response.
+ **/
+static void query_handler_stream_history(struct client_state *cs)
+{
+    struct history_stream *stream = &(cs->history);
+    int count;
+    const struct rollup_bucket *buckets = rollup_get_buckets(
+        stream->level, stream->next, stream->to, &count
+    );
+
+    if (count > QUERY_HANDLER_HISTORY_CHUNK) {
+        count = QUERY_HANDLER_HISTORY_CHUNK;
+    }
+
+    for (int i = 0; i < count; i++) {
+        query_handler_queue_line(
+            cs,
+            "{\"start\":%lld,\"active_seconds\":%i,\"breaks\":%i,"
+            "\"longest_streak_seconds\":%i}\n",
+            (long long)buckets[i].start,
+            buckets[i].active_seconds,
+            buckets[i].break_count,
+            buckets[i].longest_streak_seconds
+        );
+    }
 
-    struct pollfd listener_poll_fd = {
-        .fd = socket_listener_fd,
-        .events = POLLIN,
-        .revents = 0,
+    if (count == QUERY_HANDLER_HISTORY_CHUNK) {
+        /* Pick up after the last bucket sent next time round */
+        stream->next = buckets[count - 1].start + 1;
+        return;
+    }
+
+    struct rollup_bucket summary;
+    rollup_summarize(stream->from, stream->to, &summary);
+
+    query_handler_queue_line(
+        cs,
+        "{\"total\":{\"from\":%lld,\"to\":%lld,\"active_seconds\":%i,"
+        "\"breaks\":%i,\"longest_streak_seconds\":%i}}\n",
+        (long long)stream->from,
+        (long long)stream->to,
+        summary.active_seconds,
+        summary.break_count,
+        summary.longest_streak_seconds
+    );
+
+    stream->active = 0;
+}
+
+/**
+ * Handle a `history <from> <to> <minute|hour|day>` request, where `from` and
+ * `to` are wall clock times (seconds since the epoch). Each bucket in the
+ * range that saw some activity is sent as a line of JSON, followed by a line
+ * with the totals for the whole range.
+ *
+ * The response is streamed a chunk at a time as the client reads it, so it
+ * never has to be held in memory all at once.
+ **/
+static void query_handler_history(struct client_state *cs, const char *args)
+{
+    static const char *level_names[ROLLUP_LEVELS] = {
+        [ROLLUP_MINUTE] = "minute",
+        [ROLLUP_HOUR] = "hour",
+        [ROLLUP_DAY] = "day",
     };
+    struct history_stream *stream = &(cs->history);
+    char *end;
+
+    /* Each argument has to be followed by at least one space */
+    errno = 0;
+    stream->from = strtoll(args, &end, 10);
+    if (end == args || *end != ' ' || errno == ERANGE) {
+        query_handler_queue_line(cs, "{\"error\":\"invalid from\"}\n");
+        return;
+    }
+
+    args = end;
+    errno = 0;
+    stream->to = strtoll(args, &end, 10);
+    if (end == args || *end != ' ' || errno == ERANGE || \
+            stream->to < stream->from
+    ) {
+        query_handler_queue_line(cs, "{\"error\":\"invalid to\"}\n");
+        return;
+    }
 
-    /* Handle any new incoming connections */
-    if (poll(&listener_poll_fd, 1, 0) == 1) {
-        /* new connections are coming in */
-        if (query_handler_current_client_count() < QUERY_HANDLER_MAX_CLIENTS) {
-            /* we have room to handle a new connection */
-            int new_conn_fd = accept(socket_listener_fd, NULL, NULL);
-
-            if (new_conn_fd != -1) {
-                printf("new client connection, fd=%i\n", new_conn_fd);
-                query_handler_store_connection(new_conn_fd); 
-            } else {
-                fprintf(
-                    stderr,
-                    "failed to accept incoming client connection (%s)\n",
-                    strerror(errno)
-                );
+    args = end + strspn(end, " ");
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        if (strcmp(args, level_names[level]) == 0) {
+            stream->level = level;
+            stream->next = stream->from;
+            stream->active = 1;
+            return;
+        }
+    }
+
+    query_handler_queue_line(cs, "{\"error\":\"invalid bucket\"}\n");
+}
+
+/**
+ * Handle an `export` request: every history segment is sent as a line of JSON
+ * giving its name and size, followed by exactly that many bytes of the raw
+ * segment file. A final line gives the number of segments sent.
+ **/
+static void query_handler_export(struct client_state *cs)
+{
+    struct export_stream *stream = &(cs->export);
+    int count = history_list_segments(&(stream->segments));
+
+    if (count == -1) {
+        query_handler_queue_line(cs, "{\"error\":\"no history\"}\n");
+        return;
+    }
+
+    stream->segment_count = count;
+    stream->next_segment = 0;
+    stream->sent_count = 0;
+    stream->file_fd = -1;
+    stream->active = 1;
+}
+
+/**
+ * Open the next segment of an export and queue the line introducing it, or
+ * queue the final line once there are no more segments.
+ **/
+static void query_handler_next_export_segment(struct client_state *cs)
+{
+    struct export_stream *stream = &(cs->export);
+
+    while (stream->next_segment < stream->segment_count) {
+        int64_t base_ms = stream->segments[stream->next_segment++];
+        int packed;
+        int fd = history_open_segment(base_ms, &packed);
+        struct stat info;
+
+        if (fd == -1) {
+            /* e.g. removed since the export started */
+            continue;
+        }
+
+        if (fstat(fd, &info) == -1) {
+            close(fd);
+            continue;
+        }
+
+        stream->file_fd = fd;
+        stream->offset = 0;
+        stream->remaining = info.st_size;
+        stream->sent_count++;
+
+        query_handler_queue_line(
+            cs, "{\"segment\":\"%013lld.%s\",\"bytes\":%zu}\n",
+            (long long)base_ms, packed ? "segp" : "seg", stream->remaining
+        );
+        return;
+    }
+
+    query_handler_queue_line(
+        cs, "{\"segments\":%i}\n", stream->sent_count
+    );
+
+    free(stream->segments);
+    stream->segments = NULL;
+    stream->active = 0;
+}
+
+/**
+ * Carry on sending an export. Segment contents go from the page cache straight
+ * to the socket with sendfile, so they never pass through the output buffer
+ * (which has to be empty before each segment is sent, to keep things in
+ * order).
+ *
+ * Returns 1 once the export is finished, 0 if the socket would block, or -1 if
+ * the client had to be dropped
+ **/
+static int query_handler_send_export(struct client_state *cs)
+{
+    struct export_stream *stream = &(cs->export);
+
+    while (stream->active || ring_buffer_len(&(cs->out)) > 0) {
+        if (ring_buffer_len(&(cs->out)) > 0) {
+            if (query_handler_flush(cs) == -1) {
+                return -1;
             }
-        } else {
-            fprintf(stderr, "too many clients connected to accept another\n");
+            if (ring_buffer_len(&(cs->out)) > 0) {
+                return 0;
+            }
+            continue;
+        }
+
+        if (stream->file_fd == -1) {
+            query_handler_next_export_segment(cs);
+            continue;
         }
+
+        if (stream->remaining == 0) {
+            close(stream->file_fd);
+            stream->file_fd = -1;
+            continue;
+        }
+
+        ssize_t sent = sendfile(
+            cs->fd, stream->file_fd, &(stream->offset), stream->remaining
+        );
+
+        if (sent == -1 && errno == EAGAIN) {
+            /* Wait for the socket to become writeable again */
+            return 0;
+        } else if (sent == -1 && errno == EINTR) {
+            continue;
+        } else if (sent <= 0) {
+            /* The client was promised more bytes than we can give them */
+            fprintf(
+                stderr, "unable to export history to client %i (%s)\n",
+                cs->id, sent == 0 ? "segment shrank" : strerror(errno)
+            );
+            query_handler_drop_connection(cs);
+            return -1;
+        }
+
+        metrics_add(METRICS_BYTES_OUT, sent);
+        stream->remaining -= sent;
     }
 
-    /**
-     *  1. Poll for POLLIN flags
-     *  2. > 0 means some clients received requests
-     *  3. read data for all with POLLIN revents
-     *  4. subroutine checks if a full request came in
-     *  5. subroutine cooks up a response and stores it in outgoing buffer
-     *  6. If outgoing data is available, POLLOUT flag is set
-     *  7. for all pollfd with revents POLLOUT, write out data from outgoing
-     *     buffer, if all of it was written, clear events POLLOUT (as we don't
-     *     need to know when to write)
-     **/
+    /* Catch up on any status push held back by the export */
+    if (cs->subscribed && \
+            cs->pushed_generation != tracker_get_status_generation()
+    ) {
+        query_handler_push_status(cs, query_handler_now_ms());
+    }
+
+    return 1;
+}
+
+/**
+ * Queue a report of the daemon's counters and latency histograms
+ **/
+static void query_handler_metrics(struct client_state *cs)
+{
+    int metrics_len;
+    const char *metrics = metrics_get_json(&metrics_len);
+
+    if (ring_buffer_write(&(cs->out), metrics, metrics_len) == -1) {
+        fprintf(stderr, "unable to queue metrics for client %i\n", cs->id);
+    }
+}
+
+/**
+ * Take the first complete message out of a client's input buffer and handle
+ * it, causing responses to be written to their output buffer. The scan for
+ * the end of the message picks up where the last one left off, so partial
+ * messages aren't searched again every time more data arrives.
+ *
+ * returns non-zero if there was a complete message, 0 otherwise
+ **/
+static int query_handler_handle_message(struct client_state *cs)
+{
+    char parse_buff[QUERY_HANDLER_MAX_REQUEST_LENGTH + 1];
+    long msg_len = ring_buffer_take_line(
+        &(cs->in), &(cs->in_scanned), parse_buff, sizeof(parse_buff)
+    );
+
+    if (msg_len == -1) {
+        return 0;
+    }
+
+    if (cs->discarding) {
+        /* That was the end of an oversized request (already counted) */
+        cs->discarding = 0;
+        return 1;
+    }
+
+    if (msg_len > QUERY_HANDLER_MAX_REQUEST_LENGTH) {
+        printf("client %i made oversized request\n", cs->id);
+        metrics_add(METRICS_REQUESTS_OVERSIZED, 1);
+        return 1;
+    }
+
+    int64_t started_ns = metrics_now_ns();
+
+    if (strcmp(parse_buff, "status") == 0) {
+        printf("client %i requested status\n", cs->id);
+        metrics_add(METRICS_REQUESTS_STATUS, 1);
+
+        query_handler_queue_status(cs);
+    } else if (strncmp(parse_buff, "subscribe", 9) == 0 && \
+            (parse_buff[9] == '\0' || parse_buff[9] == ' ')
+    ) {
+        printf("client %i subscribed to status\n", cs->id);
+        metrics_add(METRICS_REQUESTS_SUBSCRIBE, 1);
+
+        query_handler_subscribe(cs, &(parse_buff[9]));
+    } else if (strncmp(parse_buff, "history ", 8) == 0) {
+        printf("client %i requested history\n", cs->id);
+        metrics_add(METRICS_REQUESTS_HISTORY, 1);
+
+        query_handler_history(cs, &(parse_buff[8]));
+    } else if (strcmp(parse_buff, "export") == 0) {
+        printf("client %i requested export\n", cs->id);
+        metrics_add(METRICS_REQUESTS_EXPORT, 1);
+
+        query_handler_export(cs);
+    } else if (strcmp(parse_buff, "info") == 0) {
+        /* TODO: this is just a dummy handler for testing */
+        printf("client %i requested info\n", cs->id);
+        metrics_add(METRICS_REQUESTS_INFO, 1);
+    } else if (strcmp(parse_buff, "metrics") == 0) {
+        printf("client %i requested metrics\n", cs->id);
+        metrics_add(METRICS_REQUESTS_METRICS, 1);
 
-    /* Handle any existing connections */
-    if (poll(conn_poll_fds, QUERY_HANDLER_MAX_CLIENTS, 0) > 0) {
-        for (int i = 0; i < QUERY_HANDLER_MAX_CLIENTS; i++) {
-            struct pollfd *pfd = &(conn_poll_fds[i]);
-            struct client_state *cs = &(client_state[i]);
-           
-            if (!(pfd->revents & (POLLIN | POLLOUT))) {
-                /* skip handling if no flags are set for client */
+        query_handler_metrics(cs);
+    } else {
+        printf("client %i made unknown request\n", cs->id);
+        metrics_add(METRICS_REQUESTS_UNKNOWN, 1);
+    }
+
+    /* Only counts queueing the response, not sending it */
+    metrics_observe(METRICS_REQUEST_NS, metrics_now_ns() - started_ns);
+
+    return 1;
+}
+
+/**
+ * Called by the event loop when the listening socket has new connections
+ * waiting to be accepted. The listener is level-triggered, so anything left
+ * in the backlog (e.g. after running out of FDs) is picked up next time round.
+ **/
+static void query_handler_accept(int fd, uint32_t events, void *data)
+{
+    while (1) {
+        int new_conn_fd = accept(socket_listener_fd, NULL, NULL);
+
+        if (new_conn_fd == -1) {
+            if (errno == EAGAIN) {
+                break;
+            } else if (errno == EINTR) {
                 continue;
+            } else if (errno == EMFILE || errno == ENFILE || \
+                    errno == ENOBUFS || errno == ENOMEM
+            ) {
+                /* Leave the connections in the backlog until there's room */
+                query_handler_pause_accepting();
+                break;
+            }
+
+            /* Only this connection failed (e.g. it was aborted) */
+            fprintf(
+                stderr,
+                "failed to accept incoming client connection (%s)\n",
+                strerror(errno)
+            );
+            metrics_add(METRICS_REFUSALS, 1);
+            continue;
+        }
+
+        if (query_handler_store_connection(new_conn_fd) == -1) {
+            fprintf(stderr, "unable to store new client connection\n");
+            metrics_add(METRICS_REFUSALS, 1);
+            close(new_conn_fd);
+            break;
+        }
+
+        metrics_add(METRICS_ACCEPTS, 1);
+
+        printf("new client connection, fd=%i\n", new_conn_fd);
+    }
+}
+
+/**
+ * Called by the event loop when a client's connection has data waiting to be
+ * read, or has room for queued responses to be written. Since the connection
+ * is edge-triggered, everything available has to be dealt with before
+ * returning (unless we're waiting for the socket to become writeable).
+ *
+ *  1. handle any complete messages already buffered, queueing responses (a
+ *     `history` response being streamed has to finish first)
+ *  2. send any export in progress, and if the socket can't take all of it,
+ *     stop until it's writeable again
+ *  3. if too much output is queued, write it out, and if the socket can't
+ *     take enough of it, stop until it's writeable again
+ *  4. read more data, until the socket would block (or the client has shut
+ *     down its end)
+ *  5. write out data from outgoing buffer until it's empty, or the socket
+ *     would block (in which case we'll hear about it again once it's
+ *     writeable)
+ *  6. once a client that has shut down its end has been sent everything it
+ *     asked for, close the connection (unless it's subscribed)
+ **/
+static void query_handler_client_ready(int fd, uint32_t events, void *data)
+{
+    struct client_state *cs = data;
+
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        /* Closed in both directions, so nothing more can be sent either */
+        query_handler_drop_connection(cs);
+        return;
+    }
+
+    while (1) {
+        /* handle any complete messages in, queueing responses */
+        while (ring_buffer_len(&(cs->out)) < QUERY_HANDLER_OUT_HIGH_WATER && \
+                !cs->export.active
+        ) {
+            if (cs->history.active) {
+                query_handler_stream_history(cs);
+            } else if (!query_handler_handle_message(cs)) {
+                break;
             }
+        }
 
-            /* receive incoming data */
-            if (pfd->revents & POLLIN) {
-                unsigned char *read_to = &(cs->in[cs->in_len]);
-                int max_read = QUERY_HANDLER_MAX_CLIENT_BUFFER - cs->in_len;
-            
-                int read_count = read(pfd->fd, read_to, max_read);
-                cs->in_len = read_count;
-
-                if (read_count == 0) {
-                    /* No data waiting */
-                    pfd->revents &= ~POLLIN;
-                    shutdown(pfd->fd, SHUT_RDWR);
-                    close(pfd->fd);
-                    pfd->fd = -1;
-                } else if (read_count == -1) {
-                    fprintf(
-                        stderr,
-                        "unable to read client request (%s)\n",
-                        strerror(errno)
-                    );
-                    continue;
-                } else {
-                    pfd->revents &= ~POLLIN;
-               
-                    if (query_handler_message_ready(i)) {
-                        cs->in_ready = 1;
-                    }
-                }
+        if (cs->export.active) {
+            /* hold off on more requests until the export has gone out */
+            if (query_handler_send_export(cs) != 1) {
+                return;
             }
+            continue;
+        }
 
-            /* send outgoing data */
-            if (pfd->revents & POLLOUT) {
-                int write_count = write(
-                    conn_poll_fds[i].fd, cs->out, cs->out_len
-                );
-
-                if (write_count == -1) {
-                    fprintf(
-                        stderr,
-                        "unable to write to client (%s)\n",
-                        strerror(errno)
-                    );
-                    continue;
-                }
-
-                if (write_count == cs->out_len) {
-                    /* We don't have to keep polling to write */
-                    cs->out_len = 0;
-                    pfd->events &= ~POLLOUT;
-                } else if (write_count < cs->out_len) {
-                    /**
-                     * note that some data was sent, and shift what's left to
-                     * the start of the buffer
-                     **/
-                    memcpy(
-                        cs->out,
-                        &(cs->out[write_count]),
-                        cs->out_len - write_count
-                    );
-                    cs->out_len -= write_count;
-                }
+        if (ring_buffer_len(&(cs->out)) >= QUERY_HANDLER_OUT_HIGH_WATER) {
+            /* hold off on more requests until responses have gone out */
+            if (query_handler_flush(cs) == -1) {
+                return;
             }
+            if (ring_buffer_len(&(cs->out)) >= QUERY_HANDLER_OUT_HIGH_WATER) {
+                return;
+            }
+            continue;
+        }
+
+        if (cs->read_closed) {
+            /* Nothing more is coming (a partial request is ignored) */
+            break;
+        }
+
+        if (ring_buffer_len(&(cs->in)) > QUERY_HANDLER_MAX_REQUEST_LENGTH) {
+            /**
+             * Too long to be a request, so skip everything up to its newline
+             * (just as if it had all arrived at once)
+             **/
+            if (!cs->discarding) {
+                printf("client %i made oversized request\n", cs->id);
+                metrics_add(METRICS_REQUESTS_OVERSIZED, 1);
+                cs->discarding = 1;
+            }
+            ring_buffer_consume(&(cs->in), ring_buffer_len(&(cs->in)));
+            cs->in_scanned = 0;
+        }
 
-            /* handle any complete messages in, queueing responses */
-            if (query_handler_message_ready(i)) {
-                /**
-                 * TODO: it could be that we won't handle all messages that are
-                 * queued up because we don't have enough room in the output
-                 * buffer for all responses
-                 **/
-                while (query_handler_message_ready(i)) {
-                    query_handler_handle_message(i);
-                }
-
-                /**
-                 * If any responses are queued, wait till the socket becomes
-                 * writeable
-                 **/
-                if (cs->out_len > 0) {
-                    pfd->events |= POLLOUT;
-                }
+        /* receive incoming data */
+        int read_result = query_handler_read(cs);
+
+        if (read_result == -1) {
+            return;
+        } else if (read_result == 0) {
+            break;
+        }
+    }
+
+    /* send outgoing data */
+    if (query_handler_flush(cs) == -1) {
+        return;
+    }
+
+    /**
+     * Catch up on any status push held back while output was queued (once its
+     * push interval allows, which may be left to the push timer)
+     **/
+    if (cs->push_held && \
+            ring_buffer_len(&(cs->out)) < QUERY_HANDLER_OUT_HIGH_WATER
+    ) {
+        long long now_ms = query_handler_now_ms();
+        long long due_ms = cs->last_push_ms + cs->push_interval_ms;
+
+        if (due_ms > now_ms) {
+            query_handler_arm_push_timer(due_ms, now_ms);
+        } else {
+            query_handler_push_status(cs, now_ms);
+            if (query_handler_flush(cs) == -1) {
+                return;
             }
         }
     }
 
-    return 0;
+    if (cs->read_closed && !cs->subscribed && \
+            ring_buffer_len(&(cs->out)) == 0
+    ) {
+        /* Everything the client asked for has been sent */
+        query_handler_drop_connection(cs);
+    }
+}
+
+/**
+ * Call this after anything that could change the tracker's status, so that
+ * subscribed clients can be told about it.
+ **/
+void query_handler_publish_status(void)
+{
+    if (tracker_get_status_generation() == published_generation) {
+        /* Nothing new to tell anyone */
+        return;
+    }
+
+    published_generation = tracker_get_status_generation();
+    query_handler_push_pending();
 }
 
 /**
@@ -537,19 +1328,30 @@ int query_handler_run(void)
 int query_handler_cleanup(void)
 {
     /* Shut down all clients */
-    for (int i = 0; i < QUERY_HANDLER_MAX_CLIENTS; i++) {
-        struct pollfd *pfd = &(conn_poll_fds[i]);
-
-        if (pfd->fd != -1) {
+    for (int i = 0; i < client_slots; i++) {
+        if (clients[i] != NULL) {
             printf("dropping connection to client[%i]\n", i);
-            shutdown(pfd->fd, SHUT_RDWR);
-            close(pfd->fd);
-            pfd->fd = -1;
+            query_handler_drop_connection(clients[i]);
         }
     }
 
+    free(clients);
+    clients = NULL;
+    free(free_slots);
+    free_slots = NULL;
+    client_slots = 0;
+    free_slot_count = 0;
+
+    event_loop_remove_source(push_timer);
+    push_timer = NULL;
+    event_loop_remove_source(accept_retry_timer);
+    accept_retry_timer = NULL;
+
     /* Shut down server listener */
     if (socket_listener_fd != -1) {
+        event_loop_remove_source(socket_listener_source);
+        socket_listener_source = NULL;
+
         shutdown(socket_listener_fd, SHUT_RDWR);
         close(socket_listener_fd);
 
@@ -557,10 +1359,10 @@ int query_handler_cleanup(void)
     }
 
     /* Cleanup socket/folder so next invocation will go cleanly */
-    if (rmdir(socket_folder) == -1) {
+    if (rmdir(paths_get_runtime_folder()) == -1) {
         fprintf(
             stderr, "failed to delete folder: %s (%s)\n",
-            socket_folder,
+            paths_get_runtime_folder(),
             strerror(errno
         ));
     }
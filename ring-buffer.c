@@ -0,0 +1,304 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Growable ring buffers used to queue data going to/coming from clients.
+ *
+ * The read/write indices are free-running (they're only masked when used), so
+ * a full buffer and an empty buffer can be told apart without wasting a byte.
+ **/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring-buffer.h"
+
+/**
+ * The smallest amount of storage ever allocated for a buffer
+ **/
+#define RING_BUFFER_MIN_CAPACITY 256
+
+/**
+ * Get the number of bytes queued in the buffer
+ **/
+size_t ring_buffer_len(const struct ring_buffer *rb)
+{
+    return rb->tail - rb->head;
+}
+
+/**
+ * Make sure there's room for at least `extra` more bytes, growing the storage
+ * (to the next power of two) if needed.
+ *
+ * Returns 0 on success, -1 if the storage couldn't be grown
+ **/
+int ring_buffer_reserve(struct ring_buffer *rb, size_t extra)
+{
+    size_t len = ring_buffer_len(rb);
+    size_t capacity = rb->capacity > 0 ? rb->capacity : RING_BUFFER_MIN_CAPACITY;
+
+    while (capacity - len < extra) {
+        capacity *= 2;
+    }
+
+    if (capacity == rb->capacity) {
+        return 0;
+    }
+
+    unsigned char *data = malloc(capacity);
+    if (data == NULL) {
+        return -1;
+    }
+
+    /* Straighten out the queued data at the start of the new storage */
+    ring_buffer_peek(rb, data, len);
+    free(rb->data);
+
+    rb->data = data;
+    rb->capacity = capacity;
+    rb->head = 0;
+    rb->tail = len;
+
+    return 0;
+}
+
+/**
+ * Get the queued data as (up to) two contiguous regions, in order
+ *
+ * Returns the number of regions used
+ **/
+int ring_buffer_readable_regions(const struct ring_buffer *rb,
+    struct iovec regions[2])
+{
+    size_t len = ring_buffer_len(rb);
+
+    if (len == 0) {
+        return 0;
+    }
+
+    size_t start = rb->head & (rb->capacity - 1);
+    size_t first = rb->capacity - start;
+
+    if (first > len) {
+        first = len;
+    }
+
+    regions[0].iov_base = &(rb->data[start]);
+    regions[0].iov_len = first;
+
+    if (first == len) {
+        return 1;
+    }
+
+    regions[1].iov_base = rb->data;
+    regions[1].iov_len = len - first;
+
+    return 2;
+}
+
+/**
+ * Get the free space as (up to) two contiguous regions, in order. Call
+ * `ring_buffer_reserve` first to make sure there's some.
+ *
+ * Returns the number of regions used
+ **/
+int ring_buffer_writable_regions(const struct ring_buffer *rb,
+    struct iovec regions[2])
+{
+    size_t free_len = rb->capacity - ring_buffer_len(rb);
+
+    if (free_len == 0) {
+        return 0;
+    }
+
+    size_t start = rb->tail & (rb->capacity - 1);
+    size_t first = rb->capacity - start;
+
+    if (first > free_len) {
+        first = free_len;
+    }
+
+    regions[0].iov_base = &(rb->data[start]);
+    regions[0].iov_len = first;
+
+    if (first == free_len) {
+        return 1;
+    }
+
+    regions[1].iov_base = rb->data;
+    regions[1].iov_len = free_len - first;
+
+    return 2;
+}
+
+/**
+ * Mark `len` bytes of the free space as written (e.g. after reading into the
+ * regions from `ring_buffer_writable_regions`)
+ **/
+void ring_buffer_commit(struct ring_buffer *rb, size_t len)
+{
+    rb->tail += len;
+}
+
+/**
+ * Append `len` bytes to the buffer
+ *
+ * Returns 0 on success, -1 if the storage couldn't be grown
+ **/
+int ring_buffer_write(struct ring_buffer *rb, const void *src, size_t len)
+{
+    struct iovec regions[2];
+    const unsigned char *from = src;
+
+    if (ring_buffer_reserve(rb, len) == -1) {
+        return -1;
+    }
+
+    int count = ring_buffer_writable_regions(rb, regions);
+
+    for (int i = 0; i < count && len > 0; i++) {
+        size_t chunk = regions[i].iov_len < len ? regions[i].iov_len : len;
+
+        memcpy(regions[i].iov_base, from, chunk);
+        from += chunk;
+        len -= chunk;
+        ring_buffer_commit(rb, chunk);
+    }
+
+    return 0;
+}
+
+/**
+ * Copy up to `len` bytes from the front of the buffer without consuming them
+ *
+ * Returns the number of bytes copied
+ **/
+size_t ring_buffer_peek(const struct ring_buffer *rb, void *dst, size_t len)
+{
+    struct iovec regions[2];
+    unsigned char *to = dst;
+    size_t copied = 0;
+
+    int count = ring_buffer_readable_regions(rb, regions);
+
+    for (int i = 0; i < count && copied < len; i++) {
+        size_t chunk = regions[i].iov_len;
+
+        if (chunk > len - copied) {
+            chunk = len - copied;
+        }
+
+        memcpy(&(to[copied]), regions[i].iov_base, chunk);
+        copied += chunk;
+    }
+
+    return copied;
+}
+
+/**
+ * Find the first occurrence of `byte` at or after offset `from` (counted from
+ * the front of the buffer). Uses memchr, so long runs are searched a word or
+ * vector at a time.
+ *
+ * Returns the offset of the byte, or -1 if it isn't there
+ **/
+long ring_buffer_find(const struct ring_buffer *rb, size_t from, int byte)
+{
+    struct iovec regions[2];
+    size_t offset = 0;
+
+    int count = ring_buffer_readable_regions(rb, regions);
+
+    for (int i = 0; i < count; i++) {
+        size_t region_len = regions[i].iov_len;
+
+        if (from < offset + region_len) {
+            size_t skip = from > offset ? from - offset : 0;
+            unsigned char *start = (unsigned char *)regions[i].iov_base + skip;
+            unsigned char *found = memchr(start, byte, region_len - skip);
+
+            if (found != NULL) {
+                return offset + (found - (unsigned char *)regions[i].iov_base);
+            }
+        }
+
+        offset += region_len;
+    }
+
+    return -1;
+}
+
+/**
+ * Take the first complete line (ending in `\n`) off the front of the buffer,
+ * copying it into `dst` without its newline, and terminating it. A line that
+ * doesn't fit in `size` bytes is dropped without being copied.
+ *
+ * `scanned` holds how much of the front of the buffer is already known not
+ * to contain a newline, so a partial line isn't searched again every time more
+ * data arrives. Start it at 0, and keep it with the buffer.
+ *
+ * Returns the length of the line (which is `size` or more if it was dropped),
+ * or -1 if there isn't a complete line yet
+ **/
+long ring_buffer_take_line(struct ring_buffer *rb, size_t *scanned, char *dst,
+    size_t size)
+{
+    long line_len = ring_buffer_find(rb, *scanned, '\n');
+
+    if (line_len == -1) {
+        *scanned = ring_buffer_len(rb);
+        return -1;
+    }
+
+    if ((size_t)line_len < size) {
+        ring_buffer_peek(rb, dst, line_len);
+        dst[line_len] = '\0';
+    }
+
+    /* Nothing past this line has been scanned yet */
+    ring_buffer_consume(rb, line_len + 1);
+    *scanned = 0;
+
+    return line_len;
+}
+
+/**
+ * Drop `len` bytes from the front of the buffer. Once the buffer is empty its
+ * storage is released, so idle buffers cost nothing.
+ **/
+void ring_buffer_consume(struct ring_buffer *rb, size_t len)
+{
+    rb->head += len;
+
+    if (rb->head == rb->tail) {
+        ring_buffer_free(rb);
+    }
+}
+
+/**
+ * Release the buffer's storage, discarding anything queued
+ **/
+void ring_buffer_free(struct ring_buffer *rb)
+{
+    free(rb->data);
+
+    rb->data = NULL;
+    rb->capacity = 0;
+    rb->head = 0;
+    rb->tail = 0;
+}
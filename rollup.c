@@ -0,0 +1,747 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Per-minute/hour/day totals of the user's activity, so that reports over long
+ * ranges don't have to replay the raw history.
+ *
+ * The tables are rebuilt from the history log at start-up, then kept up to
+ * date as the tracker is told about activity/idleness. Days from history that
+ * has since been dropped (to keep its size down) are kept in an archive file
+ * in the state folder. Each table only holds
+ * buckets which saw some activity, sorted by start time, so any bucket can be
+ * found with a binary search. Ranges are summarized from the coarsest table
+ * that covers them, falling back to finer tables only at the edges.
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "history.h"
+#include "paths.h"
+#include "rollup.h"
+#include "safety-tracker.h"
+
+/* "NRSR" */
+#define ROLLUP_ARCHIVE_MAGIC 0x5253524e
+#define ROLLUP_ARCHIVE_VERSION 1
+
+/**
+ * Stale buckets are only dropped once there are at least this many of them,
+ * so that trimming a table doesn't mean moving it every minute
+ **/
+#define ROLLUP_TRIM_SLACK 1024
+
+/**
+ * Spans of activity/idleness longer than this (e.g. from the wall clock
+ * jumping while replaying history) are assumed to be bogus
+ **/
+#define ROLLUP_MAX_SPAN_SECONDS (24 * 60 * 60)
+
+/**
+ * The buckets for one resolution
+ **/
+struct rollup_table {
+    /* Width of each bucket */
+    int64_t width;
+    /* How far back (from the newest bucket) to keep buckets, 0 => forever */
+    int64_t retention;
+    /* Buckets, sorted by start time */
+    struct rollup_bucket *buckets;
+    /* Number of entries in `buckets` */
+    int count;
+    /* Number of entries allocated for `buckets` */
+    int capacity;
+    /* Buckets before this time have been dropped */
+    int64_t trimmed_before;
+};
+
+/**
+ * A full set of tables, along with what's needed to keep adding to them
+ **/
+struct rollup_set {
+    struct rollup_table tables[ROLLUP_LEVELS];
+    /* Active time since the last break */
+    int64_t current_streak;
+    /* Idle time needed for a break (0 => ask the tracker) */
+    int break_seconds;
+    /* The previous event replayed (time_ms is -1 before the first one) */
+    struct history_event last_event;
+};
+
+/**
+ * Layout of the archive file (followed by `day_count` day buckets)
+ **/
+struct rollup_archive_header {
+    /* Always ROLLUP_ARCHIVE_MAGIC */
+    uint32_t magic;
+    /* Always ROLLUP_ARCHIVE_VERSION for this layout */
+    uint32_t version;
+    /* Number of day buckets after the header */
+    uint32_t day_count;
+    /* Unused */
+    uint32_t reserved;
+    /* Segments starting before this were archived (then dropped) */
+    int64_t covered_until_ms;
+};
+
+/**
+ * The tables kept up to date for the running tracker
+ **/
+static struct rollup_set live = {
+    .tables = {
+        [ROLLUP_MINUTE] = {
+            .width = 60,
+            .retention = 7 * 24 * 60 * 60,
+        },
+        [ROLLUP_HOUR] = {
+            .width = 60 * 60,
+            .retention = 400 * 24 * 60 * 60,
+        },
+        [ROLLUP_DAY] = {
+            .width = 24 * 60 * 60,
+            .retention = 0,
+        },
+    },
+    .last_event = {.time_ms = -1},
+};
+
+/**
+ * Round `time` down to a multiple of `width`
+ **/
+static int64_t rollup_floor(int64_t time, int64_t width)
+{
+    int64_t rem = time % width;
+
+    return rem < 0 ? time - rem - width : time - rem;
+}
+
+/**
+ * Add the activity from one bucket into another
+ **/
+static void rollup_merge_bucket(struct rollup_bucket *into,
+    const struct rollup_bucket *from)
+{
+    into->active_seconds += from->active_seconds;
+    into->break_count += from->break_count;
+
+    if (into->longest_streak_seconds < from->longest_streak_seconds) {
+        into->longest_streak_seconds = from->longest_streak_seconds;
+    }
+}
+
+/**
+ * Find the first bucket in a table starting at or after `start`
+ **/
+static int rollup_lower_bound(const struct rollup_table *table, int64_t start)
+{
+    int low = 0;
+    int high = table->count;
+
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+
+        if (table->buckets[mid].start < start) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low;
+}
+
+/**
+ * Drop buckets which have fallen out of a table's retention window (once
+ * there are enough of them to be worth moving the table for)
+ **/
+static void rollup_trim(struct rollup_table *table, int64_t newest)
+{
+    if (table->retention == 0) {
+        return;
+    }
+
+    int64_t horizon = newest - table->retention;
+    int stale = rollup_lower_bound(table, horizon);
+
+    if (stale < ROLLUP_TRIM_SLACK) {
+        return;
+    }
+
+    memmove(
+        table->buckets,
+        &(table->buckets[stale]),
+        (table->count - stale) * sizeof(struct rollup_bucket)
+    );
+    table->count -= stale;
+    table->trimmed_before = horizon;
+}
+
+/**
+ * Get the bucket starting at `start`, adding it if it isn't there yet
+ *
+ * Returns the bucket, or NULL if it's too old to keep (or out of memory)
+ **/
+static struct rollup_bucket *rollup_get_bucket(struct rollup_table *table,
+    int64_t start)
+{
+    int count = table->count;
+
+    /* Nearly everything lands in the newest bucket */
+    if (count > 0 && table->buckets[count - 1].start == start) {
+        return &(table->buckets[count - 1]);
+    }
+
+    int64_t newest = start;
+    if (count > 0 && table->buckets[count - 1].start > newest) {
+        newest = table->buckets[count - 1].start;
+    }
+
+    if (start < table->trimmed_before || \
+            (table->retention > 0 && start < newest - table->retention)
+    ) {
+        return NULL;
+    }
+
+    rollup_trim(table, newest);
+    count = table->count;
+
+    int pos = count;
+    if (count > 0 && table->buckets[count - 1].start > start) {
+        pos = rollup_lower_bound(table, start);
+
+        if (table->buckets[pos].start == start) {
+            return &(table->buckets[pos]);
+        }
+    }
+
+    if (count == table->capacity) {
+        int capacity = table->capacity > 0 ? table->capacity * 2 : 64;
+        struct rollup_bucket *buckets = realloc(
+            table->buckets, capacity * sizeof(struct rollup_bucket)
+        );
+
+        if (buckets == NULL) {
+            fprintf(stderr, "failed to grow rollup table\n");
+            return NULL;
+        }
+
+        table->buckets = buckets;
+        table->capacity = capacity;
+    }
+
+    memmove(
+        &(table->buckets[pos + 1]),
+        &(table->buckets[pos]),
+        (count - pos) * sizeof(struct rollup_bucket)
+    );
+    table->buckets[pos] = (struct rollup_bucket){.start = start};
+    table->count++;
+
+    return &(table->buckets[pos]);
+}
+
+/**
+ * Add a span of activity ending at `end` to every table
+ **/
+static void rollup_add_active(struct rollup_set *set, int64_t end,
+    int64_t seconds)
+{
+    if (seconds <= 0 || seconds > ROLLUP_MAX_SPAN_SECONDS) {
+        return;
+    }
+
+    set->current_streak += seconds;
+
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        struct rollup_table *table = &(set->tables[level]);
+        int64_t at = end;
+        int64_t remaining = seconds;
+
+        /* Split the span across the buckets it covers, newest first */
+        while (remaining > 0) {
+            int64_t start = rollup_floor(at - 1, table->width);
+            int64_t chunk = at - start < remaining ? at - start : remaining;
+            struct rollup_bucket *bucket = rollup_get_bucket(table, start);
+
+            if (bucket == NULL) {
+                break;
+            }
+
+            bucket->active_seconds += chunk;
+            if (at == end && \
+                    bucket->longest_streak_seconds < set->current_streak
+            ) {
+                bucket->longest_streak_seconds = set->current_streak;
+            }
+
+            at -= chunk;
+            remaining -= chunk;
+        }
+    }
+}
+
+/**
+ * Add a span of idleness ending at `end`. This counts as a break if it's long
+ * enough for the tracker to reset any period.
+ **/
+static void rollup_add_idle(struct rollup_set *set, int64_t end,
+    int64_t seconds)
+{
+    int threshold = set->break_seconds;
+
+    if (seconds <= 0 || set->current_streak == 0) {
+        return;
+    }
+
+    if (threshold == 0) {
+        threshold = rollup_get_break_seconds();
+    }
+    if (threshold <= 0 || seconds < threshold) {
+        return;
+    }
+
+    set->current_streak = 0;
+
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        struct rollup_table *table = &(set->tables[level]);
+        int64_t start = rollup_floor(end - seconds, table->width);
+        struct rollup_bucket *bucket = rollup_get_bucket(table, start);
+
+        if (bucket != NULL) {
+            bucket->break_count++;
+        }
+    }
+}
+
+/**
+ * Get the shortest idle time that counts as a break, i.e. enough for the
+ * tracker to reset some period (its smallest idle threshold)
+ **/
+int rollup_get_break_seconds(void)
+{
+    int threshold;
+
+    if (tracker_get_idle_thresholds(&threshold, 1) < 1) {
+        return 0;
+    }
+
+    return threshold;
+}
+
+/**
+ * Add a history event to a set of tables. Each pair of consecutive events is
+ * a span of activity or idleness. (This is a `history_event_handler`.)
+ **/
+void rollup_set_add_event(const struct history_event *event, void *data)
+{
+    struct rollup_set *set = data;
+    struct history_event *last = &(set->last_event);
+
+    if (last->time_ms != -1 && last->active != event->active) {
+        int64_t end = event->time_ms / 1000;
+        int64_t seconds = end - last->time_ms / 1000;
+
+        if (last->active) {
+            rollup_add_active(set, end, seconds);
+        } else {
+            rollup_add_idle(set, end, seconds);
+        }
+    }
+
+    *last = *event;
+}
+
+/**
+ * Create an empty set of tables (e.g. to roll up history on another thread),
+ * which counts idle spells of at least `break_seconds` as breaks (none are
+ * counted if it's 0)
+ *
+ * Returns the new set, or NULL if out of memory
+ **/
+struct rollup_set *rollup_set_create(int break_seconds)
+{
+    struct rollup_set *set = malloc(sizeof(struct rollup_set));
+
+    if (set == NULL) {
+        return NULL;
+    }
+
+    *set = (struct rollup_set){
+        .break_seconds = break_seconds > 0 ? break_seconds : -1,
+        .last_event = {.time_ms = -1},
+    };
+
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        set->tables[level].width = live.tables[level].width;
+    }
+
+    return set;
+}
+
+/**
+ * Free the tables in a set
+ **/
+static void rollup_set_free_tables(struct rollup_set *set)
+{
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        free(set->tables[level].buckets);
+        set->tables[level].buckets = NULL;
+        set->tables[level].count = 0;
+        set->tables[level].capacity = 0;
+    }
+}
+
+/**
+ * Free a set created with `rollup_set_create`
+ **/
+void rollup_set_destroy(struct rollup_set *set)
+{
+    if (set != NULL) {
+        rollup_set_free_tables(set);
+        free(set);
+    }
+}
+
+/**
+ * Get the path of the archive file
+ *
+ * Returns 0 on success, -1 if there's no path for it
+ **/
+static int rollup_archive_path(char *path)
+{
+    const char *folder = paths_get_state_folder();
+
+    if (folder == NULL) {
+        return -1;
+    }
+
+    return paths_join(path, PATH_MAX, folder, "rollup.archive");
+}
+
+/**
+ * Read the archive file. The day buckets are allocated, and have to be freed
+ * by the caller.
+ *
+ * Returns the number of day buckets (0 if there's no archive), or -1 if the
+ * archive couldn't be read
+ **/
+static int rollup_archive_read(struct rollup_archive_header *header,
+    struct rollup_bucket **days)
+{
+    char path[PATH_MAX];
+
+    *header = (struct rollup_archive_header){0};
+    *days = NULL;
+
+    if (rollup_archive_path(path) == -1) {
+        return -1;
+    }
+
+    FILE *f = fopen(path, "rb");
+
+    if (f == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+
+    if (fread(header, sizeof(*header), 1, f) != 1 || \
+            header->magic != ROLLUP_ARCHIVE_MAGIC || \
+            header->version != ROLLUP_ARCHIVE_VERSION
+    ) {
+        fclose(f);
+        return -1;
+    }
+
+    *days = malloc((header->day_count + 1) * sizeof(struct rollup_bucket));
+
+    if (*days == NULL || fread(
+            *days, sizeof(struct rollup_bucket), header->day_count, f
+        ) != header->day_count
+    ) {
+        free(*days);
+        *days = NULL;
+        fclose(f);
+        return -1;
+    }
+
+    fclose(f);
+
+    return header->day_count;
+}
+
+/**
+ * Merge the day buckets from a set into the archive file, which then covers
+ * every segment starting before `covered_until_ms`. The archive is replaced
+ * atomically, so it's safe to drop those segments once this succeeds. Safe to
+ * call from any thread (but only one at a time).
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+int rollup_archive(struct rollup_set *set, int64_t covered_until_ms)
+{
+    char path[PATH_MAX];
+    char temp_path[PATH_MAX];
+    struct rollup_archive_header header;
+    struct rollup_bucket *old_days;
+    const struct rollup_table *new_days = &(set->tables[ROLLUP_DAY]);
+    int old_count = rollup_archive_read(&header, &old_days);
+
+    if (old_count == -1 || rollup_archive_path(path) == -1 || \
+            snprintf(temp_path, PATH_MAX, "%s.new", path) >= PATH_MAX
+    ) {
+        free(old_days);
+        return -1;
+    }
+
+    FILE *f = fopen(temp_path, "wb");
+
+    if (f == NULL) {
+        free(old_days);
+        return -1;
+    }
+
+    header.magic = ROLLUP_ARCHIVE_MAGIC;
+    header.version = ROLLUP_ARCHIVE_VERSION;
+    header.day_count = 0;
+    if (covered_until_ms > header.covered_until_ms) {
+        header.covered_until_ms = covered_until_ms;
+    }
+
+    /* Leave room for the header, which is written once the count is known */
+    int failed = fseek(f, sizeof(header), SEEK_SET) == -1;
+    int o = 0;
+    int n = 0;
+
+    while (!failed && (o < old_count || n < new_days->count)) {
+        struct rollup_bucket day;
+
+        if (n == new_days->count || \
+                (o < old_count && old_days[o].start < new_days->buckets[n].start)
+        ) {
+            day = old_days[o++];
+        } else if (o == old_count || \
+                new_days->buckets[n].start < old_days[o].start
+        ) {
+            day = new_days->buckets[n++];
+        } else {
+            /* The same day on both sides */
+            day = old_days[o++];
+            rollup_merge_bucket(&day, &(new_days->buckets[n++]));
+        }
+
+        failed = fwrite(&day, sizeof(day), 1, f) != 1;
+        header.day_count++;
+    }
+    free(old_days);
+
+    failed = failed || \
+        fseek(f, 0, SEEK_SET) == -1 || \
+        fwrite(&header, sizeof(header), 1, f) != 1 || \
+        fflush(f) != 0 || \
+        fsync(fileno(f)) == -1;
+    failed = fclose(f) != 0 || failed;
+
+    if (failed || rename(temp_path, path) == -1) {
+        unlink(temp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Load the archived days into the live tables
+ *
+ * Returns the time that the archive covers history up to (0 if none)
+ **/
+static int64_t rollup_load_archive(void)
+{
+    struct rollup_archive_header header;
+    struct rollup_bucket *days;
+    struct rollup_table *table = &(live.tables[ROLLUP_DAY]);
+    int count = rollup_archive_read(&header, &days);
+
+    if (count == -1) {
+        fprintf(stderr, "couldn't read rollup archive\n");
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        struct rollup_bucket *bucket = rollup_get_bucket(table, days[i].start);
+
+        if (bucket != NULL) {
+            rollup_merge_bucket(bucket, &(days[i]));
+        }
+    }
+    free(days);
+
+    if (header.covered_until_ms > 0) {
+        /* Finer tables know nothing about archived days */
+        int64_t covered_until = header.covered_until_ms / 1000;
+
+        for (int level = 0; level < ROLLUP_DAY; level++) {
+            if (live.tables[level].trimmed_before < covered_until) {
+                live.tables[level].trimmed_before = covered_until;
+            }
+        }
+    }
+
+    return header.covered_until_ms;
+}
+
+/**
+ * Call this once at start-up, after the history has been initialized
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+int rollup_init(void)
+{
+    int64_t covered_until_ms = rollup_load_archive();
+    int result = history_replay(rollup_set_add_event, &live, covered_until_ms);
+
+    /* Anything unfinished in the history isn't known to have ended */
+    live.current_streak = 0;
+
+    for (int level = 0; level < ROLLUP_LEVELS; level++) {
+        printf(
+            "rolled up %i buckets of %llis\n",
+            live.tables[level].count, (long long)live.tables[level].width
+        );
+    }
+
+    return result;
+}
+
+/**
+ * Call this before shutting down
+ **/
+void rollup_cleanup(void)
+{
+    rollup_set_free_tables(&live);
+}
+
+/**
+ * Call this alongside `tracker_provide_active_ns`, with the activity that just
+ * ended (in whole seconds)
+ **/
+void rollup_provide_active_seconds(int active_seconds)
+{
+    rollup_add_active(&live, time(NULL), active_seconds);
+}
+
+/**
+ * Call this when the user becomes active again, with the length of the idle
+ * time that just ended
+ **/
+void rollup_provide_idle_seconds(int idle_seconds)
+{
+    rollup_add_idle(&live, time(NULL), idle_seconds);
+}
+
+/**
+ * Get the width of the buckets at a given resolution
+ **/
+int rollup_level_seconds(enum rollup_level level)
+{
+    return live.tables[level].width;
+}
+
+/**
+ * Get the buckets at a given resolution which start in [from, to). Buckets
+ * without any activity are left out.
+ *
+ * Returns the first bucket, with the number of buckets in `count`. These are
+ * only valid until the next change to the rollups.
+ **/
+const struct rollup_bucket *rollup_get_buckets(enum rollup_level level,
+    int64_t from, int64_t to, int *count)
+{
+    struct rollup_table *table = &(live.tables[level]);
+    int first = rollup_lower_bound(table, from);
+    int last = rollup_lower_bound(table, to);
+
+    *count = last > first ? last - first : 0;
+
+    return *count > 0 ? &(table->buckets[first]) : NULL;
+}
+
+/**
+ * Add the buckets at one resolution which start in [from, to) to `summary`
+ **/
+static void rollup_accumulate(enum rollup_level level, int64_t from,
+    int64_t to, struct rollup_bucket *summary)
+{
+    int count;
+    const struct rollup_bucket *buckets = rollup_get_buckets(
+        level, from, to, &count
+    );
+
+    for (int i = 0; i < count; i++) {
+        rollup_merge_bucket(summary, &(buckets[i]));
+    }
+}
+
+/**
+ * Summarize [from, to) using whole buckets at `level`, and finer resolutions
+ * for whatever is left over at either end
+ **/
+static void rollup_summarize_level(enum rollup_level level, int64_t from,
+    int64_t to, struct rollup_bucket *summary)
+{
+    if (from >= to) {
+        return;
+    }
+
+    int64_t width = live.tables[level].width;
+
+    if (level == ROLLUP_MINUTE || \
+            from < live.tables[level - 1].trimmed_before
+    ) {
+        /* Nothing finer to fall back on, so count any overlapping bucket */
+        rollup_accumulate(level, rollup_floor(from, width), to, summary);
+        return;
+    }
+
+    int64_t inner_from = rollup_floor(from + width - 1, width);
+    int64_t inner_to = rollup_floor(to, width);
+
+    if (inner_from >= inner_to) {
+        rollup_summarize_level(level - 1, from, to, summary);
+        return;
+    }
+
+    rollup_summarize_level(level - 1, from, inner_from, summary);
+    rollup_accumulate(level, inner_from, inner_to, summary);
+    rollup_summarize_level(level - 1, inner_to, to, summary);
+}
+
+/**
+ * Summarize all activity in [from, to) (wall clock seconds)
+ **/
+void rollup_summarize(int64_t from, int64_t to, struct rollup_bucket *summary)
+{
+    *summary = (struct rollup_bucket){.start = from};
+
+    rollup_summarize_level(ROLLUP_DAY, from, to, summary);
+}
@@ -21,11 +21,30 @@
  * status based on how hard the user is working.
  **/
 
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <linux/limits.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "metrics.h"
+#include "paths.h"
 #include "safety-tracker.h"
+#include "tracker-kernel.h"
+
+/**
+ * Name of the config file (inside `paths_get_config_folder`) that periods are
+ * loaded from
+ **/
+#define TRACKER_CONFIG_FILE "config"
+
+/**
+ * Longest line accepted in the config file (including newline)
+ **/
+#define TRACKER_CONFIG_LINE_LENGTH 256
 
 /**
  * This structure represents an interval for tracking cumulative activity.
@@ -48,112 +67,832 @@ struct tracking_period_config {
 };
 
 /**
- * This structure represents the current state of a tracked interval.
+ * Periods that are tracked when the user hasn't configured any
+ **/
+static const struct tracking_period_config default_periods[] = {
+    {
+        .name = "micro",
+        .limit_seconds = 3 * 60,
+        .reset_seconds = 15,
+        .break_seconds = 30,
+    },
+    {
+        .name = "normal",
+        .limit_seconds = 45 * 60,
+        .reset_seconds = 0,
+        .break_seconds = 10 * 60,
+    },
+    {
+        .name = "workday",
+        .limit_seconds = 4 * 60 * 60,
+        .reset_seconds = 0,
+        .break_seconds = 8 * 60 * 60,
+    },
+};
+
+/**
+ * The state of every tracked interval. Each field is kept in its own array
+ * (indexed by period) so that the per-update loops only walk the values they
+ * actually use.
  **/
-struct tracking_period {
-    /* The configuration for this tracking period */
-    struct tracking_period_config config;
+struct tracking_periods {
+    /* Number of periods */
+    int count;
+    /* Number of periods the arrays have room for */
+    int capacity;
     /**
-     * An accumulator for the total active time measured for this period. Note
-     * that it will be reset according to the config.
+     * See `struct tracking_period_config` for the meaning of these (durations
+     * are kept in nanoseconds here)
      **/
-    int active_seconds;
+    char (*names)[TRACKER_NAME_LENGTH];
+    int64_t *limit_ns;
+    int64_t *reset_ns;
+    int64_t *break_ns;
     /**
-     * TODO: in the future, the cumulative active time won't be enough. We'll
-     * also want to track/log when the periods occur for reporting/charting.
+     * An accumulator for the total active time (in nanoseconds) measured for
+     * each period. Note that it will be reset according to the config.
      **/
+    int64_t *active_ns;
 };
 
-/* TODO: these should be user-configurable */
 /**
  * Global configuration for work/break durations
  **/
-static struct tracking_period periods[] = {
-    {
-        .config = {
-            .name = "micro",
-            .limit_seconds = 3 * 60,
-            .reset_seconds = 15,
-            .break_seconds = 30,
-        },
-        .active_seconds = 0,
-    },
-    {
-        .config = {
-            .name = "normal",
-            .limit_seconds = 45 * 60,
-            .reset_seconds = 0,
-            .break_seconds = 10 * 60,
-        },
-        .active_seconds = 0,
-    },
-    {
-        .config = {
-            .name = "workday",
-            .limit_seconds = 4 * 60 * 60,
-            .reset_seconds = 0,
-            .break_seconds = 8 * 60 * 60,
-        },
-        .active_seconds = 0,
-    },
+static struct tracking_periods periods = {0};
+
+/**
+ * Bumped every time the status of any period changes (see
+ * `tracker_get_status_generation`)
+ **/
+static unsigned long status_generation = 0;
+
+/**
+ * Active time provided since `status_generation` was last bumped for activity.
+ * The status only reports whole seconds, so it isn't worth bumping for every
+ * sliver of activity.
+ **/
+static int64_t unreported_active_ns = 0;
+
+/**
+ * Starting size of the buffer that the status JSON is rendered into
+ **/
+#define TRACKER_STATUS_JSON_INITIAL_CAPACITY 512
+
+/**
+ * Cached status JSON, rendered for `status_json_generation`
+ **/
+static char *status_json = NULL;
+
+/**
+ * Size of the buffer allocated for `status_json`
+ **/
+static size_t status_json_capacity = 0;
+
+/**
+ * Length of the rendered status JSON (excluding terminator)
+ **/
+static size_t status_json_len = 0;
+
+/**
+ * End of a new status JSON being rendered. It's rendered just after the cached
+ * copy, which is only replaced once the new one is complete.
+ **/
+static size_t status_json_end = 0;
+
+/**
+ * The status generation that `status_json` was rendered for
+ **/
+static unsigned long status_json_generation = 0;
+
+/**
+ * The next instant at which some period will go beyond its limit. Idle
+ * thresholds aren't scheduled here, the compositor tells us when those are
+ * crossed (see `tracker_get_idle_thresholds`).
+ **/
+struct tracker_deadline {
+    /* Nanoseconds into the current stretch of activity */
+    int64_t at_ns;
+    /* Index of the period in `periods` */
+    int period;
 };
 
+/**
+ * Min-heap (ordered on `at_ns`) of upcoming deadlines for the current
+ * stretch of activity. Each period has at most one deadline scheduled at once,
+ * so there's room for `periods.count` of them.
+ **/
+static struct tracker_deadline *deadlines = NULL;
+
+/**
+ * Number of deadlines in the heap
+ **/
+static int deadline_count = 0;
+
+/**
+ * Release the arrays of a set of periods
+ **/
+static void tracker_periods_free(struct tracking_periods *set)
+{
+    free(set->names);
+    free(set->limit_ns);
+    free(set->reset_ns);
+    free(set->break_ns);
+    free(set->active_ns);
+
+    memset(set, 0, sizeof(*set));
+}
+
+/**
+ * Make room for at least one more period in a set
+ *
+ * Returns 0 on success, -1 if the arrays couldn't be grown
+ **/
+static int tracker_periods_reserve(struct tracking_periods *set)
+{
+    if (set->count < set->capacity) {
+        return 0;
+    }
+
+    int capacity = set->capacity > 0 ? set->capacity * 2 : 8;
+    void *grown;
+
+#define TRACKER_GROW(field) \
+    grown = realloc(set->field, capacity * sizeof(*(set->field))); \
+    if (grown == NULL) { \
+        return -1; \
+    } \
+    set->field = grown;
+
+    TRACKER_GROW(names)
+    TRACKER_GROW(limit_ns)
+    TRACKER_GROW(reset_ns)
+    TRACKER_GROW(break_ns)
+    TRACKER_GROW(active_ns)
+
+#undef TRACKER_GROW
+
+    set->capacity = capacity;
+
+    return 0;
+}
+
+/**
+ * Find a period in a set by name
+ *
+ * Returns its index, or -1 if there's no such period
+ **/
+static int tracker_periods_find(
+    const struct tracking_periods *set, const char *name
+) {
+    for (int i = 0; i < set->count; i++) {
+        if (strcmp(set->names[i], name) == 0) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * Add a period to a set, with nothing accumulated yet
+ *
+ * Returns 0 on success, -1 if there was no memory for it
+ **/
+static int tracker_periods_add(
+    struct tracking_periods *set,
+    const char *name,
+    int limit_seconds,
+    int reset_seconds,
+    int break_seconds
+) {
+    if (tracker_periods_reserve(set) == -1) {
+        return -1;
+    }
+
+    int i = set->count++;
+
+    snprintf(set->names[i], TRACKER_NAME_LENGTH, "%s", name);
+    set->limit_ns[i] = limit_seconds * TRACKER_NS_PER_SECOND;
+    set->reset_ns[i] = reset_seconds * TRACKER_NS_PER_SECOND;
+    set->break_ns[i] = break_seconds * TRACKER_NS_PER_SECOND;
+    set->active_ns[i] = 0;
+
+    return 0;
+}
+
+/**
+ * Replace the tracked periods with `set` (which the tracker takes ownership
+ * of). Time accumulated for periods that keep their name is carried over.
+ *
+ * Any scheduled deadlines are dropped, see `tracker_schedule_active`.
+ *
+ * Returns 0 on success, -1 if there was no memory (`set` is freed)
+ **/
+static int tracker_install_periods(struct tracking_periods *set)
+{
+    struct tracker_deadline *heap = malloc(
+        (set->count > 0 ? set->count : 1) * sizeof(*heap)
+    );
+
+    if (heap == NULL) {
+        tracker_periods_free(set);
+        return -1;
+    }
+
+    for (int i = 0; i < set->count; i++) {
+        int old = tracker_periods_find(&periods, set->names[i]);
+
+        if (old != -1) {
+            set->active_ns[i] = periods.active_ns[old];
+        }
+    }
+
+    tracker_periods_free(&periods);
+    periods = *set;
+    memset(set, 0, sizeof(*set));
+
+    free(deadlines);
+    deadlines = heap;
+    deadline_count = 0;
+
+    status_generation++;
+
+    return 0;
+}
+
+/**
+ * Parse a duration from the config file: a whole number, optionally followed
+ * by a unit (`s`, `m`, `h` or `d`, seconds if not given)
+ *
+ * Returns 0 on success, -1 if it's malformed or too large
+ **/
+static int tracker_parse_duration(const char *text, int *seconds)
+{
+    char *end = NULL;
+    long multiplier = 1;
+
+    if (!isdigit((unsigned char)text[0])) {
+        return -1;
+    }
+
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (errno != 0) {
+        return -1;
+    }
+
+    switch (*end) {
+        case '\0':
+        case 's':
+            break;
+        case 'm':
+            multiplier = 60;
+            break;
+        case 'h':
+            multiplier = 60 * 60;
+            break;
+        case 'd':
+            multiplier = 24 * 60 * 60;
+            break;
+        default:
+            return -1;
+    }
+    if (*end != '\0' && end[1] != '\0') {
+        return -1;
+    }
+    if (value > INT_MAX / multiplier) {
+        return -1;
+    }
+
+    *seconds = value * multiplier;
+
+    return 0;
+}
+
+/**
+ * Checks that a period name is non-empty, fits in `TRACKER_NAME_LENGTH`, and
+ * only uses characters that are safe to put in JSON unescaped
+ **/
+static int tracker_valid_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len == 0 || len >= TRACKER_NAME_LENGTH) {
+        return 0;
+    }
+
+    for (size_t i = 0; i < len; i++) {
+        char c = name[i];
+
+        if (!isalnum((unsigned char)c) && c != '-' && c != '_') {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/**
+ * Parse one line of the config file into `set`
+ *
+ * Returns 0 on success, -1 with a description in `error` otherwise
+ **/
+static int tracker_parse_config_line(
+    struct tracking_periods *set, char *line, const char **error
+) {
+    char *tokens[6];
+    char *save = NULL;
+    int count = 0;
+    int limit_seconds;
+    int reset_seconds;
+    int break_seconds;
+
+    /* Comments run to the end of the line */
+    line[strcspn(line, "#")] = '\0';
+
+    for (char *token = strtok_r(line, " \t\r\n", &save);
+            token != NULL && count < 6;
+            token = strtok_r(NULL, " \t\r\n", &save)
+    ) {
+        tokens[count++] = token;
+    }
+
+    if (count == 0) {
+        /* Blank line */
+        return 0;
+    }
+    if (strcmp(tokens[0], "period") != 0) {
+        *error = "unknown setting";
+        return -1;
+    }
+    if (count != 5) {
+        *error = "expected: period <name> <limit> <reset> <break>";
+        return -1;
+    }
+    if (!tracker_valid_name(tokens[1])) {
+        *error = "period names must be 1-31 characters of [A-Za-z0-9_-]";
+        return -1;
+    }
+    if (tracker_periods_find(set, tokens[1]) != -1) {
+        *error = "period defined more than once";
+        return -1;
+    }
+    if (set->count >= TRACKER_MAX_PERIODS) {
+        *error = "too many periods (the most is 64)";
+        return -1;
+    }
+    if (tracker_parse_duration(tokens[2], &limit_seconds) == -1 || \
+            tracker_parse_duration(tokens[3], &reset_seconds) == -1 || \
+            tracker_parse_duration(tokens[4], &break_seconds) == -1
+    ) {
+        *error = "invalid duration";
+        return -1;
+    }
+    if (limit_seconds <= 0 || break_seconds <= 0) {
+        *error = "limit and break must be greater than 0";
+        return -1;
+    }
+    if (reset_seconds >= break_seconds) {
+        *error = "reset must be less than break (or 0 to disable)";
+        return -1;
+    }
+
+    if (tracker_periods_add(
+            set, tokens[1], limit_seconds, reset_seconds, break_seconds
+        ) == -1
+    ) {
+        *error = "out of memory";
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Replace the tracked periods with those defined in a config file. Each
+ * (non-blank, non-comment) line defines one period:
+ *
+ *     period <name> <limit> <reset> <break>
+ *
+ * Time accumulated for periods that keep their name is carried over. If the
+ * file has any errors, they're reported and the current periods are kept.
+ *
+ * Returns 0 on success, 1 if the file doesn't exist, -1 on error
+ **/
+int tracker_load_config(const char *path)
+{
+    struct tracking_periods set = {0};
+    char line[TRACKER_CONFIG_LINE_LENGTH];
+    const char *error = NULL;
+    int line_number = 0;
+    FILE *file = fopen(path, "re");
+
+    if (file == NULL) {
+        if (errno == ENOENT) {
+            return 1;
+        }
+        fprintf(stderr, "%s: unable to open: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    while (error == NULL && fgets(line, sizeof(line), file) != NULL) {
+        line_number++;
+
+        if (strchr(line, '\n') == NULL && !feof(file)) {
+            error = "line too long";
+        } else {
+            tracker_parse_config_line(&set, line, &error);
+        }
+    }
+    if (error == NULL && ferror(file)) {
+        error = strerror(errno);
+    }
+    fclose(file);
+
+    if (error == NULL && set.count == 0) {
+        error = "no periods defined";
+        line_number = 0;
+    }
+    if (error != NULL) {
+        if (line_number > 0) {
+            fprintf(stderr, "%s:%i: %s\n", path, line_number, error);
+        } else {
+            fprintf(stderr, "%s: %s\n", path, error);
+        }
+        tracker_periods_free(&set);
+        return -1;
+    }
+
+    if (tracker_install_periods(&set) == -1) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Get the path of the config file that periods are loaded from
+ *
+ * Returns 0 on success, -1 if it can't be determined
+ **/
+int tracker_get_config_path(char *path, size_t size)
+{
+    const char *folder = paths_get_config_folder();
+
+    if (folder == NULL) {
+        return -1;
+    }
+
+    return paths_join(path, size, folder, TRACKER_CONFIG_FILE);
+}
+
+/**
+ * Set up the tracked periods: the user's config file if there is one,
+ * otherwise (or if it has errors) the defaults.
+ *
+ * Returns 0 on success, -1 if there was no memory for the periods
+ **/
+int tracker_init(void)
+{
+    struct tracking_periods set = {0};
+    char path[PATH_MAX];
+    int count = sizeof(default_periods)/sizeof(default_periods[0]);
+
+    /* Use the fastest update loops this CPU can run */
+    tracker_kernel_select(NULL);
+
+    for (int i = 0; i < count; i++) {
+        const struct tracking_period_config *config = &(default_periods[i]);
+
+        if (tracker_periods_add(&set,
+                config->name,
+                config->limit_seconds,
+                config->reset_seconds,
+                config->break_seconds
+            ) == -1
+        ) {
+            tracker_periods_free(&set);
+            fprintf(stderr, "unable to allocate tracking periods\n");
+            return -1;
+        }
+    }
+
+    if (tracker_install_periods(&set) == -1) {
+        fprintf(stderr, "unable to allocate tracking periods\n");
+        return -1;
+    }
+
+    if (tracker_get_config_path(path, sizeof(path)) == 0 && \
+            tracker_load_config(path) == -1
+    ) {
+        fprintf(stderr, "using default tracking periods\n");
+    }
+
+    return 0;
+}
+
+/**
+ * Release everything allocated by the tracker
+ **/
+void tracker_cleanup(void)
+{
+    tracker_periods_free(&periods);
+    unreported_active_ns = 0;
+
+    free(deadlines);
+    deadlines = NULL;
+    deadline_count = 0;
+
+    free(status_json);
+    status_json = NULL;
+    status_json_capacity = 0;
+    status_json_len = 0;
+    status_json_end = 0;
+}
+
 /**
  * Get the number of different periods being tracked
  **/
-static int tracker_count_periods(void)
+int tracker_count_periods(void)
+{
+    return periods.count;
+}
+
+/**
+ * Get the name of a tracking period
+ **/
+const char *tracker_get_period_name(int period)
+{
+    return periods.names[period];
+}
+
+/**
+ * Get how many seconds a user can work in a tracking period before needing a
+ * break
+ **/
+int tracker_get_period_limit_seconds(int period)
+{
+    return periods.limit_ns[period] / TRACKER_NS_PER_SECOND;
+}
+
+/**
+ * Get the active time accumulated for a tracking period, in whole seconds
+ **/
+int tracker_get_period_active_seconds(int period)
+{
+    return periods.active_ns[period] / TRACKER_NS_PER_SECOND;
+}
+
+/**
+ * Overwrite the active time accumulated for a tracking period (e.g. when
+ * restoring a saved snapshot)
+ **/
+void tracker_set_period_active_seconds(int period, int active_seconds)
+{
+    int64_t active_ns = active_seconds * TRACKER_NS_PER_SECOND;
+
+    if (periods.active_ns[period] != active_ns) {
+        periods.active_ns[period] = active_ns;
+        status_generation++;
+    }
+}
+
+/**
+ * Checks if a tracking period is still within its limit
+ *
+ * Returns non-zero if no break is needed yet
+ **/
+int tracker_is_period_safe(int period)
+{
+    return periods.active_ns[period] <= periods.limit_ns[period];
+}
+
+/**
+ * Add a deadline to the heap
+ **/
+static void tracker_push_deadline(int64_t at_ns, int period)
+{
+    int i = deadline_count++;
+
+    /* Sift up */
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (deadlines[parent].at_ns <= at_ns) {
+            break;
+        }
+
+        deadlines[i] = deadlines[parent];
+        i = parent;
+    }
+
+    deadlines[i].at_ns = at_ns;
+    deadlines[i].period = period;
+}
+
+/**
+ * Remove the earliest deadline from the heap
+ **/
+static void tracker_pop_deadline(void)
+{
+    struct tracker_deadline last = deadlines[--deadline_count];
+    int i = 0;
+
+    /* Sift down */
+    while (1) {
+        int child = 2 * i + 1;
+
+        if (child >= deadline_count) {
+            break;
+        }
+        if (child + 1 < deadline_count && \
+                deadlines[child + 1].at_ns < deadlines[child].at_ns
+        ) {
+            child++;
+        }
+        if (last.at_ns <= deadlines[child].at_ns) {
+            break;
+        }
+
+        deadlines[i] = deadlines[child];
+        i = child;
+    }
+
+    if (deadline_count > 0) {
+        deadlines[i] = last;
+    }
+}
+
+/**
+ * Checks if a deadline can still change the state of its period
+ **/
+static int tracker_deadline_pending(const struct tracker_deadline *deadline)
+{
+    return tracker_is_period_safe(deadline->period);
+}
+
+/**
+ * Get a view of the periods for the update loops in tracker-kernel.c
+ **/
+static struct tracker_kernel_periods tracker_kernel_view(void)
+{
+    return (struct tracker_kernel_periods){
+        .count = periods.count,
+        .limit_ns = periods.limit_ns,
+        .reset_ns = periods.reset_ns,
+        .break_ns = periods.break_ns,
+        .active_ns = periods.active_ns,
+    };
+}
+
+/**
+ * This function receives the total number of idle nanoseconds in a period of
+ * user inactivity.
+ **/
+void tracker_provide_idle_ns(int64_t idle_ns)
+{
+    struct tracker_kernel_periods view = tracker_kernel_view();
+
+    if (tracker_kernel_idle(&view, idle_ns)) {
+        status_generation++;
+    }
+}
+
+/**
+ * This function receives individual periods of active nanoseconds during user
+ * activity. i.e. you can't give it a total amount of active time, because it
+ * needs to accumulate active time surrounding small-enough idle periods. (i.e.
+ * small enough to not reset the accumulator) Any amount can be given at a
+ * time, nothing is lost to rounding.
+ **/
+void tracker_provide_active_ns(int64_t active_ns)
+{
+    struct tracker_kernel_periods view = tracker_kernel_view();
+
+    if (active_ns <= 0) {
+        return;
+    }
+
+    unreported_active_ns += active_ns;
+
+    /**
+     * The status changes when some period goes beyond its limit, or when the
+     * seconds reported for it move on (roughly)
+     **/
+    if (tracker_kernel_active(&view, active_ns) || \
+            unreported_active_ns >= TRACKER_NS_PER_SECOND
+    ) {
+        unreported_active_ns = 0;
+        status_generation++;
+    }
+}
+
+/**
+ * Call this when the user becomes active, after all idle time has been
+ * provided. Schedules the instants (in nanoseconds of activity) at which
+ * periods will go beyond their limits.
+ *
+ * `elapsed_ns` is how long the user has already been active, all of which must
+ * have been provided (i.e. 0, unless the periods were just replaced).
+ **/
+void tracker_schedule_active(int64_t elapsed_ns)
 {
-    return sizeof(periods)/sizeof(periods[0]);
+    deadline_count = 0;
+
+    for (int i = 0; i < periods.count; i++) {
+        if (tracker_is_period_safe(i)) {
+            tracker_push_deadline(elapsed_ns + \
+                periods.limit_ns[i] - periods.active_ns[i] + 1, i
+            );
+        }
+    }
 }
 
 /**
- * This function receives the total number of idle seconds in a period of user
- * inactivity.
+ * Get the distinct durations of idleness (in seconds, ascending) at which some
+ * period's accumulator may be reset, i.e. the values worth passing to
+ * `tracker_provide_idle_ns`. At most `max_thresholds` are stored.
+ *
+ * Returns the number of thresholds stored in `thresholds`
  **/
-void tracker_provide_idle_seconds(int idle_seconds)
+int tracker_get_idle_thresholds(int *thresholds, int max_thresholds)
 {
-    for (int i = 0; i < tracker_count_periods(); i++) {
-        struct tracking_period_config *config = &(periods[i].config);
-        struct tracking_period *period = &(periods[i]);
+    int count = 0;
+
+    for (int i = 0; i < periods.count; i++) {
+        int reset_seconds = periods.reset_ns[i] / TRACKER_NS_PER_SECOND;
+        int break_seconds = periods.break_ns[i] / TRACKER_NS_PER_SECOND;
+        /* Accumulators are reset once idleness goes *beyond* these values */
+        int candidates[2] = {
+            reset_seconds > 0 ? reset_seconds + 1 : 0,
+            break_seconds + 1,
+        };
 
-        if (period->active_seconds > 0) {
-            /* We only do a reset if there is some activity to clear */
+        for (int c = 0; c < 2; c++) {
+            int value = candidates[c];
+            int pos = 0;
 
-            if (period->active_seconds < config->limit_seconds && \
-                    config->reset_seconds > 0 && \
-                    idle_seconds > config->reset_seconds
-            ) {
-                /**
-                 * A reset is warranted (makes more sense for small intervals)
-                 **/
-                period->active_seconds = 0; 
-            } else if (idle_seconds > config->break_seconds) {
-                /**
-                 * Whether beyond the period's limit or not, the number of
-                 * elapsed idle seconds is greater than any break needed, so the
-                 * accumulator for active time can be reset
-                 **/
-                printf("BREAK RESET\n");
-                period->active_seconds = 0;
+            if (value <= 0) {
+                continue;
+            }
+
+            /* Insertion sort, skipping duplicates */
+            while (pos < count && thresholds[pos] < value) {
+                pos++;
+            }
+            if (pos < count && thresholds[pos] == value) {
+                continue;
             }
+            if (count == max_thresholds) {
+                continue;
+            }
+
+            memmove(
+                &(thresholds[pos + 1]),
+                &(thresholds[pos]),
+                (count - pos) * sizeof(int)
+            );
+            thresholds[pos] = value;
+            count++;
         }
-    } 
+    }
+
+    return count;
 }
 
 /**
- * This function receives individual periods of active seconds during user
- * activity. i.e. you can't give it a total number of active seconds, because
- * it needs to accumulate active time surrounding small-enough idle periods.
- * (i.e. small enough to not reset the accumulator) If you call this function
- * every 1s, then you would pass it the value 1 for each call, etc.
+ * Given how long the user has been active (i.e. the total active nanoseconds
+ * provided since `tracker_schedule_active`), get the number of nanoseconds
+ * until some period will next go beyond its limit.
+ *
+ * Returns -1 if nothing is going to change
  **/
-void tracker_provide_active_seconds(int active_seconds)
+int64_t tracker_ns_until_deadline(int64_t elapsed_ns)
 {
-    for (int i = 0; i < tracker_count_periods(); i++) {
-        struct tracking_period *period = &(periods[i]);
+    while (deadline_count > 0) {
+        struct tracker_deadline *next = &(deadlines[0]);
 
-        period->active_seconds += active_seconds;
-    } 
+        if (next->at_ns > elapsed_ns && \
+                tracker_deadline_pending(next)
+        ) {
+            return next->at_ns - elapsed_ns;
+        }
+
+        /* Already passed, or no longer relevant */
+        tracker_pop_deadline();
+    }
+
+    return -1;
+}
+
+/**
+ * Get a number which changes every time the status of any period changes (i.e.
+ * whenever `tracker_get_status_json` would give a different result).
+ **/
+unsigned long tracker_get_status_generation(void)
+{
+    return status_generation;
 }
 
 /**
@@ -162,64 +901,138 @@ void tracker_provide_active_seconds(int active_seconds)
  */
 void tracker_display_nag_status(void)
 {
-    for (int i = 0; i < tracker_count_periods(); i++) {
-        struct tracking_period_config *config = &(periods[i].config);
-        struct tracking_period *period = &(periods[i]);
-
+    for (int i = 0; i < periods.count; i++) {
         const char *nag_status = NULL;
 
-        if (period->active_seconds > config->limit_seconds) {
+        if (!tracker_is_period_safe(i)) {
             nag_status = "BREAK REQUIRED";
         } else {
             nag_status = "SAFE";
         }
 
         fprintf(stderr, "%5i/%5i ('%s' period) [%s]\n",
-            period->active_seconds,
-            config->limit_seconds,
-            config->name,
+            tracker_get_period_active_seconds(i),
+            tracker_get_period_limit_seconds(i),
+            periods.names[i],
             nag_status
         );
-    } 
+    }
 }
 
 /**
- * Get a JSON dump of all status for all tracking periods
+ * Append formatted text to the status JSON being rendered, growing the buffer
+ * as needed.
+ *
+ * Returns 0 on success, -1 if the buffer couldn't be grown
  **/
-char *tracker_get_status_json(void)
+static int tracker_status_json_append(const char *format, ...)
 {
-    char *buff = malloc(512);
-    memset(buff, 0, 512);
+    while (1) {
+        size_t available = status_json_capacity - status_json_end;
+        va_list args;
 
-    strcat(buff, "{\"periods\":[");
-    for (int i = 0; i < tracker_count_periods(); i++) {
-        struct tracking_period_config *config = &(periods[i].config);
-        struct tracking_period *period = &(periods[i]);
-        
-        strcat(buff, "{\"name\":\"");
-        strcat(buff, config->name);
-        strcat(buff, "\",\"safe\":");
-        
-        if (period->active_seconds > config->limit_seconds) {
-            strcat(buff, "false");
-        } else {
-            strcat(buff, "true");
+        va_start(args, format);
+        int needed = vsnprintf(
+            status_json + status_json_end, available, format, args
+        );
+        va_end(args);
+
+        if (needed < 0) {
+            return -1;
+        }
+        if ((size_t)needed < available) {
+            status_json_end += needed;
+            return 0;
+        }
+
+        /* Didn't fit, grow the buffer and try again */
+        size_t capacity = status_json_capacity * 2;
+        if (capacity < status_json_end + needed + 1) {
+            capacity = status_json_end + needed + 1;
         }
-        
-        strcat(buff, ",\"accumulated_seconds\":");
-        char readout[16];
-        sprintf(readout, "%i", period->active_seconds);
-        strcat(buff, readout);
 
-        strcat(buff, ",\"break_at\":");
-        sprintf(readout, "%i", period->config.limit_seconds);
-        strcat(buff, readout);
+        char *grown = realloc(status_json, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+
+        status_json = grown;
+        status_json_capacity = capacity;
+    }
+}
+
+/**
+ * Re-render the cached status JSON for the current status generation. If it
+ * can't be rendered in full, the previous copy is kept.
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+static int tracker_render_status_json(void)
+{
+    if (status_json == NULL) {
+        status_json_capacity = TRACKER_STATUS_JSON_INITIAL_CAPACITY;
+        status_json = malloc(status_json_capacity);
+
+        if (status_json == NULL) {
+            status_json_capacity = 0;
+            return -1;
+        }
+        status_json_len = 0;
+    }
+
+    status_json_end = status_json_len;
+
+    int failed = tracker_status_json_append("{\"periods\":[");
+    for (int i = 0; i < periods.count && !failed; i++) {
+        failed = tracker_status_json_append(
+            "%s{\"name\":\"%s\",\"safe\":%s,"
+            "\"accumulated_seconds\":%i,\"break_at\":%i}",
+            i > 0 ? "," : "",
+            periods.names[i],
+            tracker_is_period_safe(i) ? "true" : "false",
+            tracker_get_period_active_seconds(i),
+            tracker_get_period_limit_seconds(i)
+        );
+    }
+    failed = failed || tracker_status_json_append("]}\n");
+
+    if (failed) {
+        /* Try again next time, serving the previous status until then */
+        status_json[status_json_len] = '\0';
+        return -1;
+    }
+
+    /* Replace the previous copy (including the terminator) */
+    memmove(
+        status_json, status_json + status_json_len,
+        status_json_end - status_json_len + 1
+    );
+    status_json_len = status_json_end - status_json_len;
+    status_json_generation = status_generation;
+
+    return 0;
+}
+
+/**
+ * Get a JSON dump of all status for all tracking periods. It's only rendered
+ * again when the status has changed, otherwise the cached copy is returned.
+ *
+ * The returned string belongs to the tracker, and is valid until the status
+ * next changes. Its length is stored in `len`. If the current status can't be
+ * rendered, the last one that could be is returned instead.
+ **/
+const char *tracker_get_status_json(int *len)
+{
+    if (status_json == NULL || status_json_generation != status_generation) {
+        int64_t started_ns = metrics_now_ns();
+
+        tracker_render_status_json();
+        metrics_observe(
+            METRICS_STATUS_RENDER_NS, metrics_now_ns() - started_ns
+        );
+    }
 
-        strcat(buff, "},");
-    } 
-    int len = strlen(buff);
-    buff[len-1] = 0;
-    strcat(buff, "]}\n");
+    *len = status_json_len;
 
-    return buff;
+    return status_json != NULL ? status_json : "";
 }
@@ -0,0 +1,363 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Keeps a snapshot of the safety tracker's accumulators in a small mapped file
+ * under the state folder, so that a crash, compositor restart or reboot
+ * doesn't lose the time accumulated so far.
+ *
+ * The file holds two slots which are written alternately, each with its own
+ * checksum. If noRSI dies part way through writing one, the other still holds
+ * the previous snapshot.
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "paths.h"
+#include "safety-tracker.h"
+#include "state-file.h"
+
+/* "NRST" */
+#define STATE_FILE_MAGIC 0x5453524eu
+#define STATE_FILE_VERSION 1
+#define STATE_FILE_MAX_PERIODS 64
+#define STATE_FILE_NAME_LENGTH 32
+#define STATE_FILE_BOOT_ID_LENGTH 40
+
+/**
+ * Saved accumulator for a single tracking period
+ **/
+struct state_file_period {
+    /* NUL-terminated period name (periods are matched up by name) */
+    char name[STATE_FILE_NAME_LENGTH];
+    /* Active time accumulated for the period */
+    int64_t active_seconds;
+};
+
+/**
+ * A complete snapshot of the tracker
+ **/
+struct state_file_slot {
+    /* FNV-1a hash of everything in the slot after this field */
+    uint32_t checksum;
+    /* Always STATE_FILE_MAGIC */
+    uint32_t magic;
+    /* Always STATE_FILE_VERSION for this layout */
+    uint32_t version;
+    /* Number of valid entries in `periods` */
+    uint32_t period_count;
+    /* Incremented with each snapshot (the highest valid one wins) */
+    uint64_t sequence;
+    /* CLOCK_BOOTTIME when the snapshot was taken */
+    int64_t boottime_ns;
+    /* CLOCK_REALTIME when the snapshot was taken */
+    int64_t realtime_ns;
+    /* Kernel boot ID, to tell if CLOCK_BOOTTIME can be compared */
+    char boot_id[STATE_FILE_BOOT_ID_LENGTH];
+    struct state_file_period periods[STATE_FILE_MAX_PERIODS];
+};
+
+/**
+ * Layout of the whole file
+ **/
+struct state_file {
+    struct state_file_slot slots[2];
+};
+
+/**
+ * e.g. /home/user/.local/state/norsi/tracker.state
+ **/
+static char state_file_path[PATH_MAX] = {0};
+
+/**
+ * The mapped file (NULL until initialized)
+ **/
+static struct state_file *state = NULL;
+
+/**
+ * Sequence number of the most recent snapshot
+ **/
+static uint64_t last_sequence = 0;
+
+/**
+ * The tracker status generation that was last saved
+ **/
+static unsigned long saved_generation = 0;
+
+/**
+ * ID of the current boot
+ **/
+static char boot_id[STATE_FILE_BOOT_ID_LENGTH] = {0};
+
+/**
+ * Get the time on `clock` in nanoseconds
+ **/
+static int64_t state_file_clock_ns(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * Read the kernel's ID for the current boot into `boot_id`
+ **/
+static void state_file_read_boot_id(void)
+{
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+    if (f == NULL) {
+        return;
+    }
+    if (fgets(boot_id, STATE_FILE_BOOT_ID_LENGTH, f) != NULL) {
+        boot_id[strcspn(boot_id, "\n")] = '\0';
+    }
+
+    fclose(f);
+}
+
+/**
+ * Compute the checksum for a slot
+ **/
+static uint32_t state_file_checksum(const struct state_file_slot *slot)
+{
+    const unsigned char *bytes = (const unsigned char *)slot;
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = sizeof(slot->checksum); i < sizeof(*slot); i++) {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/**
+ * Checks if a slot holds a complete snapshot
+ **/
+static int state_file_slot_valid(const struct state_file_slot *slot)
+{
+    return slot->magic == STATE_FILE_MAGIC && \
+        slot->version == STATE_FILE_VERSION && \
+        slot->period_count <= STATE_FILE_MAX_PERIODS && \
+        slot->checksum == state_file_checksum(slot);
+}
+
+/**
+ * Work out how long noRSI was down for (in nanoseconds) since a snapshot was
+ * taken
+ **/
+static int64_t state_file_ns_since(const struct state_file_slot *slot)
+{
+    int64_t elapsed_ns;
+
+    if (boot_id[0] != '\0' && strcmp(slot->boot_id, boot_id) == 0) {
+        /* Same boot, so this is immune to wall clock changes */
+        elapsed_ns = state_file_clock_ns(CLOCK_BOOTTIME) - slot->boottime_ns;
+    } else {
+        elapsed_ns = state_file_clock_ns(CLOCK_REALTIME) - slot->realtime_ns;
+    }
+
+    return elapsed_ns > 0 ? elapsed_ns : 0;
+}
+
+/**
+ * Restore the tracker's accumulators from the most recent valid snapshot, then
+ * let the tracker know about the time noRSI was down for (which counts as
+ * idleness).
+ **/
+static void state_file_restore(void)
+{
+    struct state_file_slot *newest = NULL;
+
+    for (int i = 0; i < 2; i++) {
+        struct state_file_slot *slot = &(state->slots[i]);
+
+        if (state_file_slot_valid(slot) && \
+                (newest == NULL || slot->sequence > newest->sequence)
+        ) {
+            newest = slot;
+        }
+    }
+
+    if (newest == NULL) {
+        printf("no saved tracker state to restore\n");
+        return;
+    }
+
+    last_sequence = newest->sequence;
+
+    for (uint32_t s = 0; s < newest->period_count; s++) {
+        struct state_file_period *saved = &(newest->periods[s]);
+
+        for (int i = 0; i < tracker_count_periods(); i++) {
+            if (strncmp(
+                    saved->name, tracker_get_period_name(i),
+                    STATE_FILE_NAME_LENGTH
+                ) == 0
+            ) {
+                tracker_set_period_active_seconds(i, saved->active_seconds);
+                break;
+            }
+        }
+    }
+
+    int64_t down_ns = state_file_ns_since(newest);
+    printf(
+        "restored tracker state (down for %llis)\n",
+        (long long)(down_ns / TRACKER_NS_PER_SECOND)
+    );
+
+    if (down_ns > 0) {
+        tracker_provide_idle_ns(down_ns);
+    }
+}
+
+/**
+ * Call this once at start-up, before the user's state is known. Restores any
+ * saved accumulators into the tracker.
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+int state_file_init(void)
+{
+    const char *folder = paths_get_state_folder();
+
+    if (folder == NULL || \
+            paths_join(state_file_path, PATH_MAX, folder, "tracker.state")
+    ) {
+        fprintf(stderr, "no path for tracker state\n");
+        state_file_path[0] = '\0';
+        return -1;
+    }
+
+    if (paths_make_folders(folder) == -1) {
+        fprintf(
+            stderr, "failed to create %s (%s)\n", folder, strerror(errno)
+        );
+        return -1;
+    }
+
+    int fd = open(state_file_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+
+    if (fd == -1) {
+        fprintf(
+            stderr, "couldn't open %s (%s)\n", state_file_path, strerror(errno)
+        );
+        return -1;
+    }
+
+    /* New (or foreign) files are zero-filled, so neither slot is valid */
+    if (ftruncate(fd, sizeof(struct state_file)) == -1) {
+        fprintf(stderr, "couldn't size tracker state (%s)\n", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    void *mapped = mmap(
+        NULL, sizeof(struct state_file), PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, 0
+    );
+    /* The mapping keeps the file open */
+    close(fd);
+
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "couldn't map tracker state (%s)\n", strerror(errno));
+        return -1;
+    }
+
+    state = mapped;
+    state_file_read_boot_id();
+    state_file_restore();
+    saved_generation = tracker_get_status_generation();
+
+    return 0;
+}
+
+/**
+ * Call this after anything that could change the tracker's status. Writes a
+ * new snapshot over the older of the two slots if anything has changed.
+ **/
+void state_file_save(void)
+{
+    if (state == NULL || \
+            tracker_get_status_generation() == saved_generation
+    ) {
+        return;
+    }
+
+    uint64_t sequence = last_sequence + 1;
+    struct state_file_slot *slot = &(state->slots[sequence % 2]);
+    int count = tracker_count_periods();
+
+    /* Configs with more periods than this are rejected by the tracker */
+    if (count > STATE_FILE_MAX_PERIODS) {
+        count = STATE_FILE_MAX_PERIODS;
+    }
+
+    /* Invalidate the slot first, in case we don't make it to the end */
+    slot->magic = 0;
+
+    memset(slot->periods, 0, sizeof(slot->periods));
+    for (int i = 0; i < count; i++) {
+        strncpy(
+            slot->periods[i].name,
+            tracker_get_period_name(i),
+            STATE_FILE_NAME_LENGTH - 1
+        );
+        slot->periods[i].active_seconds = tracker_get_period_active_seconds(i);
+    }
+
+    slot->version = STATE_FILE_VERSION;
+    slot->period_count = count;
+    slot->sequence = sequence;
+    slot->boottime_ns = state_file_clock_ns(CLOCK_BOOTTIME);
+    slot->realtime_ns = state_file_clock_ns(CLOCK_REALTIME);
+    memcpy(slot->boot_id, boot_id, STATE_FILE_BOOT_ID_LENGTH);
+    slot->magic = STATE_FILE_MAGIC;
+    slot->checksum = state_file_checksum(slot);
+
+    last_sequence = sequence;
+    saved_generation = tracker_get_status_generation();
+}
+
+/**
+ * Call this before shutting down, to take a final snapshot and make sure it
+ * reaches the disk
+ **/
+void state_file_cleanup(void)
+{
+    if (state == NULL) {
+        return;
+    }
+
+    state_file_save();
+    msync(state, sizeof(struct state_file), MS_SYNC);
+    munmap(state, sizeof(struct state_file));
+    state = NULL;
+}
@@ -0,0 +1,192 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * Publishes the status of each tracking period into a shared memory page, for
+ * clients that want to check it very often (e.g. a status bar redrawing at
+ * 60Hz) without a round trip through the query socket.
+ **/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "paths.h"
+#include "safety-tracker.h"
+#include "status-page.h"
+
+/**
+ * e.g. /run/user/1000/norsi/status.shm
+ **/
+static char status_page_path[PATH_MAX] = {0};
+
+/**
+ * The mapped page (NULL until initialized)
+ **/
+static struct status_page *page = NULL;
+
+/**
+ * The tracker status generation that was last published
+ **/
+static unsigned long published_generation = 0;
+
+/**
+ * Copy the tracker's current status into the page
+ **/
+static void status_page_write(void)
+{
+    uint32_t sequence = page->sequence;
+    int count = tracker_count_periods();
+
+    /* Configs with more periods than this are rejected by the tracker */
+    if (count > STATUS_PAGE_MAX_PERIODS) {
+        count = STATUS_PAGE_MAX_PERIODS;
+    }
+
+    /* Readers will retry while the sequence is odd */
+    __atomic_store_n(&(page->sequence), sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (int i = 0; i < count; i++) {
+        struct status_page_period *period = &(page->periods[i]);
+
+        strncpy(
+            period->name,
+            tracker_get_period_name(i),
+            STATUS_PAGE_NAME_LENGTH - 1
+        );
+        period->name[STATUS_PAGE_NAME_LENGTH - 1] = '\0';
+        period->active_seconds = tracker_get_period_active_seconds(i);
+        period->limit_seconds = tracker_get_period_limit_seconds(i);
+        period->safe = tracker_is_period_safe(i);
+    }
+    page->period_count = count;
+    page->generation = tracker_get_status_generation();
+
+    __atomic_store_n(&(page->sequence), sequence + 2, __ATOMIC_RELEASE);
+
+    published_generation = tracker_get_status_generation();
+}
+
+/**
+ * Call this once at start-up, after the runtime folder has been created (i.e.
+ * after `query_handler_init_server`)
+ *
+ * Returns 0 on success, -1 otherwise
+ **/
+int status_page_init(void)
+{
+    char temp_path[PATH_MAX];
+    const char *folder = paths_get_runtime_folder();
+
+    if (folder == NULL || \
+            paths_join(status_page_path, PATH_MAX, folder, "status.shm") || \
+            paths_join(temp_path, PATH_MAX, folder, "status.shm.new")
+    ) {
+        fprintf(stderr, "no path for status page\n");
+        status_page_path[0] = '\0';
+        return -1;
+    }
+
+    /**
+     * Set the page up under a temporary name, so that readers never see a
+     * partially initialized page
+     **/
+    int fd = open(temp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+
+    if (fd == -1) {
+        fprintf(
+            stderr, "couldn't create %s (%s)\n", temp_path, strerror(errno)
+        );
+        return -1;
+    }
+
+    if (ftruncate(fd, sizeof(struct status_page)) == -1) {
+        fprintf(
+            stderr, "couldn't size status page (%s)\n", strerror(errno)
+        );
+        close(fd);
+        unlink(temp_path);
+        return -1;
+    }
+
+    void *mapped = mmap(
+        NULL, sizeof(struct status_page), PROT_READ | PROT_WRITE, MAP_SHARED,
+        fd, 0
+    );
+    /* The mapping keeps the file alive */
+    close(fd);
+
+    if (mapped == MAP_FAILED) {
+        fprintf(stderr, "couldn't map status page (%s)\n", strerror(errno));
+        unlink(temp_path);
+        return -1;
+    }
+
+    page = mapped;
+    page->magic = STATUS_PAGE_MAGIC;
+    page->version = STATUS_PAGE_VERSION;
+    status_page_write();
+
+    if (rename(temp_path, status_page_path) == -1) {
+        fprintf(
+            stderr, "couldn't publish status page (%s)\n", strerror(errno)
+        );
+        status_page_cleanup();
+        unlink(temp_path);
+        return -1;
+    }
+
+    return 0;
+}
+
+/**
+ * Call this after anything that could change the tracker's status, so that
+ * the page stays current. Does nothing if the status hasn't changed.
+ **/
+void status_page_publish(void)
+{
+    if (page == NULL || \
+            tracker_get_status_generation() == published_generation
+    ) {
+        return;
+    }
+
+    status_page_write();
+}
+
+/**
+ * Call this before shutting down, before the runtime folder is removed (i.e.
+ * before `query_handler_cleanup`)
+ **/
+void status_page_cleanup(void)
+{
+    if (page != NULL) {
+        munmap(page, sizeof(struct status_page));
+        page = NULL;
+    }
+
+    if (status_page_path[0] != '\0') {
+        unlink(status_page_path);
+        status_page_path[0] = '\0';
+    }
+}
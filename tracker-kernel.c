@@ -0,0 +1,461 @@
+/**
+ * Copyright © 2020 John Ferguson <src@jferg.net>
+ *
+ * This file is part of noRSI.
+ *
+ * noRSI is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+ *
+ * noRSI is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * noRSI.  If not, see <https://www.gnu.org/licenses/>.
+ **/
+
+/**
+ * The loops which apply an update to every tracking period at once. Each comes
+ * in a plain C version, plus SSE2 and AVX2 versions on x86 which are picked at
+ * runtime when the CPU supports them.
+ *
+ * Every version does the same thing to each period, without branching:
+ *
+ * - idle: the accumulator is cleared if the idle time is beyond the period's
+ *   break, or beyond its reset while still within its limit
+ * - active: the active time is added to the accumulator (and the caller is
+ *   told if that took it beyond the period's limit)
+ **/
+
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define TRACKER_KERNEL_X86 1
+#else
+#define TRACKER_KERNEL_X86 0
+#endif
+
+#include "tracker-kernel.h"
+
+/**
+ * One implementation of the update loops
+ **/
+struct tracker_kernel {
+    /* e.g. "avx2" */
+    const char *name;
+    /* Non-zero if this CPU can run it */
+    int (*supported)(void);
+    int (*idle)(const struct tracker_kernel_periods *periods, int64_t idle_ns);
+    int (*active)(const struct tracker_kernel_periods *periods,
+        int64_t active_ns);
+};
+
+/**
+ * Apply idle time to periods `start` onwards, one at a time
+ *
+ * Returns non-zero if any accumulator was cleared
+ **/
+static int tracker_kernel_idle_from(
+    const struct tracker_kernel_periods *periods, int start, int64_t idle_ns
+) {
+    const int64_t *limit_ns = periods->limit_ns;
+    const int64_t *reset_ns = periods->reset_ns;
+    const int64_t *break_ns = periods->break_ns;
+    int64_t *active_ns = periods->active_ns;
+    int changed = 0;
+
+    for (int i = start; i < periods->count; i++) {
+        int64_t active = active_ns[i];
+        /**
+         * A reset is only warranted before the limit is reached (makes more
+         * sense for small intervals)
+         **/
+        int reset = (active < limit_ns[i]) & \
+            (reset_ns[i] > 0) & \
+            (idle_ns > reset_ns[i]);
+        /**
+         * Whether beyond the period's limit or not, once the elapsed idle time
+         * is greater than any break needed the accumulator for active time can
+         * be reset
+         **/
+        int clear = reset | (idle_ns > break_ns[i]);
+
+        /* It's only a change if there was some activity to clear */
+        changed |= clear & (active > 0);
+        active_ns[i] = clear ? 0 : active;
+    }
+
+    return changed;
+}
+
+/**
+ * Apply active time to periods `start` onwards, one at a time
+ *
+ * Returns non-zero if any period went beyond its limit
+ **/
+static int tracker_kernel_active_from(
+    const struct tracker_kernel_periods *periods, int start, int64_t active_ns
+) {
+    const int64_t *limit_ns = periods->limit_ns;
+    int64_t *accumulators = periods->active_ns;
+    int crossed = 0;
+
+    for (int i = start; i < periods->count; i++) {
+        int64_t before = accumulators[i];
+
+        accumulators[i] = before + active_ns;
+        crossed |= (before <= limit_ns[i]) & (before + active_ns > limit_ns[i]);
+    }
+
+    return crossed;
+}
+
+static int tracker_kernel_scalar_supported(void)
+{
+    return 1;
+}
+
+static int tracker_kernel_scalar_idle(
+    const struct tracker_kernel_periods *periods, int64_t idle_ns
+) {
+    return tracker_kernel_idle_from(periods, 0, idle_ns);
+}
+
+static int tracker_kernel_scalar_active(
+    const struct tracker_kernel_periods *periods, int64_t active_ns
+) {
+    return tracker_kernel_active_from(periods, 0, active_ns);
+}
+
+#if TRACKER_KERNEL_X86
+
+/**
+ * Times handed to the SSE2 version have to be within this much either way
+ * (about 146 years), so that the difference of any two fits in 64 bits
+ **/
+#define TRACKER_KERNEL_SSE2_RANGE_NS (1LL << 62)
+
+static int tracker_kernel_sse2_supported(void)
+{
+#if defined(__x86_64__)
+    /* Every x86-64 CPU has SSE2 */
+    return 1;
+#else
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+/**
+ * `a > b` for each 64-bit half, in its top bit (SSE2 can only compare 32 bits
+ * at a time). This is the sign of `b - a`, which can't overflow while the
+ * times are within TRACKER_KERNEL_SSE2_RANGE_NS. The other bits are junk, but
+ * since results are only combined with bitwise operations, turning them into
+ * full masks (with `tracker_kernel_sse2_mask`) is left until one is needed.
+ **/
+__attribute__((target("sse2")))
+static inline __m128i tracker_kernel_sse2_cmpgt(__m128i a, __m128i b)
+{
+    return _mm_sub_epi64(b, a);
+}
+
+/**
+ * Spread the top bit of each 64-bit half over the whole half
+ **/
+__attribute__((target("sse2")))
+static inline __m128i tracker_kernel_sse2_mask(__m128i gt)
+{
+    return _mm_shuffle_epi32(_mm_srai_epi32(gt, 31), _MM_SHUFFLE(3, 3, 1, 1));
+}
+
+/**
+ * The idle update, 2 periods at a time
+ **/
+__attribute__((target("sse2")))
+static int tracker_kernel_sse2_idle(
+    const struct tracker_kernel_periods *periods, int64_t idle_ns
+) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i idle = _mm_set1_epi64x(idle_ns);
+    __m128i changed = zero;
+    int i = 0;
+
+    if (idle_ns <= -TRACKER_KERNEL_SSE2_RANGE_NS || \
+            idle_ns >= TRACKER_KERNEL_SSE2_RANGE_NS
+    ) {
+        return tracker_kernel_idle_from(periods, 0, idle_ns);
+    }
+
+    for (; i + 2 <= periods->count; i += 2) {
+        __m128i active = _mm_loadu_si128(
+            (const __m128i *)&(periods->active_ns[i])
+        );
+        __m128i limit = _mm_loadu_si128(
+            (const __m128i *)&(periods->limit_ns[i])
+        );
+        __m128i reset = _mm_loadu_si128(
+            (const __m128i *)&(periods->reset_ns[i])
+        );
+        __m128i brk = _mm_loadu_si128(
+            (const __m128i *)&(periods->break_ns[i])
+        );
+
+        __m128i do_reset = _mm_and_si128(
+            _mm_and_si128(
+                tracker_kernel_sse2_cmpgt(limit, active),
+                tracker_kernel_sse2_cmpgt(reset, zero)
+            ),
+            tracker_kernel_sse2_cmpgt(idle, reset)
+        );
+        __m128i clear = _mm_or_si128(
+            do_reset, tracker_kernel_sse2_cmpgt(idle, brk)
+        );
+
+        changed = _mm_or_si128(
+            changed,
+            _mm_and_si128(clear, tracker_kernel_sse2_cmpgt(active, zero))
+        );
+        _mm_storeu_si128(
+            (__m128i *)&(periods->active_ns[i]),
+            _mm_andnot_si128(tracker_kernel_sse2_mask(clear), active)
+        );
+    }
+
+    /* The answers are in the top bit of each half */
+    return _mm_movemask_pd(_mm_castsi128_pd(changed)) | \
+        tracker_kernel_idle_from(periods, i, idle_ns);
+}
+
+/**
+ * The active update, 2 periods at a time
+ **/
+__attribute__((target("sse2")))
+static int tracker_kernel_sse2_active(
+    const struct tracker_kernel_periods *periods, int64_t active_ns
+) {
+    const __m128i add = _mm_set1_epi64x(active_ns);
+    __m128i crossed = _mm_setzero_si128();
+    int i = 0;
+
+    if (active_ns <= -TRACKER_KERNEL_SSE2_RANGE_NS || \
+            active_ns >= TRACKER_KERNEL_SSE2_RANGE_NS
+    ) {
+        return tracker_kernel_active_from(periods, 0, active_ns);
+    }
+
+    for (; i + 2 <= periods->count; i += 2) {
+        __m128i *accumulators = (__m128i *)&(periods->active_ns[i]);
+        __m128i limit = _mm_loadu_si128(
+            (const __m128i *)&(periods->limit_ns[i])
+        );
+        __m128i before = _mm_loadu_si128(accumulators);
+        __m128i after = _mm_add_epi64(before, add);
+
+        crossed = _mm_or_si128(crossed, _mm_andnot_si128(
+            tracker_kernel_sse2_cmpgt(before, limit),
+            tracker_kernel_sse2_cmpgt(after, limit)
+        ));
+        _mm_storeu_si128(accumulators, after);
+    }
+
+    /* The answers are in the top bit of each half */
+    return _mm_movemask_pd(_mm_castsi128_pd(crossed)) | \
+        tracker_kernel_active_from(periods, i, active_ns);
+}
+
+static int tracker_kernel_avx2_supported(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+/**
+ * The idle update, 4 periods at a time
+ **/
+__attribute__((target("avx2")))
+static int tracker_kernel_avx2_idle(
+    const struct tracker_kernel_periods *periods, int64_t idle_ns
+) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i idle = _mm256_set1_epi64x(idle_ns);
+    __m256i changed = zero;
+    int i = 0;
+
+    for (; i + 4 <= periods->count; i += 4) {
+        __m256i active = _mm256_loadu_si256(
+            (const __m256i *)&(periods->active_ns[i])
+        );
+        __m256i limit = _mm256_loadu_si256(
+            (const __m256i *)&(periods->limit_ns[i])
+        );
+        __m256i reset = _mm256_loadu_si256(
+            (const __m256i *)&(periods->reset_ns[i])
+        );
+        __m256i brk = _mm256_loadu_si256(
+            (const __m256i *)&(periods->break_ns[i])
+        );
+
+        __m256i do_reset = _mm256_and_si256(
+            _mm256_and_si256(
+                _mm256_cmpgt_epi64(limit, active),
+                _mm256_cmpgt_epi64(reset, zero)
+            ),
+            _mm256_cmpgt_epi64(idle, reset)
+        );
+        __m256i clear = _mm256_or_si256(
+            do_reset, _mm256_cmpgt_epi64(idle, brk)
+        );
+
+        changed = _mm256_or_si256(
+            changed,
+            _mm256_and_si256(clear, _mm256_cmpgt_epi64(active, zero))
+        );
+        _mm256_storeu_si256(
+            (__m256i *)&(periods->active_ns[i]),
+            _mm256_andnot_si256(clear, active)
+        );
+    }
+
+    return _mm256_movemask_epi8(changed) | \
+        tracker_kernel_idle_from(periods, i, idle_ns);
+}
+
+/**
+ * The active update, 4 periods at a time
+ **/
+__attribute__((target("avx2")))
+static int tracker_kernel_avx2_active(
+    const struct tracker_kernel_periods *periods, int64_t active_ns
+) {
+    const __m256i add = _mm256_set1_epi64x(active_ns);
+    __m256i crossed = _mm256_setzero_si256();
+    int i = 0;
+
+    for (; i + 4 <= periods->count; i += 4) {
+        __m256i *accumulators = (__m256i *)&(periods->active_ns[i]);
+        __m256i limit = _mm256_loadu_si256(
+            (const __m256i *)&(periods->limit_ns[i])
+        );
+        __m256i before = _mm256_loadu_si256(accumulators);
+        __m256i after = _mm256_add_epi64(before, add);
+
+        crossed = _mm256_or_si256(crossed, _mm256_andnot_si256(
+            _mm256_cmpgt_epi64(before, limit),
+            _mm256_cmpgt_epi64(after, limit)
+        ));
+        _mm256_storeu_si256(accumulators, after);
+    }
+
+    return _mm256_movemask_epi8(crossed) | \
+        tracker_kernel_active_from(periods, i, active_ns);
+}
+
+#endif
+
+/**
+ * Every implementation, best first
+ **/
+static const struct tracker_kernel kernels[] = {
+#if TRACKER_KERNEL_X86
+    {
+        .name = "avx2",
+        .supported = tracker_kernel_avx2_supported,
+        .idle = tracker_kernel_avx2_idle,
+        .active = tracker_kernel_avx2_active,
+    },
+    {
+        .name = "sse2",
+        .supported = tracker_kernel_sse2_supported,
+        .idle = tracker_kernel_sse2_idle,
+        .active = tracker_kernel_sse2_active,
+    },
+#endif
+    {
+        .name = "scalar",
+        .supported = tracker_kernel_scalar_supported,
+        .idle = tracker_kernel_scalar_idle,
+        .active = tracker_kernel_scalar_active,
+    },
+};
+
+#define TRACKER_KERNEL_COUNT (sizeof(kernels)/sizeof(kernels[0]))
+
+/**
+ * The implementation in use (plain C until one is selected)
+ **/
+static const struct tracker_kernel *selected = \
+    &(kernels[TRACKER_KERNEL_COUNT - 1]);
+
+/**
+ * Pick which implementation of the update loops to use: the one called `name`,
+ * or the best this CPU supports if `name` is NULL.
+ *
+ * Returns 0 on success, -1 if there's no such implementation or this CPU can't
+ * run it
+ **/
+int tracker_kernel_select(const char *name)
+{
+    for (size_t i = 0; i < TRACKER_KERNEL_COUNT; i++) {
+        if (name != NULL && strcmp(kernels[i].name, name) != 0) {
+            continue;
+        }
+        if (!kernels[i].supported()) {
+            if (name != NULL) {
+                return -1;
+            }
+            continue;
+        }
+
+        selected = &(kernels[i]);
+        return 0;
+    }
+
+    return -1;
+}
+
+/**
+ * Get the name of the implementation in use (e.g. "avx2")
+ **/
+const char *tracker_kernel_name(void)
+{
+    return selected->name;
+}
+
+/**
+ * Get the name of the `index`th implementation (best first), so callers can
+ * try each of them
+ *
+ * Returns NULL once `index` is past the last one
+ **/
+const char *tracker_kernel_list(int index)
+{
+    if (index < 0 || (size_t)index >= TRACKER_KERNEL_COUNT) {
+        return NULL;
+    }
+
+    return kernels[index].name;
+}
+
+/**
+ * Apply a stretch of idle time (in nanoseconds) to every period
+ *
+ * Returns non-zero if any accumulator was cleared
+ **/
+int tracker_kernel_idle(
+    const struct tracker_kernel_periods *periods, int64_t idle_ns
+) {
+    return selected->idle(periods, idle_ns);
+}
+
+/**
+ * Add a stretch of active time (in nanoseconds) to every period
+ *
+ * Returns non-zero if any period went beyond its limit
+ **/
+int tracker_kernel_active(
+    const struct tracker_kernel_periods *periods, int64_t active_ns
+) {
+    return selected->active(periods, active_ns);
+}